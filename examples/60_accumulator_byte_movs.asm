@@ -0,0 +1,14 @@
+; Byte moves between AL/AH and a direct address (A0/A2 encodings), which always
+; carry a 16 bit address. CX must stay untouched by the byte loads.
+
+bits 16
+
+mov cx, 0x1111
+mov word [1000], 0x2233
+mov al, [1000]
+mov [1002], al
+mov ah, [1001]
+mov [1003], ah
+mov bx, [1002]
+mov dx, [1000]
+add al, 1
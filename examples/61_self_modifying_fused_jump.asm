@@ -0,0 +1,25 @@
+; Code after a fused compare and jump gets rewritten while the program runs. The first time around
+; the jump is taken and its fall-through, "cmp ax, ax", is never executed. Both successors overwrite the
+; flags, so the threaded engine can skip storing them for the fused pair. Once the fall-through is patched
+; into "je good", the second pass needs the flags of "cmp di, 2" again.
+; DX ends as 0x600d if they are there and 0x0bad if a stale zero flag was read.
+
+bits 16
+
+mov dx, 0x600d
+mov di, 0
+top:
+add di, 1
+cmp di, 2
+jne first
+patch:
+cmp ax, ax
+mov dx, 0x0bad
+cmp di, 2
+je good
+first:
+cmp ax, ax
+mov word [patch], 0x74 + (good - patch - 2) * 256
+cmp di, 1
+je top
+good:
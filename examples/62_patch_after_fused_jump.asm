@@ -0,0 +1,19 @@
+; A fused compare and jump is followed by a MOV that rewrites the code after it. Before the patch both
+; successors of "jne skip" overwrite the flags, but the MOV turns "cmp ax, ax" into "je good", which reads
+; the flags of "cmp bx, 1". So the threaded engine can't treat them as dead past a write to memory.
+; DX ends as 0x600d if the flags are there and 0x0bad if a stale zero flag was read.
+
+bits 16
+
+mov dx, 0x600d
+mov bx, 1
+cmp bx, 0
+cmp bx, 1
+jne skip
+mov word [patch], 0x74 + (good - patch - 2) * 256
+patch:
+cmp ax, ax
+mov dx, 0x0bad
+skip:
+cmp ax, ax
+good:
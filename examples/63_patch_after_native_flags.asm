@@ -0,0 +1,15 @@
+; The JIT only stores the flags of the last flag setting instruction in a block, but a block that patches
+; itself is left right after the write to memory. "cmp bx, 1" is not the last flag setter of its block,
+; so its flags must still be stored when the block is left early, as the patched "je good" reads them.
+; DX ends as 0x600d if the flags are there and 0x0bad if a stale zero flag was read.
+
+bits 16
+
+mov dx, 0x600d
+mov bx, 1
+cmp bx, 1
+mov word [patch], 0x74 + (good - patch - 2) * 256
+patch:
+cmp ax, ax
+mov dx, 0x0bad
+good:
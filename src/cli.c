@@ -1,16 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 #include "os.h"
 #include "sim8086/prelude.h"
+#include "os.c"
 
 // TODO: refactor cli commands, there is a lot of repeating code for reading assemblies and compiling them.
 
 #define strequal(a, b) strcmp(a, b) == 0
 
+enum sim_engine {
+	SIM_ENGINE_SWITCH,   // decode_instruction + execute_instruction every step
+	SIM_ENGINE_THREADED, // see "sim8086/threaded.c"
+	SIM_ENGINE_JIT,      // see "sim8086/jit.c"
+};
+
+#define MAX_LOAD_IMAGES 16 // See `load_images`
+
+struct sim_options {
+	enum sim_engine engine;
+	bool verify; // Only used by SIM_ENGINE_JIT, compares every block against the interpreter
+
+	// Only used by SIM_ENGINE_SWITCH, runs with an undo journal (see "sim8086/journal.c") and goes back after finishing
+	u32 journal_size;
+	uint64_t back_steps;
+	int back_to_write; // Address, or -1
+
+	bool sparse_dump; // Only used by sim-dump, see `write_sparse_dump`
+
+	const char *trace_path; // Only used by SIM_ENGINE_SWITCH, see "sim8086/trace.c"
+
+	// Extra files loaded after the program, with "--load <file>@<address>"
+	u32 image_count;
+	const char *image_paths[MAX_LOAD_IMAGES-1];
+	u16 image_starts[MAX_LOAD_IMAGES-1];
+};
+
+// Parses "8086" or "8088"
+int parse_cpu_model(const char *name, enum cpu_model *model) {
+	if (strequal(name, "8086")) {
+		*model = CPU_8086;
+	} else if (strequal(name, "8088")) {
+		*model = CPU_8088;
+	} else {
+		fprintf(stderr, "ERROR: Unknown CPU '%s', expected 8086 or 8088\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+#define JOURNAL_DEFAULT_SIZE (1 << 20)
+#define JOURNAL_CHECKPOINT_COUNT 16
+#define JOURNAL_CHECKPOINT_INTERVAL 100000
+
 const char *get_tmp_dir() {
 #ifdef IS_WINDOWS
 	char *dir;
@@ -18,7 +68,7 @@ const char *get_tmp_dir() {
     if ((dir = getenv("TEMP"))   != NULL) return dir;
     if ((dir = getenv("TMP"))    != NULL) return dir;
 	return NULL;
-#elif IS_LINUX
+#elif defined(IS_LINUX)
 	return "/tmp";
 #endif
 }
@@ -43,110 +93,560 @@ char *strdup(const char *src) {
 
 void get_tmp_file(char *filename, const char *prefix) {
 	const char *dir = get_tmp_dir();
+#ifdef IS_WINDOWS
 	sprintf(filename, "%s\\%sXXXXXX", dir, prefix);
+#else
+	sprintf(filename, "%s/%sXXXXXX", dir, prefix);
+#endif
 	int fd = mkstemp(filename);
 	close(fd);
 }
 
 int compile_asm(const char *src, const char *dst) {
 	char command[512] = { 0 };
-	snprintf(command, sizeof(command), "nasm \"%s\" -O0 -o \"%s\"", src, dst);
+	snprintf(command, sizeof(command), "nasm \"%s\" -o \"%s\"", src, dst);
 	return system(command);
 }
 
-int compare_files(const char *expected, const char *gotten) {
-	int rc = -1;
-	FILE *f1 = fopen(expected, "r");
-	FILE *f2 = fopen(gotten, "r");
-
-	int i = 0;
-	while (!feof(f1) && !feof(f2)) {
-		int byte1 = fgetc(f1);
-		int byte2 = fgetc(f2);
-		if (byte1 != byte2) {
-			printf("Mismatch byte at %d, expected %d got %d\n", i, byte1, byte2);
-			goto err;
+int compare_bytes(const u8 *expected, u32 expected_size, const u8 *gotten, u32 gotten_size) {
+	u32 size = expected_size < gotten_size ? expected_size : gotten_size;
+	for (u32 i = 0; i < size; i++) {
+		if (expected[i] != gotten[i]) {
+			printf("Mismatch byte at %d, expected %d got %d\n", i, expected[i], gotten[i]);
+			return -1;
 		}
-		i++;
 	}
 
-	if (!feof(f1) || !feof(f2)) {
-		goto err;
+	if (expected_size != gotten_size) {
+		printf("Mismatch size, expected %d got %d\n", expected_size, gotten_size);
+		return -1;
 	}
-
-	rc = 0;
-err:
-	fclose(f1);
-	fclose(f2);
-	return rc;
+	return 0;
 }
 
-int dissassemble(FILE *src, FILE *dst) {
-    fprintf(dst, "bits 16\n\n");
+// Assembles source that is already in memory, `path` is only used for errors.
+// Returns the size of the program, or -1 on failure.
+int assemble_source(const char *path, const u8 *source, size_t source_size, u8 *output, u32 max_size) {
+	struct assemble_result result = assemble((const char *)source, source_size, output, max_size);
+	if (result.err != ASSEMBLE_OK) {
+		fprintf(stderr, "ERROR: %s:%d: %s\n", path, result.line, assemble_error_to_str(result.err));
+		return -1;
+	}
+	return result.size;
+}
 
-	struct memory mem = { 0 };
-	int byte_count = load_mem_from_stream(&mem, src, 0);
-	if (byte_count == -1) {
-		fprintf(stderr, "ERROR: Failed to load file to memory\n");
+// Assembles a file with the built-in assembler, see "sim8086/assembler.c".
+// Returns the size of the program, or -1 on failure.
+int assemble_file(const char *path, u8 *output, u32 max_size) {
+	struct mapped_file file;
+	if (map_file(path, &file)) {
+		fprintf(stderr, "ERROR: Opening file '%s': %d\n", path, errno);
 		return -1;
 	}
 
+	int size = assemble_source(path, file.data, file.size, output, max_size);
+	unmap_file(&file);
+	return size;
+}
+
+int dissassemble(const u8 *data, size_t size, FILE *dst) {
+    fprintf(dst, "bits 16\n\n");
+
     char buff[256];
     struct instruction inst;
-	u16 inst_address = 0;
-    while (inst_address < byte_count) {
-        enum decode_error err = decode_instruction(&mem, &inst_address, &inst);
+	size_t inst_offset = 0;
+    while (inst_offset < size) {
+        enum decode_error err = decode_instruction_from_span(data, size, &inst_offset, &inst);
         if (err == DECODE_ERR_EOF) break;
         if (err != DECODE_OK) {
-            fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", inst_address, decode_error_to_str(err));
+            fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08zx: %s\n", inst_offset, decode_error_to_str(err));
             return -1;
         }
 
         instruction_to_str(buff, sizeof(buff), &inst);
-        fprintf(dst, "%s\b", buff);
+        fprintf(dst, "%s\n", buff);
     }
 
     return 0;
 }
 
-int simulate(FILE *src, struct memory *mem) {
-	int byte_count = load_mem_from_stream(mem, src, 0);
-	if (byte_count == -1) {
-		fprintf(stderr, "ERROR: Failed to load file to memory\n");
+// Same as `dissassemble`, but into a buffer. Returns the length of the text, or -1 if it didn't decode or fit.
+int dissassemble_to_buffer(const u8 *data, size_t size, char *dst, size_t max_size) {
+	size_t len = snprintf(dst, max_size, "bits 16\n\n");
+
+	struct instruction inst;
+	size_t inst_offset = 0;
+	while (inst_offset < size && len < max_size) {
+		enum decode_error err = decode_instruction_from_span(data, size, &inst_offset, &inst);
+		if (err == DECODE_ERR_EOF) break;
+		if (err != DECODE_OK) return -1;
+
+		instruction_to_str(dst + len, max_size - len, &inst);
+		len += strlen(dst + len);
+		if (len + 1 < max_size) dst[len++] = '\n';
+	}
+
+	return len + 1 < max_size ? (int)len : -1;
+}
+
+int dissassemble_file(const char *filename, FILE *dst) {
+	struct mapped_file file;
+	if (map_file(filename, &file)) {
+		printf("ERROR: Opening file '%s': %d\n", filename, errno);
+		return -1;
+	}
+
+	int rc = dissassemble(file.data, file.size, dst);
+	unmap_file(&file);
+	return rc;
+}
+
+// Same path with the extension replaced by ".s86"
+void get_precompiled_path(char *precompiled_path, size_t max_size, const char *path) {
+	const char *extension = strrchr(path, '.');
+	const char *separator = strrchr(path, '/');
+	if (separator == NULL) separator = strrchr(path, '\\');
+	size_t base_size = strlen(path);
+	if (extension && (separator == NULL || extension > separator)) base_size = extension - path;
+	snprintf(precompiled_path, max_size, "%.*s.s86", (int)base_size, path);
+}
+
+// Opens the ".s86" file next to `path` (see `get_precompiled_path`) if it was made from `source`.
+// `file` is left mapped on success.
+bool open_fresh_precompiled(const char *path, struct mapped_file *source, struct mapped_file *file, struct precompiled *precompiled) {
+	char precompiled_path[MAX_PATH_SIZE];
+	get_precompiled_path(precompiled_path, sizeof(precompiled_path), path);
+	if (map_file(precompiled_path, file)) return false;
+
+	if (!open_precompiled(precompiled, file->data, file->size)) {
+		fprintf(stderr, "WARNING: Ignoring invalid precompiled program '%s'\n", precompiled_path);
+	} else if (precompiled->source_hash != hash_precompiled_bytes(source->data, source->size)) {
+		fprintf(stderr, "WARNING: Ignoring stale precompiled program '%s', '%s' changed since\n", precompiled_path, path);
+	} else {
+		return true;
+	}
+	unmap_file(file);
+	return false;
+}
+
+// Loads several files into memory in one go, ".asm" files are assembled first.
+// ".s86" files and fresh ".s86" files next to the given ones are loaded without assembling, and if `mem->decode_cache`
+// is set it gets filled from them, see "sim8086/precompiled.c".
+// Every file is mapped and checked before anything is copied, see `load_mem_segments`.
+// If `sizes` is not NULL, the size of each file is written to it.
+// Returns the end of the highest image, or -1 on failure.
+int load_images(struct memory *mem, const char **paths, const u16 *starts, u32 count, u32 *sizes) {
+	assert(count <= MAX_LOAD_IMAGES);
+	struct mapped_file files[MAX_LOAD_IMAGES] = { 0 };
+	struct mapped_file precompiled_files[MAX_LOAD_IMAGES] = { 0 };
+	struct precompiled precompiled[MAX_LOAD_IMAGES];
+	bool is_precompiled[MAX_LOAD_IMAGES] = { 0 };
+	u8 *assembled[MAX_LOAD_IMAGES] = { 0 };
+	struct memory_segment segments[MAX_LOAD_IMAGES] = { 0 };
+
+	int rc = 0;
+	for (u32 i = 0; i < count; i++) {
+		if (map_file(paths[i], &files[i])) {
+			rc = -1;
+			break;
+		}
+
+		u32 size;
+		if (strendswith(paths[i], ".s86")) {
+			if (!open_precompiled(&precompiled[i], files[i].data, files[i].size)) {
+				fprintf(stderr, "ERROR: '%s' is not a valid precompiled program\n", paths[i]);
+				rc = -1;
+				break;
+			}
+			is_precompiled[i] = true;
+		} else {
+			is_precompiled[i] = open_fresh_precompiled(paths[i], &files[i], &precompiled_files[i], &precompiled[i]);
+		}
+
+		if (is_precompiled[i]) {
+			segments[i].data = precompiled[i].image;
+			size = precompiled[i].image_size;
+		} else if (strendswith(paths[i], ".asm")) {
+			assembled[i] = malloc(MEMORY_SIZE);
+			int assembled_size = assembled[i] ? assemble_source(paths[i], files[i].data, files[i].size, assembled[i], MEMORY_SIZE - starts[i]) : -1;
+			if (assembled_size == -1) {
+				rc = -1;
+				break;
+			}
+			segments[i].data = assembled[i];
+			size = assembled_size;
+		} else {
+			segments[i].data = files[i].data;
+			size = files[i].size > MEMORY_SIZE ? MEMORY_SIZE + 1 : files[i].size;
+		}
+
+		segments[i].size = size;
+		segments[i].start = starts[i];
+		if (sizes) sizes[i] = size;
+	}
+
+	if (rc == 0) {
+		rc = load_mem_segments(mem, segments, count);
+	}
+	if (rc != -1 && mem->decode_cache) {
+		for (u32 i = 0; i < count; i++) {
+			if (is_precompiled[i]) prefill_decode_cache(mem->decode_cache, &precompiled[i], starts[i]);
+		}
+	}
+
+	for (u32 i = 0; i < count; i++) {
+		unmap_file(&files[i]);
+		unmap_file(&precompiled_files[i]);
+		free(assembled[i]);
+	}
+	return rc;
+}
+
+// Loads a program into memory at 0, see `load_images`.
+// Returns the size of the program, or -1 on failure.
+int load_program(struct memory *mem, const char *path) {
+	u16 start = 0;
+	return load_images(mem, &path, &start, 1, NULL);
+}
+
+// Trace records are encoded by the simulator into `block`, full blocks are pushed into a lock-free single-producer
+// single-consumer ring which a background thread drains into the file in large writes.
+// `head` and `tail` are only touched with atomics, the lock and condition variables are only used to park a side
+// which has nothing to do: the writer thread until at least `TRACE_WRITE_SIZE` bytes are waiting or the trace is
+// finished, and the simulator while the ring is full. The other side only takes the lock if it sees one parked.
+#define TRACE_RING_SIZE (8 << 20) // Must be a power of two
+#define TRACE_BLOCK_SIZE (64 << 10)
+#define TRACE_WRITE_SIZE (1 << 20)
+
+struct trace_writer {
+	FILE *file;
+	pthread_t thread;
+
+	// Bytes between `tail` and `head` belong to the writer thread
+	u8 *ring;
+	_Atomic uint64_t head; // Only written by the simulator
+	_Atomic uint64_t tail; // Only written by the writer thread
+	atomic_bool finished;
+	atomic_bool failed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t data_ready;  // Signaled if `writer_waiting` once enough bytes are waiting, or the trace is finished
+	pthread_cond_t space_ready; // Signaled if `producer_waiting` once the writer thread freed up some of the ring
+	atomic_bool writer_waiting;
+	atomic_bool producer_waiting;
+
+	u8 block[TRACE_BLOCK_SIZE];
+	u32 block_size;
+};
+
+static bool trace_writer_has_data(struct trace_writer *writer, uint64_t tail) {
+	return atomic_load(&writer->head) - tail >= TRACE_WRITE_SIZE || atomic_load(&writer->finished);
+}
+
+// Wakes up the other side if it's parked, `waiting` is its flag.
+// The flag is set before the condition is checked again under the lock, and the caller has already updated the
+// condition, so either the other side sees the update or this sees the flag.
+static void trace_writer_wake(struct trace_writer *writer, atomic_bool *waiting, pthread_cond_t *cond) {
+	if (!atomic_load(waiting)) return;
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+void *trace_writer_main(void *arg) {
+	struct trace_writer *writer = arg;
+	uint64_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+	while (true) {
+		if (!trace_writer_has_data(writer, tail)) {
+			pthread_mutex_lock(&writer->lock);
+			atomic_store(&writer->writer_waiting, true);
+			while (!trace_writer_has_data(writer, tail)) {
+				pthread_cond_wait(&writer->data_ready, &writer->lock);
+			}
+			atomic_store(&writer->writer_waiting, false);
+			pthread_mutex_unlock(&writer->lock);
+		}
+
+		uint64_t head = atomic_load_explicit(&writer->head, memory_order_acquire);
+		if (head == tail) break; // Finished and everything is written
+
+		uint64_t offset = tail % TRACE_RING_SIZE;
+		uint64_t size = head - tail;
+		if (size > TRACE_RING_SIZE - offset) size = TRACE_RING_SIZE - offset;
+		if (fwrite(writer->ring + offset, 1, size, writer->file) != size) {
+			atomic_store(&writer->failed, true);
+		}
+		tail += size;
+		atomic_store(&writer->tail, tail);
+		trace_writer_wake(writer, &writer->producer_waiting, &writer->space_ready);
+	}
+	return NULL;
+}
+
+int trace_writer_open(struct trace_writer *writer, const char *path) {
+	writer->file = fopen(path, "wb");
+	if (writer->file == NULL) return -1;
+	writer->ring = malloc(TRACE_RING_SIZE);
+	if (writer->ring == NULL) {
+		fclose(writer->file);
+		return -1;
+	}
+	atomic_init(&writer->head, 0);
+	atomic_init(&writer->tail, 0);
+	atomic_init(&writer->finished, false);
+	atomic_init(&writer->failed, false);
+	atomic_init(&writer->writer_waiting, false);
+	atomic_init(&writer->producer_waiting, false);
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->data_ready, NULL);
+	pthread_cond_init(&writer->space_ready, NULL);
+
+	write_trace_header(writer->block);
+	writer->block_size = TRACE_HEADER_SIZE;
+
+	if (pthread_create(&writer->thread, NULL, trace_writer_main, writer)) {
+		pthread_mutex_destroy(&writer->lock);
+		pthread_cond_destroy(&writer->data_ready);
+		pthread_cond_destroy(&writer->space_ready);
+		free(writer->ring);
+		fclose(writer->file);
 		return -1;
 	}
+	return 0;
+}
+
+static bool trace_writer_has_space(struct trace_writer *writer, uint64_t head) {
+	return TRACE_RING_SIZE - (head - atomic_load(&writer->tail)) >= writer->block_size;
+}
+
+static void trace_writer_push_block(struct trace_writer *writer) {
+	uint64_t head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+	if (!trace_writer_has_space(writer, head)) {
+		pthread_mutex_lock(&writer->lock);
+		atomic_store(&writer->producer_waiting, true);
+		while (!trace_writer_has_space(writer, head)) {
+			pthread_cond_wait(&writer->space_ready, &writer->lock);
+		}
+		atomic_store(&writer->producer_waiting, false);
+		pthread_mutex_unlock(&writer->lock);
+	}
+
+	uint64_t offset = head % TRACE_RING_SIZE;
+	u32 first_part = writer->block_size;
+	if (first_part > TRACE_RING_SIZE - offset) first_part = TRACE_RING_SIZE - offset;
+	memcpy(writer->ring + offset, writer->block, first_part);
+	memcpy(writer->ring, writer->block + first_part, writer->block_size - first_part);
+
+	head += writer->block_size;
+	atomic_store(&writer->head, head);
+	if (head - atomic_load(&writer->tail) >= TRACE_WRITE_SIZE) {
+		trace_writer_wake(writer, &writer->writer_waiting, &writer->data_ready);
+	}
+	writer->block_size = 0;
+}
+
+void trace_writer_append(struct trace_writer *writer, struct cpu_state *before, struct cpu_state *after, struct instruction *inst, struct memory *mem, struct write_log *log) {
+	if (writer->block_size + TRACE_MAX_RECORD_SIZE > TRACE_BLOCK_SIZE) {
+		trace_writer_push_block(writer);
+	}
+	writer->block_size += encode_trace_record(writer->block + writer->block_size, before, after, inst, mem, log);
+}
+
+// Waits until everything is written, returns -1 if any write failed
+int trace_writer_close(struct trace_writer *writer) {
+	trace_writer_push_block(writer);
+	atomic_store(&writer->finished, true);
+	trace_writer_wake(writer, &writer->writer_waiting, &writer->data_ready);
+	pthread_join(writer->thread, NULL);
+
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->data_ready);
+	pthread_cond_destroy(&writer->space_ready);
+	free(writer->ring);
+
+	int rc = atomic_load(&writer->failed) ? -1 : 0;
+	if (fclose(writer->file)) rc = -1;
+	return rc;
+}
+
+void print_registers(struct cpu_state *state) {
+	const enum reg_value print_order[] = { REG_AX, REG_BX, REG_CX, REG_DX, REG_SP, REG_BP, REG_SI, REG_DI };
+	for (int i = 0; i < ARRAY_LEN(print_order); i++) {
+		u16 value = state->regs[REG16_INDEX(print_order[i])];
+		printf("      %s: 0x%04x (%d)\n", reg_to_str(print_order[i]), value, value);
+	}
+	printf("      ip: 0x%04x (%d)\n", state->ip, state->ip);
+	char flags[16];
+	flags_to_str(flags, sizeof(flags), get_cpu_flags(state));
+	printf("   flags: %s\n", flags);
+}
+
+// Runs the program that is already loaded in `mem`, until `ip` reaches `byte_count`.
+// `mem->decode_cache` must be set.
+int simulate(struct memory *mem, u32 byte_count, struct sim_options *options) {
+	clear_dirty_pages(mem, DIRTY_DUMP);
+	struct decode_cache *cache = mem->decode_cache;
 
 	struct cpu_state state = { 0 };
-    struct instruction inst;
-    while (state.ip < byte_count) {
-        enum decode_error err = decode_instruction(mem, &state.ip, &inst);
-        if (err == DECODE_ERR_EOF) break;
-        if (err != DECODE_OK) {
-            fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
-            return -1;
-        }
-		execute_instruction(mem, &state, &inst);
-    }
+	enum sim_engine engine = options->engine;
+	struct jit *jit = NULL;
+	struct journal *journal = NULL;
+	if (engine == SIM_ENGINE_SWITCH && (options->back_steps > 0 || options->back_to_write >= 0)) {
+		journal = malloc(sizeof(struct journal));
+		if (journal == NULL || journal_init(journal, options->journal_size, JOURNAL_CHECKPOINT_COUNT, JOURNAL_CHECKPOINT_INTERVAL)) {
+			fprintf(stderr, "ERROR: Failed to allocate undo journal\n");
+			free(journal);
+			return -1;
+		}
+	}
+	if (engine == SIM_ENGINE_JIT) {
+		jit = malloc(sizeof(struct jit));
+		if (jit == NULL || jit_init(jit)) {
+			fprintf(stderr, "WARNING: JIT is not supported on this host, falling back to the threaded engine\n");
+			free(jit);
+			jit = NULL;
+			engine = SIM_ENGINE_THREADED;
+		} else if (options->verify && jit_enable_verify(jit, mem, &state)) {
+			fprintf(stderr, "ERROR: Failed to allocate memory for JIT verification\n");
+			jit_free(jit);
+			free(jit);
+			return -1;
+		}
+	}
+
+	if (engine == SIM_ENGINE_JIT) {
+		enum decode_error err = run_jit(jit, mem, &state, byte_count);
+		struct jit_stats stats = jit->stats;
+		jit_disable_verify(jit);
+		jit_free(jit);
+		free(jit);
+
+		if (err != DECODE_OK && err != DECODE_ERR_EOF) {
+			if (options->verify) {
+				fprintf(stderr, "ERROR: JIT and interpreter diverged at 0x%04x\n", state.ip);
+			} else {
+				fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+			}
+			return -1;
+		}
+
+		printf("JIT: %" PRIu64 " blocks compiled (%" PRIu64 " native / %" PRIu64 " fallback instructions), %" PRIu64 " blocks executed, %" PRIu64 " flushes\n",
+			stats.blocks_compiled, stats.native_compiled, stats.fallback_compiled, stats.blocks_executed, stats.flushes);
+		if (options->verify) {
+			printf("JIT: verified every block against the interpreter\n");
+		}
+	} else if (engine == SIM_ENGINE_THREADED) {
+		struct threaded_stats stats = { 0 };
+		enum decode_error err = run_threaded(mem, &state, byte_count, &stats);
+		if (err != DECODE_OK && err != DECODE_ERR_EOF) {
+			fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+			return -1;
+		}
+
+		for (int first = 0; first < __OP_COUNT; first++) {
+			for (int jump = 0; jump < __OP_COUNT; jump++) {
+				uint64_t count = stats.fused_pairs[first][jump];
+				if (count == 0) continue;
+				printf("Fused %s+%s: %" PRIu64 "\n", operation_to_str(first), operation_to_str(jump), count);
+			}
+		}
+	} else if (options->trace_path) {
+		struct trace_writer *writer = malloc(sizeof(struct trace_writer));
+		if (writer == NULL || trace_writer_open(writer, options->trace_path)) {
+			fprintf(stderr, "ERROR: Failed to open trace file '%s'\n", options->trace_path);
+			free(writer);
+			return -1;
+		}
+
+		struct write_log log;
+		mem->write_log = &log;
+		struct instruction inst;
+		enum decode_error err = DECODE_OK;
+		while (state.ip < byte_count) {
+			struct cpu_state before = state;
+			err = decode_instruction_cached(cache, mem, &state.ip, &inst);
+			if (err != DECODE_OK) break;
+			log.count = 0;
+			execute_instruction(mem, &state, &inst);
+			trace_writer_append(writer, &before, &state, &inst, mem, &log);
+		}
+		mem->write_log = NULL;
+
+		if (trace_writer_close(writer)) {
+			fprintf(stderr, "ERROR: Failed to write trace file '%s'\n", options->trace_path);
+			err = DECODE_ERR_EOF; // Only report the write error
+			free(writer);
+			return -1;
+		}
+		free(writer);
+
+		if (err != DECODE_OK && err != DECODE_ERR_EOF) {
+			fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+			return -1;
+		}
+	} else if (journal) {
+		struct instruction inst;
+		while (state.ip < byte_count) {
+			enum decode_error err = journal_step(journal, mem, &state, &inst);
+			if (err == DECODE_ERR_EOF) break;
+			if (err != DECODE_OK) {
+				fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+				journal_free(journal);
+				free(journal);
+				return -1;
+			}
+		}
+	} else {
+		struct instruction inst;
+		while (state.ip < byte_count) {
+			enum decode_error err = decode_instruction_cached(cache, mem, &state.ip, &inst);
+			if (err == DECODE_ERR_EOF) break;
+			if (err != DECODE_OK) {
+				fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+				return -1;
+			}
+			execute_instruction(mem, &state, &inst);
+		}
+	}
+	mem->decode_cache = NULL;
 
 	printf("Final registers:\n");
-	printf("      ax: 0x%04x (%d)\n", state.ax, state.ax);
-	printf("      bx: 0x%04x (%d)\n", state.bx, state.bx);
-	printf("      cx: 0x%04x (%d)\n", state.cx, state.cx);
-	printf("      dx: 0x%04x (%d)\n", state.dx, state.dx);
-	printf("      sp: 0x%04x (%d)\n", state.sp, state.sp);
-	printf("      bp: 0x%04x (%d)\n", state.bp, state.bp);
-	printf("      si: 0x%04x (%d)\n", state.si, state.si);
-	printf("      di: 0x%04x (%d)\n", state.di, state.di);
-	printf("      ip: 0x%04x (%d)\n", state.ip, state.ip);
-	printf("   flags: %s%s\n", state.flags.sign ? "S" : "", state.flags.zero ? "Z" : "");
+	print_registers(&state);
+
+	if (journal) {
+		if (options->back_to_write >= 0) {
+			if (journal_run_back_to_write(journal, mem, &state, options->back_to_write)) {
+				printf("Registers before the last write to 0x%04x:\n", options->back_to_write);
+				print_registers(&state);
+			} else {
+				printf("No write to 0x%04x in the journal\n", options->back_to_write);
+			}
+		}
+		if (options->back_steps > 0) {
+			uint64_t steps = journal_step_back(journal, mem, &state, options->back_steps);
+			printf("Registers %" PRIu64 " steps back:\n", steps);
+			print_registers(&state);
+		}
+		journal_free(journal);
+		free(journal);
+	}
+
+	printf("Decode cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " invalidations\n", cache->hits, cache->misses, cache->invalidations);
 	return 0;
 }
 
-int estimate_clocks(FILE *src) {
+int run_estimate_clocks(const char *input, enum cpu_model model) {
 	struct memory mem = { 0 };
-	int byte_count = load_mem_from_stream(&mem, src, 0);
+	mem.decode_cache = calloc(1, sizeof(struct decode_cache));
+	if (mem.decode_cache == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate decode cache\n");
+		return -1;
+	}
+
+	int byte_count = load_program(&mem, input);
 	if (byte_count == -1) {
-		fprintf(stderr, "ERROR: Failed to load file to memory\n");
+		fprintf(stderr, "ERROR: Failed to load '%s' to memory\n", input);
+		free(mem.decode_cache);
 		return -1;
 	}
 
@@ -155,212 +655,2378 @@ int estimate_clocks(FILE *src) {
 	struct cpu_state state = { 0 };
     struct instruction inst;
     while (state.ip < byte_count) {
-        enum decode_error err = decode_instruction(&mem, &state.ip, &inst);
+        enum decode_error err = decode_instruction_cached(mem.decode_cache, &mem, &state.ip, &inst);
         if (err == DECODE_ERR_EOF) break;
         if (err != DECODE_OK) {
             fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", state.ip, decode_error_to_str(err));
+            free(mem.decode_cache);
             return -1;
         }
 
+		struct instruction_clocks parts = estimate_executed_clocks(model, &inst, &state);
 		execute_instruction(&mem, &state, &inst);
 
-		u32 clocks = estimate_instruction_clocks(&inst);
+		u32 clocks = get_total_clocks(parts);
 		total_clocks += clocks;
 		instruction_to_str(buff, sizeof(buff), &inst);
-        printf("%s ; Clocks = %d (+%d)\n", buff, total_clocks, clocks);
+		if (parts.ea == 0 && parts.penalty == 0) {
+			printf("%s ; Clocks = %d (+%d)\n", buff, total_clocks, clocks);
+		} else if (parts.penalty == 0) {
+			printf("%s ; Clocks = %d (+%d = %d + %dea)\n", buff, total_clocks, clocks, parts.base, parts.ea);
+		} else {
+			printf("%s ; Clocks = %d (+%d = %d + %dea + %dp)\n", buff, total_clocks, clocks, parts.base, parts.ea, parts.penalty);
+		}
     }
 
+	free(mem.decode_cache);
 	return 0;
 }
 
 void print_usage(const char *program) {
 	fprintf(stderr, "Usage: %s <command> ...\n", program);
-	fprintf(stderr, "\ttest-dump <file.asm> - disassemble and test output\n");
-	fprintf(stderr, "\tdump <file> - disassemble\n");
-	fprintf(stderr, "\tsim <file> - simulate program\n");
-	fprintf(stderr, "\tsim-dump <file> <output> - simulate program and dump memory to file\n");
-	fprintf(stderr, "\tclocks <file> - output estimation of clocks\n");
+	fprintf(stderr, "\ttest-dump <file.asm> [--nasm] - disassemble and test output, optionally also compare the assembler against NASM\n");
+	fprintf(stderr, "\ttest-all [--jobs N] [<file|directory>...] - check every example in parallel against the \".txt\" next to it with every engine, \"examples\" by default\n");
+	fprintf(stderr, "\tbench [--warmup N] [--iterations N] [--filter TEXT] [--program <file>]... [--output <file>] - benchmark the decoder, clock estimation and engines\n");
+	fprintf(stderr, "\t    [--baseline <file>] [--threshold PERCENT] - compare against results saved with --output, slower than the threshold fails\n");
+	fprintf(stderr, "\tdump <file> - disassemble, a \".s86\" file is printed with its blocks and clocks\n");
+	fprintf(stderr, "\tprecompile <file> [<output>] - save the program decoded as a \".s86\" file, which is used instead of it when it's next to it\n");
+	fprintf(stderr, "\tsim <file> [--engine switch|threaded|jit] [--verify] - simulate program\n");
+	fprintf(stderr, "\t    [--back N] [--back-to-write ADDR] [--journal-size BYTES] - with the switch engine, step back afterwards using an undo journal\n");
+	fprintf(stderr, "\t    [--trace <output>] - with the switch engine, write a binary trace of every executed instruction\n");
+	fprintf(stderr, "\t    [--load <file>@<address>]... - load more files into memory before running, the program still ends at the end of <file>\n");
+	fprintf(stderr, "\ttrace-dump <trace> - print a binary trace as text\n");
+	fprintf(stderr, "\tsim-dump <file> <output> [--engine switch|threaded|jit] [--verify] [--sparse] - simulate program and dump memory to file\n");
+	fprintf(stderr, "\tdump-expand <file> <sparse dump> <output> - turn a sparse dump back into a full memory dump\n");
+	fprintf(stderr, "\tsim-batch [--jobs N] [--max-steps N] [--cpu 8086|8088] <file|directory>... - simulate many programs in parallel, outputs JSON lines\n");
+	fprintf(stderr, "\tsim-batch [--jobs N] [--max-steps N] [--cpu 8086|8088] <file> --states <state file|directory>... - simulate one program from many initial states\n");
+	fprintf(stderr, "\tsim-lockstep [--verify] [--max-steps N] [--cpu 8086|8088] <file> --states <state file|directory>... - simulate one program from many initial states in SIMD lanes\n");
+	fprintf(stderr, "\tclocks <file> [--cpu 8086|8088] - output estimation of clocks\n");
+	fprintf(stderr, "\tclocks <file> --static [--cpu 8086|8088] [--cache <file>] - estimate clocks per block and loop without executing\n");
+	fprintf(stderr, "\tprofile [--top N] [--max-steps N] [--cpu 8086|8088] [--folded <output>] <file> - count executions and clocks per instruction and block\n");
 }
 
-int test_decoder(const char *asm_file) {
-	if (!strendswith(asm_file, ".asm")) {
-		printf("ERROR: Expected *.asm file, gotten '%s'", asm_file);
-		return -1;
-	}
+#define REASSEMBLE_TEXT_SIZE (4 << 20) // Enough for the disassembly of a full memory image
 
-	char *bin_filename = "test-input.o";
-	if (compile_asm(asm_file, bin_filename)) {
-		printf("ERROR: Failed to compile '%s'", asm_file);
+// Disassembles `program` and assembles the text again into `output`, which should give back the same bytes.
+// `text` is scratch space of `REASSEMBLE_TEXT_SIZE` bytes. Returns the size of the output, or -1 with `error` filled in.
+int reassemble(const u8 *program, u32 size, char *text, u8 *output, u32 max_size, char *error, size_t error_size) {
+	int text_size = dissassemble_to_buffer(program, size, text, REASSEMBLE_TEXT_SIZE);
+	if (text_size == -1) {
+		snprintf(error, error_size, "failed to disassemble");
 		return -1;
 	}
 
-	FILE *bin_test = fopen(bin_filename, "rb");
-	if (bin_test == NULL) {
-		printf("ERROR: Opening file '%s': %d\n", bin_filename, errno);
+	struct assemble_result result = assemble(text, text_size, output, max_size);
+	if (result.err != ASSEMBLE_OK) {
+		snprintf(error, error_size, "disassembly line %d: %s", result.line, assemble_error_to_str(result.err));
 		return -1;
 	}
+	return result.size;
+}
 
-	char *dissassembly_filename = "test-dump.asm";
-	FILE *dissassembly = fopen(dissassembly_filename, "wb+");
-	if (dissassembly == NULL) {
-		printf("ERROR: Opening file '%s': %d\n", dissassembly_filename, errno);
+// Assembles the file, disassembles it and checks that assembling the disassembly gives the same bytes.
+// With `check_nasm` the built-in assembler is also compared against NASM.
+int test_decoder(const char *asm_file, bool check_nasm) {
+	if (!strendswith(asm_file, ".asm")) {
+		printf("ERROR: Expected *.asm file, gotten '%s'", asm_file);
 		return -1;
 	}
-	dissassemble(bin_test, dissassembly);
-	fclose(dissassembly);
 
-	char *dissassembly_dump_filename = "test-dump-asm.o";
-	if (compile_asm(dissassembly_filename, dissassembly_dump_filename)) {
-		printf("ERROR: Failed to compile '%s'", dissassembly_filename);
-		return -1;
-	}
+	u8 *input = malloc(MEMORY_SIZE);
+	u8 *output = malloc(MEMORY_SIZE);
+	char *text = malloc(REASSEMBLE_TEXT_SIZE);
+	int rc = -1;
+	if (input == NULL || output == NULL || text == NULL) goto err;
 
-	if (!compare_files(bin_filename, dissassembly_dump_filename)) {
-		printf("Test success\n");
-	} else {
-		printf("Test failed\n");
+	int input_size = assemble_file(asm_file, input, MEMORY_SIZE);
+	if (input_size == -1) goto err;
+
+	char error[256];
+	int output_size = reassemble(input, input_size, text, output, MEMORY_SIZE, error, sizeof(error));
+	if (output_size == -1) {
+		printf("ERROR: %s\n", error);
+		goto err;
 	}
 
-	return 0;
-}
+	bool passed = !compare_bytes(input, input_size, output, output_size);
 
-int dump_decompilation(const char *input) {
-	if (strendswith(input, ".asm")) {
+	if (check_nasm) {
 		char bin_filename[MAX_PATH_SIZE];
 		get_tmp_file(bin_filename, "nasm_output");
 
-		if (compile_asm(input, bin_filename)) {
-			printf("ERROR: Failed to compile '%s'", input);
-			return -1;
-		}
-
-		FILE *assembly = fopen(bin_filename, "rb");
-		if (assembly == NULL) {
-			printf("ERROR: Opening file '%s': %d\n", bin_filename, errno);
+		struct mapped_file nasm_output = { 0 };
+		if (compile_asm(asm_file, bin_filename) || map_file(bin_filename, &nasm_output)) {
+			printf("ERROR: Failed to compile '%s' with NASM\n", asm_file);
 			remove(bin_filename);
-			return -1;
+			goto err;
 		}
-		dissassemble(assembly, stdout);
-		fclose(assembly);
 
+		if (compare_bytes(nasm_output.data, nasm_output.size, input, input_size)) {
+			printf("Built-in assembler differs from NASM\n");
+			passed = false;
+		}
+		unmap_file(&nasm_output);
 		remove(bin_filename);
+	}
+
+	if (passed) {
+		printf("Test success\n");
+		rc = 0;
 	} else {
-		FILE *assembly = fopen(input, "r");
-		if (assembly == NULL) {
-			printf("ERROR: Opening file '%s': %d\n", input, errno);
-			return -1;
-		}
-		dissassemble(assembly, stdout);
-		fclose(assembly);
+		printf("Test failed\n");
 	}
 
-	return 0;
+err:
+	free(input);
+	free(output);
+	free(text);
+	return rc;
 }
 
-int run_simulation_with_memory(const char *input, struct memory *mem) {
-	if (strendswith(input, ".asm")) {
-		char bin_filename[MAX_PATH_SIZE];
-		get_tmp_file(bin_filename, "nasm_output");
+// Prints the instruction table of a ".s86" file, with the block starts and clocks stored in it
+void dump_precompiled(const struct precompiled *precompiled, FILE *dst) {
+	fprintf(dst, "bits 16\n");
 
-		if (compile_asm(input, bin_filename)) {
-			printf("ERROR: Failed to compile '%s'", input);
-			return -1;
+	char buff[256];
+	u32 next_address = 0;
+	for (u32 i = 0; i < precompiled->inst_count; i++) {
+		const struct precompiled_inst *entry = &precompiled->insts[i];
+		if (entry->address > next_address) {
+			fprintf(dst, "; 0x%04x..0x%04x not decodable\n", next_address, entry->address - 1);
+		}
+		if (entry->flags & PRECOMPILED_BLOCK_START) {
+			fprintf(dst, "\n; Block 0x%04x\n", entry->address);
 		}
 
-		FILE *assembly = fopen(bin_filename, "rb");
-		if (assembly == NULL) {
-			printf("ERROR: Opening file '%s': %d\n", bin_filename, errno);
-			remove(bin_filename);
+		struct instruction inst;
+		unpack_instruction(&inst, &entry->inst);
+		instruction_to_str(buff, sizeof(buff), &inst);
+		fprintf(dst, "%s ; Clocks: 8086 %u, 8088 %u\n", buff, entry->clocks[CPU_8086], entry->clocks[CPU_8088]);
+		next_address = entry->address + entry->size;
+	}
+	if (precompiled->image_size > next_address) {
+		fprintf(dst, "; 0x%04x..0x%04x not decodable\n", next_address, precompiled->image_size - 1);
+	}
+}
+
+int dump_decompilation(const char *input) {
+	if (strendswith(input, ".asm")) {
+		u8 *program = malloc(MEMORY_SIZE);
+		int size = program ? assemble_file(input, program, MEMORY_SIZE) : -1;
+		int rc = size == -1 ? -1 : dissassemble(program, size, stdout);
+		free(program);
+		return rc;
+	} else if (strendswith(input, ".s86")) {
+		struct mapped_file file;
+		struct precompiled precompiled;
+		if (map_file(input, &file)) {
+			fprintf(stderr, "ERROR: Opening file '%s': %d\n", input, errno);
 			return -1;
 		}
-		simulate(assembly, mem);
-		fclose(assembly);
-
-		remove(bin_filename);
-	} else {
-		FILE *assembly = fopen(input, "r");
-		if (assembly == NULL) {
-			printf("ERROR: Opening file '%s': %d\n", input, errno);
+		if (!open_precompiled(&precompiled, file.data, file.size)) {
+			fprintf(stderr, "ERROR: '%s' is not a valid precompiled program\n", input);
+			unmap_file(&file);
 			return -1;
 		}
-		simulate(assembly, mem);
-		fclose(assembly);
+		dump_precompiled(&precompiled, stdout);
+		unmap_file(&file);
+		return 0;
+	} else {
+		return dissassemble_file(input, stdout);
 	}
-
-	return 0;
-}
-
-int run_simulation(const char *input) {
-	struct memory mem = { 0 };
-	return run_simulation_with_memory(input, &mem);
 }
 
-int run_simulation_and_dump(const char *input, char const *output) {
-	struct memory mem = { 0 };
-	int rc = run_simulation_with_memory(input, &mem);
-	if (rc) return rc;
-
-	FILE *output_file = fopen(output, "wb");
-	if (output_file == NULL) {
+// Writes a ".s86" file for the program, by default next to it, see "sim8086/precompiled.c"
+int run_precompile(const char *input, const char *output) {
+	char default_output[MAX_PATH_SIZE];
+	if (output == NULL) {
+		get_precompiled_path(default_output, sizeof(default_output), input);
+		output = default_output;
+	}
+	if (strendswith(input, ".s86")) {
+		fprintf(stderr, "ERROR: '%s' is already precompiled\n", input);
 		return -1;
 	}
 
-	int written = fwrite(mem.mem, sizeof(u8), MEMORY_SIZE, output_file);
-	if (written != MEMORY_SIZE) {
-		fclose(output_file);
+	struct mapped_file source;
+	if (map_file(input, &source)) {
+		fprintf(stderr, "ERROR: Opening file '%s': %d\n", input, errno);
 		return -1;
 	}
 
-	return fclose(output_file);
-}
-
-int run_estimate_clocks(const char *input) {
+	int rc = -1;
+	u8 *assembled = NULL;
+	u8 *file = NULL;
+	const u8 *image = source.data;
+	int image_size = source.size;
 	if (strendswith(input, ".asm")) {
-		char bin_filename[MAX_PATH_SIZE];
-		get_tmp_file(bin_filename, "nasm_output");
-
-		if (compile_asm(input, bin_filename)) {
-			printf("ERROR: Failed to compile '%s'", input);
-			return -1;
-		}
+		assembled = malloc(MEMORY_SIZE);
+		image_size = assembled ? assemble_source(input, source.data, source.size, assembled, MEMORY_SIZE) : -1;
+		if (image_size == -1) goto done;
+		image = assembled;
+	} else if (source.size > MEMORY_SIZE) {
+		fprintf(stderr, "ERROR: '%s' doesn't fit into memory\n", input);
+		goto done;
+	}
 
-		FILE *assembly = fopen(bin_filename, "rb");
-		if (assembly == NULL) {
-			printf("ERROR: Opening file '%s': %d\n", bin_filename, errno);
-			remove(bin_filename);
-			return -1;
-		}
-		estimate_clocks(assembly);
-		fclose(assembly);
+	u32 file_size;
+	file = build_precompiled(image, image_size, hash_precompiled_bytes(source.data, source.size), &file_size);
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate precompiled program\n");
+		goto done;
+	}
 
-		remove(bin_filename);
-	} else {
-		return -1;
+	FILE *dst = fopen(output, "wb");
+	if (dst == NULL) {
+		fprintf(stderr, "ERROR: Opening file '%s': %d\n", output, errno);
+		goto done;
 	}
+	if (fwrite(file, 1, file_size, dst) == file_size) rc = 0;
+	if (fclose(dst) != 0) rc = -1;
+	if (rc) fprintf(stderr, "ERROR: Writing file '%s': %d\n", output, errno);
 
-	return 0;
+done:
+	free(file);
+	free(assembled);
+	unmap_file(&source);
+	return rc;
 }
 
-int main(int argc, char **argv) {
-	if (argc <= 2) {
-		print_usage(argv[0]);
+int run_simulation_with_memory(const char *input, struct memory *mem, struct sim_options *options) {
+	const char *paths[MAX_LOAD_IMAGES] = { input };
+	u16 starts[MAX_LOAD_IMAGES] = { 0 };
+	for (u32 i = 0; i < options->image_count; i++) {
+		paths[i+1] = options->image_paths[i];
+		starts[i+1] = options->image_starts[i];
+	}
+
+	// Set before loading, so precompiled programs can fill it in
+	struct decode_cache *cache = calloc(1, sizeof(struct decode_cache));
+	if (cache == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate decode cache\n");
 		return -1;
 	}
+	mem->decode_cache = cache;
 
-	if (strequal(argv[1], "test-dump") && argc == 3) {
-		return test_decoder(argv[2]);
+	u32 sizes[MAX_LOAD_IMAGES];
+	if (load_images(mem, paths, starts, options->image_count + 1, sizes) == -1) {
+		fprintf(stderr, "ERROR: Failed to load '%s'%s to memory\n", input, options->image_count > 0 ? " and the --load files" : "");
+		mem->decode_cache = NULL;
+		free(cache);
+		return -1;
+	}
+
+	int rc = simulate(mem, sizes[0], options);
+	mem->decode_cache = NULL;
+	free(cache);
+	return rc;
+}
+
+int run_simulation(const char *input, struct sim_options *options) {
+	struct memory mem = { 0 };
+	return run_simulation_with_memory(input, &mem, options);
+}
+
+// Sparse dumps only store the pages which were written to after loading the program, everything
+// else is the same as the loaded image. All numbers are little endian:
+//     "S86D"
+//     u32 range count
+//     (u32 start, u32 size, u8 data[size])...
+#define SPARSE_DUMP_MAGIC "S86D"
+
+void write_u32_le(FILE *dst, u32 value) {
+	u8 bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF };
+	fwrite(bytes, 1, sizeof(bytes), dst);
+}
+
+bool read_u32_le(FILE *src, u32 *value) {
+	u8 bytes[4];
+	if (fread(bytes, 1, sizeof(bytes), src) != sizeof(bytes)) return false;
+	*value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((u32)bytes[3] << 24);
+	return true;
+}
+
+int write_sparse_dump(FILE *dst, struct memory *mem) {
+	struct memory_range ranges[MAX_DIRTY_RANGES];
+	u32 range_count = take_dirty_ranges(mem, DIRTY_DUMP, ranges);
+
+	fwrite(SPARSE_DUMP_MAGIC, 1, 4, dst);
+	write_u32_le(dst, range_count);
+	for (u32 i = 0; i < range_count; i++) {
+		write_u32_le(dst, ranges[i].start);
+		write_u32_le(dst, ranges[i].size);
+		fwrite(mem->mem + ranges[i].start, 1, ranges[i].size, dst);
+	}
+	return ferror(dst) ? -1 : 0;
+}
+
+// Applies a sparse dump on top of the image that is already in `mem`
+int read_sparse_dump(FILE *src, struct memory *mem) {
+	char magic[4];
+	if (fread(magic, 1, 4, src) != 4 || memcmp(magic, SPARSE_DUMP_MAGIC, 4) != 0) return -1;
+
+	u32 range_count;
+	if (!read_u32_le(src, &range_count)) return -1;
+	for (u32 i = 0; i < range_count; i++) {
+		u32 start, size;
+		if (!read_u32_le(src, &start) || !read_u32_le(src, &size)) return -1;
+		if (start > MEMORY_SIZE || size > MEMORY_SIZE - start) return -1;
+		if (fread(mem->mem + start, 1, size, src) != size) return -1;
+	}
+	return 0;
+}
+
+int run_simulation_and_dump(const char *input, char const *output, struct sim_options *options) {
+	struct memory mem = { 0 };
+	int rc = run_simulation_with_memory(input, &mem, options);
+	if (rc) return rc;
+
+	FILE *output_file = fopen(output, "wb");
+	if (output_file == NULL) {
+		return -1;
+	}
+
+	if (options->sparse_dump) {
+		if (write_sparse_dump(output_file, &mem)) {
+			fclose(output_file);
+			return -1;
+		}
+		return fclose(output_file);
+	}
+
+	int written = fwrite(mem.mem, sizeof(u8), MEMORY_SIZE, output_file);
+	if (written != MEMORY_SIZE) {
+		fclose(output_file);
+		return -1;
+	}
+
+	return fclose(output_file);
+}
+
+/* -------------------- Batch simulation ----------------------- */
+
+#define BATCH_DEFAULT_MAX_STEPS 10000000
+
+enum batch_status {
+	BATCH_OK,
+	BATCH_LOAD_ERROR,  // Program or state file couldn't be read
+	BATCH_DECODE_ERROR,
+	BATCH_STEP_LIMIT,  // Program didn't finish in `batch.max_steps`
+};
+
+struct batch_result {
+	enum batch_status status;
+	struct cpu_state cpu;
+	bool has_clocks; // false if the program used instructions without clock estimations
+	u32 clocks;
+	uint64_t steps;
+	uint64_t memory_hash;
+};
+
+// Every job either runs its own program (`batch.program_snapshot` is NULL),
+// or `batch.program_snapshot` with the initial state from its file.
+struct batch_job {
+	const char *path;
+	struct batch_result result;
+	atomic_bool done;
+};
+
+// Jobs of a worker are the range [head, tail) of job indices. The owner takes jobs from the head,
+// and other workers steal from the tail once they run out.
+struct batch_worker {
+	struct batch *batch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	u32 head;
+	u32 tail;
+
+	struct memory *mem;
+	struct decode_cache *cache;
+	struct cpu_state cpu;
+};
+
+struct batch {
+	struct batch_job *jobs;
+	u32 job_count;
+	struct batch_worker *workers;
+	u32 worker_count;
+	uint64_t max_steps;
+	enum cpu_model cpu_model;
+
+	struct snapshot *program_snapshot; // Set when running one program with many initial states
+	u32 program_size;
+	struct snapshot *empty_snapshot;   // Workers are restored to it before loading each program
+
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+};
+
+// FNV-1a
+uint64_t hash_memory(struct memory *mem) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (u32 i = 0; i < MEMORY_SIZE; i++) {
+		hash ^= mem->mem[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+// Initial state for "sim-batch --states", one assignment per line:
+//     ax=0x10       any 16bit register, ip or flags
+//     [0x100]=0xff  byte of memory
+// Empty lines and lines starting with ';' are ignored.
+int load_initial_state(struct memory *mem, struct cpu_state *cpu, const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return -1;
+	}
+
+	int rc = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		char *equals = strchr(line, '=');
+		if (line[0] == ';' || equals == NULL) {
+			if (line[0] != ';' && strspn(line, " \t\r\n") != strlen(line)) rc = -1;
+			continue;
+		}
+		*equals = '\0';
+		long value = strtol(equals + 1, NULL, 0);
+
+		if (line[0] == '[') {
+			write_u8_at(mem, strtol(line + 1, NULL, 0), value);
+		} else if (strequal(line, "ip")) {
+			cpu->ip = value;
+		} else if (strequal(line, "flags")) {
+			set_cpu_flags(cpu, value);
+		} else {
+			bool found = false;
+			for (enum reg_value reg = REG_AX; reg <= REG_DI; reg++) {
+				if (strequal(line, reg_to_str(reg))) {
+					cpu->regs[REG16_INDEX(reg)] = value;
+					found = true;
+				}
+			}
+			if (!found) rc = -1;
+		}
+	}
+
+	fclose(file);
+	return rc;
+}
+
+void run_batch_job(struct batch_worker *worker, struct batch_job *job) {
+	struct batch *batch = worker->batch;
+	struct memory *mem = worker->mem;
+	struct cpu_state *cpu = &worker->cpu;
+	struct batch_result *result = &job->result;
+	memset(result, 0, sizeof(*result));
+
+	int end_ip;
+	if (batch->program_snapshot) {
+		restore_snapshot(batch->program_snapshot, mem, cpu);
+		end_ip = batch->program_size;
+		if (load_initial_state(mem, cpu, job->path)) {
+			result->status = BATCH_LOAD_ERROR;
+			return;
+		}
+	} else {
+		restore_snapshot(batch->empty_snapshot, mem, cpu);
+		end_ip = load_program(mem, job->path);
+		if (end_ip == -1) {
+			result->status = BATCH_LOAD_ERROR;
+			return;
+		}
+	}
+
+	result->status = BATCH_OK;
+	result->has_clocks = true;
+	struct instruction inst;
+	while (cpu->ip < end_ip) {
+		if (result->steps >= batch->max_steps) {
+			result->status = BATCH_STEP_LIMIT;
+			break;
+		}
+
+		enum decode_error err = decode_instruction_cached(worker->cache, mem, &cpu->ip, &inst);
+		if (err == DECODE_ERR_EOF) break;
+		if (err != DECODE_OK) {
+			result->status = BATCH_DECODE_ERROR;
+			break;
+		}
+
+		if (has_clock_estimation(&inst)) {
+			result->clocks += get_total_clocks(estimate_executed_clocks(batch->cpu_model, &inst, cpu));
+		} else {
+			result->has_clocks = false;
+		}
+		execute_instruction(mem, cpu, &inst);
+		result->steps++;
+	}
+
+	result->cpu = *cpu;
+	result->memory_hash = hash_memory(mem);
+}
+
+// Takes a job from the worker's own range, or steals from the back of someone else's.
+// Returns false once there are no jobs left anywhere.
+bool take_batch_job(struct batch_worker *worker, u32 *job_index) {
+	pthread_mutex_lock(&worker->lock);
+	bool found = worker->head < worker->tail;
+	if (found) *job_index = worker->head++;
+	pthread_mutex_unlock(&worker->lock);
+	if (found) return true;
+
+	struct batch *batch = worker->batch;
+	u32 self = worker - batch->workers;
+	for (u32 i = 1; i < batch->worker_count; i++) {
+		struct batch_worker *victim = &batch->workers[(self + i) % batch->worker_count];
+		pthread_mutex_lock(&victim->lock);
+		found = victim->head < victim->tail;
+		if (found) *job_index = --victim->tail;
+		pthread_mutex_unlock(&victim->lock);
+		if (found) return true;
+	}
+
+	return false;
+}
+
+void *batch_worker_main(void *arg) {
+	struct batch_worker *worker = arg;
+	struct batch *batch = worker->batch;
+
+	u32 job_index;
+	while (take_batch_job(worker, &job_index)) {
+		struct batch_job *job = &batch->jobs[job_index];
+		run_batch_job(worker, job);
+
+		pthread_mutex_lock(&batch->done_lock);
+		atomic_store(&job->done, true);
+		pthread_cond_signal(&batch->done_cond);
+		pthread_mutex_unlock(&batch->done_lock);
+	}
+
+	return NULL;
+}
+
+void print_json_string(FILE *dst, const char *str) {
+	fputc('"', dst);
+	for (const char *c = str; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(dst, "\\%c", *c);
+		} else if ((u8)*c < 0x20) {
+			fprintf(dst, "\\u%04x", (u8)*c);
+		} else {
+			fputc(*c, dst);
+		}
+	}
+	fputc('"', dst);
+}
+
+void print_batch_result(FILE *dst, struct batch_job *job) {
+	const char *status_str[] = {
+		[BATCH_OK]           = "ok",
+		[BATCH_LOAD_ERROR]   = "load error",
+		[BATCH_DECODE_ERROR] = "decode error",
+		[BATCH_STEP_LIMIT]   = "step limit",
+	};
+	struct batch_result *result = &job->result;
+
+	fprintf(dst, "{\"name\":");
+	print_json_string(dst, job->path);
+	fprintf(dst, ",\"status\":\"%s\"", status_str[result->status]);
+	if (result->status != BATCH_LOAD_ERROR) {
+		const enum reg_value print_order[] = { REG_AX, REG_BX, REG_CX, REG_DX, REG_SP, REG_BP, REG_SI, REG_DI };
+		for (int i = 0; i < ARRAY_LEN(print_order); i++) {
+			fprintf(dst, ",\"%s\":%d", reg_to_str(print_order[i]), result->cpu.regs[REG16_INDEX(print_order[i])]);
+		}
+		char flags[16];
+		flags_to_str(flags, sizeof(flags), get_cpu_flags(&result->cpu));
+		fprintf(dst, ",\"ip\":%d,\"flags\":\"%s\"", result->cpu.ip, flags);
+		if (result->has_clocks) {
+			fprintf(dst, ",\"clocks\":%u", result->clocks);
+		} else {
+			fprintf(dst, ",\"clocks\":null");
+		}
+		fprintf(dst, ",\"steps\":%" PRIu64 ",\"memory_hash\":\"%016" PRIx64 "\"", result->steps, result->memory_hash);
+	}
+	fprintf(dst, "}\n");
+}
+
+int compare_strings(const void *a, const void *b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Appends `path` to `paths`, or all files inside of it if it's a directory (sorted by name).
+// With `skip_expected`, ".txt" files inside directories are skipped, those are expected outputs next to the examples.
+// State directories keep them, ".txt" is a fine extension for the state format.
+int collect_batch_paths(const char *path, char ***paths, u32 *count, u32 *capacity, bool skip_expected) {
+	DIR *dir = opendir(path);
+	const char *single[] = { path };
+	char **entries = (char **)single;
+	u32 entry_count = 1;
+
+	if (dir != NULL) {
+		entries = NULL;
+		entry_count = 0;
+		u32 entry_capacity = 0;
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.' || (skip_expected && strendswith(entry->d_name, ".txt"))) continue;
+
+			char *full_path = malloc(strlen(path) + strlen(entry->d_name) + 2);
+			sprintf(full_path, "%s/%s", path, entry->d_name);
+			struct stat st;
+			if (stat(full_path, &st) || !S_ISREG(st.st_mode)) {
+				free(full_path);
+				continue;
+			}
+
+			if (entry_count == entry_capacity) {
+				entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+				entries = realloc(entries, entry_capacity * sizeof(char *));
+			}
+			entries[entry_count++] = full_path;
+		}
+		closedir(dir);
+		qsort(entries, entry_count, sizeof(char *), compare_strings);
+	}
+
+	for (u32 i = 0; i < entry_count; i++) {
+		if (*count == *capacity) {
+			*capacity = *capacity ? *capacity * 2 : 64;
+			*paths = realloc(*paths, *capacity * sizeof(char *));
+		}
+		(*paths)[(*count)++] = dir ? entries[i] : strdup(entries[i]);
+	}
+	if (dir) free(entries);
+	return 0;
+}
+
+// sim-batch [--jobs N] [--max-steps N] [--cpu 8086|8088] <program|directory>...
+// sim-batch [--jobs N] [--max-steps N] [--cpu 8086|8088] <program> --states <state file|directory>...
+int run_batch(int argc, char **argv, int first_arg) {
+	u32 worker_count = get_cpu_count();
+	uint64_t max_steps = BATCH_DEFAULT_MAX_STEPS;
+	enum cpu_model cpu_model = CPU_8086;
+	char **paths = NULL;
+	u32 path_count = 0;
+	u32 path_capacity = 0;
+	int states_from = -1;
+
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--jobs") && i+1 < argc) {
+			worker_count = atoi(argv[++i]);
+		} else if (strequal(argv[i], "--max-steps") && i+1 < argc) {
+			max_steps = strtoull(argv[++i], NULL, 10);
+		} else if (strequal(argv[i], "--cpu") && i+1 < argc) {
+			if (parse_cpu_model(argv[++i], &cpu_model)) return -1;
+		} else if (strequal(argv[i], "--states")) {
+			states_from = path_count;
+		} else {
+			collect_batch_paths(argv[i], &paths, &path_count, &path_capacity, states_from == -1);
+		}
+	}
+
+	if (worker_count == 0) worker_count = 1;
+	if (states_from != -1 && states_from != 1) {
+		fprintf(stderr, "ERROR: Exactly one program is expected before --states\n");
+		return -1;
+	}
+	if (states_from != -1 && path_count == 1) {
+		fprintf(stderr, "ERROR: No state files given after --states\n");
+		return -1;
+	} else if (path_count == 0) {
+		fprintf(stderr, "ERROR: No programs given\n");
+		return -1;
+	}
+
+	struct batch batch = {
+		.max_steps = max_steps,
+		.cpu_model = cpu_model,
+		.worker_count = worker_count,
+	};
+	pthread_mutex_init(&batch.done_lock, NULL);
+	pthread_cond_init(&batch.done_cond, NULL);
+
+	batch.empty_snapshot = calloc(1, sizeof(struct snapshot));
+	if (states_from != -1) {
+		struct memory *mem = calloc(1, sizeof(struct memory));
+		struct cpu_state cpu = { 0 };
+		int size = load_program(mem, paths[0]);
+		if (size == -1) {
+			fprintf(stderr, "ERROR: Failed to load program '%s'\n", paths[0]);
+			free(mem);
+			return -1;
+		}
+		batch.program_snapshot = malloc(sizeof(struct snapshot));
+		batch.program_size = size;
+		take_snapshot(batch.program_snapshot, mem, &cpu);
+		free(mem);
+	}
+
+	u32 first_job_path = states_from != -1 ? 1 : 0;
+	batch.job_count = path_count - first_job_path;
+	batch.jobs = calloc(batch.job_count, sizeof(struct batch_job));
+	for (u32 i = 0; i < batch.job_count; i++) {
+		batch.jobs[i].path = paths[first_job_path + i];
+	}
+
+	struct snapshot *base = batch.program_snapshot ? batch.program_snapshot : batch.empty_snapshot;
+	batch.workers = calloc(worker_count, sizeof(struct batch_worker));
+	for (u32 i = 0; i < worker_count; i++) {
+		struct batch_worker *worker = &batch.workers[i];
+		worker->batch = &batch;
+		worker->head = (uint64_t)batch.job_count * i / worker_count;
+		worker->tail = (uint64_t)batch.job_count * (i+1) / worker_count;
+		worker->mem = calloc(1, sizeof(struct memory));
+		worker->cache = calloc(1, sizeof(struct decode_cache));
+		if (worker->mem == NULL || worker->cache == NULL) {
+			fprintf(stderr, "ERROR: Failed to allocate worker memory\n");
+			return -1;
+		}
+		worker->mem->decode_cache = worker->cache;
+		fork_snapshot(base, worker->mem, &worker->cpu);
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+
+	for (u32 i = 0; i < worker_count; i++) {
+		pthread_create(&batch.workers[i].thread, NULL, batch_worker_main, &batch.workers[i]);
+	}
+
+	// Results are printed in order as soon as all jobs before them are done
+	int rc = 0;
+	for (u32 i = 0; i < batch.job_count; i++) {
+		struct batch_job *job = &batch.jobs[i];
+		pthread_mutex_lock(&batch.done_lock);
+		while (!atomic_load(&job->done)) {
+			pthread_cond_wait(&batch.done_cond, &batch.done_lock);
+		}
+		pthread_mutex_unlock(&batch.done_lock);
+
+		print_batch_result(stdout, job);
+		if (job->result.status != BATCH_OK) rc = -1;
+	}
+
+	// Everyone has to be done before any lock goes away, idle workers still look into others' ranges
+	for (u32 i = 0; i < worker_count; i++) {
+		pthread_join(batch.workers[i].thread, NULL);
+	}
+	for (u32 i = 0; i < worker_count; i++) {
+		struct batch_worker *worker = &batch.workers[i];
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->mem);
+		free(worker->cache);
+	}
+	pthread_mutex_destroy(&batch.done_lock);
+	pthread_cond_destroy(&batch.done_cond);
+
+	for (u32 i = 0; i < path_count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(batch.jobs);
+	free(batch.workers);
+	free(batch.program_snapshot);
+	free(batch.empty_snapshot);
+	return rc;
+}
+
+/* -------------------- Lockstep simulation ----------------------- */
+
+// Same as running the program through the switch engine, used to verify the lockstep engine
+enum batch_status run_scalar(struct memory *mem, struct cpu_state *cpu, u16 end_ip, uint64_t max_steps, enum cpu_model model, u32 *clocks) {
+	struct instruction inst;
+	*clocks = 0;
+	for (uint64_t steps = 0; cpu->ip < end_ip; steps++) {
+		if (steps >= max_steps) return BATCH_STEP_LIMIT;
+		enum decode_error err = decode_instruction(mem, &cpu->ip, &inst);
+		if (err != DECODE_OK) return BATCH_DECODE_ERROR;
+		*clocks += get_total_clocks(estimate_executed_clocks(model, &inst, cpu));
+		execute_instruction(mem, cpu, &inst);
+	}
+	return BATCH_OK;
+}
+
+// sim-lockstep [--verify] [--max-steps N] [--cpu 8086|8088] <program> --states <state file|directory>...
+int run_lockstep_states(int argc, char **argv, int first_arg) {
+	uint64_t max_steps = BATCH_DEFAULT_MAX_STEPS;
+	enum cpu_model cpu_model = CPU_8086;
+	bool verify = false;
+	char **paths = NULL;
+	u32 path_count = 0;
+	u32 path_capacity = 0;
+	int states_from = -1;
+
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--max-steps") && i+1 < argc) {
+			max_steps = strtoull(argv[++i], NULL, 10);
+		} else if (strequal(argv[i], "--cpu") && i+1 < argc) {
+			if (parse_cpu_model(argv[++i], &cpu_model)) return -1;
+		} else if (strequal(argv[i], "--verify")) {
+			verify = true;
+		} else if (strequal(argv[i], "--states")) {
+			states_from = path_count;
+		} else {
+			collect_batch_paths(argv[i], &paths, &path_count, &path_capacity, states_from == -1);
+		}
+	}
+
+	if (states_from != 1) {
+		fprintf(stderr, "ERROR: Exactly one program is expected before --states\n");
+		return -1;
+	}
+	if (path_count == 1) {
+		fprintf(stderr, "ERROR: No state files given after --states\n");
+		return -1;
+	}
+
+	struct snapshot *program = malloc(sizeof(struct snapshot));
+	struct memory *scalar_mem = calloc(1, sizeof(struct memory));
+	struct lockstep *ls = calloc(1, sizeof(struct lockstep));
+	struct memory *mems = calloc(LOCKSTEP_LANES, sizeof(struct memory));
+	if (program == NULL || scalar_mem == NULL || ls == NULL || mems == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate memory\n");
+		return -1;
+	}
+
+	struct cpu_state cpu = { 0 };
+	int program_size = load_program(scalar_mem, paths[0]);
+	if (program_size == -1) {
+		fprintf(stderr, "ERROR: Failed to load program '%s'\n", paths[0]);
+		return -1;
+	}
+	take_snapshot(program, scalar_mem, &cpu);
+	for (u32 lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		ls->mems[lane] = &mems[lane];
+		fork_snapshot(program, ls->mems[lane], &cpu);
+	}
+
+	int rc = 0;
+	struct batch_job jobs[LOCKSTEP_LANES];
+	struct cpu_state initial[LOCKSTEP_LANES];
+	for (u32 first = 1; first < path_count; first += LOCKSTEP_LANES) {
+		u32 lane_count = path_count - first;
+		if (lane_count > LOCKSTEP_LANES) lane_count = LOCKSTEP_LANES;
+
+		// Lanes that fail to load their state still run, but their results aren't printed
+		ls->lane_count = lane_count;
+		ls->model = cpu_model;
+		for (u32 lane = 0; lane < lane_count; lane++) {
+			struct batch_job *job = &jobs[lane];
+			memset(job, 0, sizeof(*job));
+			job->path = paths[first + lane];
+
+			restore_snapshot(program, ls->mems[lane], &initial[lane]);
+			if (load_initial_state(ls->mems[lane], &initial[lane], job->path)) {
+				job->result.status = BATCH_LOAD_ERROR;
+			}
+			lockstep_set_lane(ls, lane, &initial[lane]);
+		}
+
+		run_lockstep(ls, program_size, max_steps);
+
+		for (u32 lane = 0; lane < lane_count; lane++) {
+			struct batch_job *job = &jobs[lane];
+			struct batch_result *result = &job->result;
+			if (result->status != BATCH_LOAD_ERROR) {
+				const enum batch_status status_from_lane[] = {
+					[LOCKSTEP_FINISHED]     = BATCH_OK,
+					[LOCKSTEP_DECODE_ERROR] = BATCH_DECODE_ERROR,
+					[LOCKSTEP_STEP_LIMIT]   = BATCH_STEP_LIMIT,
+				};
+				result->status = status_from_lane[ls->status[lane]];
+				lockstep_get_lane(ls, lane, &result->cpu);
+				result->steps = ls->steps[lane];
+				result->clocks = ls->clocks[lane];
+				result->has_clocks = ls->has_clocks[lane];
+				result->memory_hash = hash_memory(ls->mems[lane]);
+			}
+			print_batch_result(stdout, job);
+			if (result->status != BATCH_OK) rc = -1;
+
+			if (verify && result->status != BATCH_LOAD_ERROR) {
+				restore_snapshot(program, scalar_mem, &cpu);
+				load_initial_state(scalar_mem, &cpu, job->path);
+				u32 clocks;
+				enum batch_status status = run_scalar(scalar_mem, &cpu, program_size, max_steps, cpu_model, &clocks);
+
+				bool same = status == result->status &&
+					clocks == result->clocks &&
+					memcmp(cpu.regs, result->cpu.regs, sizeof(cpu.regs)) == 0 &&
+					cpu.ip == result->cpu.ip &&
+					get_cpu_flags(&cpu) == get_cpu_flags(&result->cpu) &&
+					memcmp(scalar_mem->mem, ls->mems[lane]->mem, MEMORY_SIZE) == 0;
+				if (!same) {
+					fprintf(stderr, "ERROR: Lockstep and scalar engines differ for '%s'\n", job->path);
+					rc = -1;
+				}
+			}
+		}
+	}
+
+	if (verify && rc == 0) {
+		fprintf(stderr, "Lockstep engine matches the scalar engine for all %u states\n", path_count - 1);
+	}
+
+	for (u32 i = 0; i < path_count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(program);
+	free(scalar_mem);
+	free(ls);
+	free(mems);
+	return rc;
+}
+
+// dump-expand <program> <sparse dump> <output>
+// Turns a dump made with "sim-dump --sparse" back into a full memory dump
+int run_dump_expand(const char *program, const char *sparse_dump, const char *output) {
+	struct memory *mem = calloc(1, sizeof(struct memory));
+	if (mem == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+
+	if (load_program(mem, program) < 0) {
+		fprintf(stderr, "ERROR: Failed to load program '%s'\n", program);
+		free(mem);
+		return -1;
+	}
+
+	FILE *src = fopen(sparse_dump, "rb");
+	if (src == NULL) {
+		fprintf(stderr, "ERROR: Opening file '%s': %d\n", sparse_dump, errno);
+		free(mem);
+		return -1;
+	}
+	int rc = read_sparse_dump(src, mem);
+	fclose(src);
+	if (rc) {
+		fprintf(stderr, "ERROR: '%s' is not a valid sparse dump\n", sparse_dump);
+		free(mem);
+		return -1;
+	}
+
+	FILE *dst = fopen(output, "wb");
+	if (dst == NULL || fwrite(mem->mem, 1, MEMORY_SIZE, dst) != MEMORY_SIZE) {
+		fprintf(stderr, "ERROR: Failed to write '%s'\n", output);
+		if (dst) fclose(dst);
+		free(mem);
+		return -1;
+	}
+	free(mem);
+	return fclose(dst);
+}
+
+struct profile_row {
+	u16 start;
+	u16 end;
+	uint64_t count;
+	uint64_t clocks;
+};
+
+// Most clocks first, ties broken by execution count and then by address
+int compare_profile_rows(const void *a, const void *b) {
+	const struct profile_row *row_a = a;
+	const struct profile_row *row_b = b;
+	if (row_a->clocks != row_b->clocks) return row_a->clocks < row_b->clocks ? 1 : -1;
+	if (row_a->count != row_b->count) return row_a->count < row_b->count ? 1 : -1;
+	return (int)row_a->start - (int)row_b->start;
+}
+
+double profile_percent(uint64_t value, uint64_t total) {
+	return total > 0 ? 100.0 * value / total : 0.0;
+}
+
+void print_profile_inst(FILE *dst, struct memory *mem, u16 addr) {
+	struct instruction inst;
+	char buff[256] = "(invalid)";
+	if (decode_instruction(mem, &addr, &inst) == DECODE_OK) {
+		instruction_to_str(buff, sizeof(buff), &inst);
+	}
+	fprintf(dst, "%s", buff);
+}
+
+// Folded stacks for flamegraph.pl and similar tools: "<program>;<block>;<instruction> <weight>"
+int write_folded_profile(const char *path, const char *program, struct profile *profile, struct memory *mem, bool use_clocks) {
+	FILE *dst = fopen(path, "wb");
+	if (dst == NULL) return -1;
+
+	const char *name = strrchr(program, '/');
+	name = name ? name + 1 : program;
+	u32 block_start = 0;
+	for (u32 addr = 0; addr < MEMORY_SIZE; addr++) {
+		if (profile->block_counts[addr] > 0) block_start = addr;
+		uint64_t weight = use_clocks ? profile->clocks[addr] : profile->counts[addr];
+		if (weight == 0) continue;
+
+		fprintf(dst, "%s;block 0x%04x;0x%04x ", name, block_start, addr);
+		print_profile_inst(dst, mem, addr);
+		fprintf(dst, " %" PRIu64 "\n", weight);
+	}
+	return fclose(dst);
+}
+
+// profile [--top N] [--max-steps N] [--cpu 8086|8088] [--folded <output>] <program>
+int run_profile(int argc, char **argv, int first_arg) {
+	u32 top = 20;
+	enum cpu_model cpu_model = CPU_8086;
+	uint64_t max_steps = 0;
+	const char *folded_path = NULL;
+	const char *program = NULL;
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--top") && i+1 < argc) {
+			top = strtoul(argv[++i], NULL, 0);
+		} else if (strequal(argv[i], "--max-steps") && i+1 < argc) {
+			max_steps = strtoull(argv[++i], NULL, 0);
+		} else if (strequal(argv[i], "--cpu") && i+1 < argc) {
+			if (parse_cpu_model(argv[++i], &cpu_model)) return -1;
+		} else if (strequal(argv[i], "--folded") && i+1 < argc) {
+			folded_path = argv[++i];
+		} else if (program == NULL) {
+			program = argv[i];
+		} else {
+			fprintf(stderr, "ERROR: Unknown option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	if (program == NULL) {
+		fprintf(stderr, "ERROR: Missing program\n");
+		return -1;
+	}
+
+	struct memory *mem = calloc(1, sizeof(struct memory));
+	struct memory *image = calloc(1, sizeof(struct memory));
+	struct decode_cache *cache = calloc(1, sizeof(struct decode_cache));
+	struct profile *profile = calloc(1, sizeof(struct profile));
+	struct profile_row *rows = malloc(MEMORY_SIZE * sizeof(struct profile_row));
+	int rc = 0;
+	if (mem == NULL || image == NULL || cache == NULL || profile == NULL || rows == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		rc = -1;
+		goto done;
+	}
+
+	mem->decode_cache = cache;
+	int program_size = load_program(mem, program);
+	if (program_size < 0) {
+		fprintf(stderr, "ERROR: Failed to load program '%s'\n", program);
+		rc = -1;
+		goto done;
+	}
+	// Disassembly is shown from the program as it was loaded, in case it modifies itself
+	memcpy(image->mem, mem->mem, MEMORY_SIZE);
+
+	struct cpu_state cpu = { 0 };
+	enum decode_error err = run_profiled(profile, mem, &cpu, program_size, max_steps, cpu_model);
+	mem->decode_cache = NULL;
+	if (err != DECODE_OK && err != DECODE_ERR_EOF) {
+		fprintf(stderr, "ERROR: Failed to decode instruction at 0x%08x: %s\n", cpu.ip, decode_error_to_str(err));
+		rc = -1;
+	} else if (cpu.ip < program_size) {
+		fprintf(stderr, "WARNING: Stopped after %" PRIu64 " steps at 0x%04x\n", profile->total_steps, cpu.ip);
+	}
+
+	printf("Profile: %" PRIu64 " instructions, %" PRIu64 " clocks\n", profile->total_steps, profile->total_clocks);
+	if (profile->missing_clocks) {
+		printf("NOTE: Some executed instructions have no clock estimation, they are counted as 0 clocks\n");
+	}
+
+	u32 row_count = 0;
+	for (u32 addr = 0; addr < MEMORY_SIZE; addr++) {
+		if (profile->counts[addr] == 0) continue;
+		rows[row_count++] = (struct profile_row){ .start = addr, .end = addr, .count = profile->counts[addr], .clocks = profile->clocks[addr] };
+	}
+	qsort(rows, row_count, sizeof(struct profile_row), compare_profile_rows);
+
+	printf("\nHotspots:\n");
+	printf("  address        count       clocks  clocks%%  instruction\n");
+	for (u32 i = 0; i < row_count && i < top; i++) {
+		struct profile_row *row = &rows[i];
+		printf("   0x%04x %12" PRIu64 " %12" PRIu64 " %7.2f%%  ", row->start, row->count, row->clocks, profile_percent(row->clocks, profile->total_clocks));
+		print_profile_inst(stdout, image, row->start);
+		printf("\n");
+	}
+
+	row_count = 0;
+	for (u32 addr = 0; addr < MEMORY_SIZE; addr++) {
+		if (profile->block_counts[addr] == 0) continue;
+		rows[row_count++] = (struct profile_row){ .start = addr, .end = profile->block_ends[addr], .count = profile->block_counts[addr], .clocks = profile->block_clocks[addr] };
+	}
+	qsort(rows, row_count, sizeof(struct profile_row), compare_profile_rows);
+
+	printf("\nBlocks:\n");
+	printf("            range        count       clocks  clocks%%\n");
+	for (u32 i = 0; i < row_count && i < top; i++) {
+		struct profile_row *row = &rows[i];
+		printf("   0x%04x..0x%04x %12" PRIu64 " %12" PRIu64 " %7.2f%%\n", row->start, row->end, row->count, row->clocks, profile_percent(row->clocks, profile->total_clocks));
+	}
+
+	printf("\nAnnotated disassembly:\n");
+	u16 addr = 0;
+	while (addr < program_size) {
+		u16 inst_addr = addr;
+		struct instruction inst;
+		if (decode_instruction(image, &addr, &inst) != DECODE_OK) break;
+
+		char buff[256];
+		instruction_to_str(buff, sizeof(buff), &inst);
+		if (profile->counts[inst_addr] > 0) {
+			printf("%12" PRIu64 " %12" PRIu64 "   0x%04x: %s\n", profile->counts[inst_addr], profile->clocks[inst_addr], inst_addr, buff);
+		} else {
+			printf("%12s %12s   0x%04x: %s\n", "", "", inst_addr, buff);
+		}
+	}
+
+	if (folded_path) {
+		bool use_clocks = !profile->missing_clocks;
+		if (write_folded_profile(folded_path, program, profile, image, use_clocks)) {
+			fprintf(stderr, "ERROR: Failed to write '%s'\n", folded_path);
+			rc = -1;
+		} else if (!use_clocks) {
+			fprintf(stderr, "NOTE: Folded output is weighted by execution counts, because not all clocks are known\n");
+		}
+	}
+
+done:
+	free(mem);
+	free(image);
+	free(cache);
+	free(profile);
+	free(rows);
+	return rc;
+}
+
+// Cache of `analyse_static_clocks` kept between runs, it's only meant for the same machine:
+// "S86C" followed by the raw `struct static_clocks_cache`
+#define STATIC_CACHE_MAGIC "S86C"
+
+void load_static_cache(const char *path, struct static_clocks_cache *cache) {
+	FILE *src = fopen(path, "rb");
+	if (src == NULL) return;
+
+	char magic[4];
+	bool valid = fread(magic, 1, 4, src) == 4 && memcmp(magic, STATIC_CACHE_MAGIC, 4) == 0 &&
+		fread(cache, sizeof(*cache), 1, src) == 1;
+	if (!valid) {
+		fprintf(stderr, "WARNING: Ignoring invalid clocks cache '%s'\n", path);
+		memset(cache, 0, sizeof(*cache));
+	}
+	fclose(src);
+}
+
+int save_static_cache(const char *path, struct static_clocks_cache *cache) {
+	FILE *dst = fopen(path, "wb");
+	if (dst == NULL) return -1;
+	fwrite(STATIC_CACHE_MAGIC, 1, 4, dst);
+	fwrite(cache, sizeof(*cache), 1, dst);
+	return fclose(dst);
+}
+
+int run_static_clocks(const char *program, enum cpu_model model, const char *cache_path) {
+	struct memory *mem = calloc(1, sizeof(struct memory));
+	struct static_clocks_cache *cache = calloc(1, sizeof(struct static_clocks_cache));
+	if (mem == NULL || cache == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(mem);
+		free(cache);
+		return -1;
+	}
+
+	int program_size = load_program(mem, program);
+	if (program_size < 0) {
+		fprintf(stderr, "ERROR: Failed to load program '%s'\n", program);
+		free(mem);
+		free(cache);
+		return -1;
+	}
+
+	if (cache_path) load_static_cache(cache_path, cache);
+
+	struct static_clocks analysis;
+	if (analyse_static_clocks(&analysis, mem, program_size, model, cache_path ? cache : NULL)) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(mem);
+		free(cache);
+		return -1;
+	}
+
+	printf("Blocks:\n");
+	for (u32 i = 0; i < analysis.block_count; i++) {
+		struct static_block *block = &analysis.blocks[i];
+		printf("   0x%04x..0x%04x %4u instructions %6u clocks", block->start, block->end, block->inst_count, block->clocks);
+		if (block->has_jump) {
+			printf(" + %s to 0x%04x: %u taken / %u not taken", operation_to_str(block->jump_op), block->jump_target, block->taken_clocks, block->not_taken_clocks);
+		}
+		printf("\n");
+	}
+
+	if (analysis.loop_count > 0) {
+		printf("Loops:\n");
+	}
+	for (u32 i = 0; i < analysis.loop_count; i++) {
+		struct static_loop *loop = &analysis.loops[i];
+		printf("   0x%04x..0x%04x body %u clocks per iteration", loop->start, loop->end, loop->body_clocks);
+		if (loop->has_trip_count) {
+			printf(", %u iterations (%s), total %" PRIu64 " clocks", loop->trip_count, reg_to_str(loop->counter), loop->total_clocks);
+		} else {
+			printf(", unknown iterations");
+		}
+		printf("\n");
+	}
+
+	if (analysis.has_total) {
+		printf("Total: %" PRIu64 " clocks, if jumps other than loop back edges fall through\n", analysis.total_clocks);
+	} else {
+		printf("Total: unknown, some loops have no known trip count\n");
+	}
+
+	int rc = 0;
+	if (cache_path) {
+		printf("Cache: %u of %u blocks reused\n", analysis.cached_blocks, analysis.block_count);
+		if (save_static_cache(cache_path, cache)) {
+			fprintf(stderr, "ERROR: Failed to write clocks cache '%s'\n", cache_path);
+			rc = -1;
+		}
+	}
+
+	free_static_clocks(&analysis);
+	free(mem);
+	free(cache);
+	return rc;
+}
+
+// clocks <program> [--cpu 8086|8088] [--static [--cache <file>]]
+int run_clocks(int argc, char **argv, int first_arg) {
+	enum cpu_model model = CPU_8086;
+	bool is_static = false;
+	const char *cache_path = NULL;
+	const char *program = NULL;
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--cpu") && i+1 < argc) {
+			if (parse_cpu_model(argv[++i], &model)) return -1;
+		} else if (strequal(argv[i], "--static")) {
+			is_static = true;
+		} else if (strequal(argv[i], "--cache") && i+1 < argc) {
+			cache_path = argv[++i];
+		} else if (program == NULL) {
+			program = argv[i];
+		} else {
+			fprintf(stderr, "ERROR: Unknown option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	if (program == NULL) {
+		fprintf(stderr, "ERROR: Missing program\n");
+		return -1;
+	}
+
+	if (is_static) {
+		return run_static_clocks(program, model, cache_path);
+	}
+	return run_estimate_clocks(program, model);
+}
+
+// trace-dump <trace file>
+// Prints every record of a trace made with "sim --trace" as one line of text
+int run_trace_dump(const char *path) {
+	struct mapped_file file;
+	if (map_file(path, &file)) {
+		fprintf(stderr, "ERROR: Opening file '%s': %d\n", path, errno);
+		return -1;
+	}
+	if (!is_trace_header_valid(file.data, file.size)) {
+		fprintf(stderr, "ERROR: '%s' is not a trace file\n", path);
+		unmap_file(&file);
+		return -1;
+	}
+
+	const char *reg_names[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" }; // Same order as `cpu_state.regs`
+	int rc = 0;
+	size_t offset = TRACE_HEADER_SIZE;
+	while (offset < file.size) {
+		struct trace_record record;
+		u32 size = decode_trace_record(file.data + offset, file.size - offset, &record);
+		if (size == 0) {
+			fprintf(stderr, "ERROR: Truncated trace record at offset %zu\n", offset);
+			rc = -1;
+			break;
+		}
+		offset += size;
+
+		struct instruction inst;
+		unpack_instruction(&inst, &record.inst);
+		char buff[256];
+		instruction_to_str(buff, sizeof(buff), &inst);
+		printf("0x%04x: %s ;", record.ip, buff);
+		for (int i = 0; i < 8; i++) {
+			if (record.changed & (1 << i)) printf(" %s=0x%04x", reg_names[i], record.regs[i]);
+		}
+		if (record.changed & TRACE_CHANGED_FLAGS) {
+			char flags[16];
+			flags_to_str(flags, sizeof(flags), record.flags);
+			printf(" flags=%s", flags);
+		}
+		for (int i = 0; i < record.write_count; i++) {
+			printf(" [0x%04x]=0x%02x", record.write_address[i], record.write_value[i]);
+		}
+		printf("\n");
+	}
+
+	unmap_file(&file);
+	return rc;
+}
+
+// Parses "--engine <name>", "--verify" and the journal options from the trailing arguments of a command
+int parse_sim_options(int argc, char **argv, int first_option, struct sim_options *options) {
+	options->engine = SIM_ENGINE_SWITCH;
+	options->verify = false;
+	options->journal_size = JOURNAL_DEFAULT_SIZE;
+	options->back_steps = 0;
+	options->back_to_write = -1;
+	options->sparse_dump = false;
+	options->trace_path = NULL;
+	options->image_count = 0;
+	for (int i = first_option; i < argc; i++) {
+		if (strequal(argv[i], "--engine") && i+1 < argc) {
+			i++;
+			if (strequal(argv[i], "switch")) {
+				options->engine = SIM_ENGINE_SWITCH;
+			} else if (strequal(argv[i], "threaded")) {
+				options->engine = SIM_ENGINE_THREADED;
+			} else if (strequal(argv[i], "jit")) {
+				options->engine = SIM_ENGINE_JIT;
+			} else {
+				fprintf(stderr, "ERROR: Unknown engine '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (strequal(argv[i], "--verify")) {
+			options->verify = true;
+		} else if (strequal(argv[i], "--trace") && i+1 < argc) {
+			options->trace_path = argv[++i];
+		} else if (strequal(argv[i], "--sparse")) {
+			options->sparse_dump = true;
+		} else if (strequal(argv[i], "--load") && i+1 < argc) {
+			char *at = strrchr(argv[++i], '@');
+			if (at == NULL || at == argv[i]) {
+				fprintf(stderr, "ERROR: Expected <file>@<address>, gotten '%s'\n", argv[i]);
+				return -1;
+			}
+			if (options->image_count == ARRAY_LEN(options->image_paths)) {
+				fprintf(stderr, "ERROR: At most %d files can be loaded\n", (int)ARRAY_LEN(options->image_paths));
+				return -1;
+			}
+			*at = '\0';
+			options->image_paths[options->image_count] = argv[i];
+			options->image_starts[options->image_count] = strtol(at + 1, NULL, 0) & 0xFFFF;
+			options->image_count++;
+		} else if (strequal(argv[i], "--back") && i+1 < argc) {
+			options->back_steps = strtoull(argv[++i], NULL, 0);
+		} else if (strequal(argv[i], "--back-to-write") && i+1 < argc) {
+			options->back_to_write = strtol(argv[++i], NULL, 0) & 0xFFFF;
+		} else if (strequal(argv[i], "--journal-size") && i+1 < argc) {
+			options->journal_size = strtoul(argv[++i], NULL, 0);
+			if (options->journal_size < 256) {
+				fprintf(stderr, "ERROR: Journal size must be at least 256 bytes\n");
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "ERROR: Unknown option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+
+	if (options->trace_path && (options->engine != SIM_ENGINE_SWITCH || options->back_steps > 0 || options->back_to_write >= 0)) {
+		fprintf(stderr, "ERROR: --trace only works with the switch engine and without stepping back\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* -------------------- Example tests ----------------------- */
+
+// Every ".asm" file is assembled and checked to disassemble back to the same bytes. If there is a ".txt" file
+// next to it with the expected output (as in "examples/"), the program is also simulated along it.
+// Every executed line is checked for its clocks and the new values of the registers it lists, and
+// "Final registers:" for the state at the end, unlisted registers must be 0. Instruction text is not compared,
+// the reference prints some operands differently.
+// The threaded engine and the JIT (with every block verified against the interpreter) then run the same program
+// from scratch, and must end with the same registers, flags and memory as the checked run.
+
+struct test_job {
+	char *path;
+	bool passed;
+	bool has_expected;
+	u32 runs; // Simulations checked against the expected output, one per CPU model in it
+	uint64_t steps;
+	uint64_t time_ns;
+	char error[256]; // First failure
+};
+
+struct test_run {
+	struct test_job *jobs;
+	u32 job_count;
+	atomic_uint next_job;
+};
+
+// Scratch space of a worker, reused for every test it runs
+struct test_worker {
+	struct test_run *run;
+	pthread_t thread;
+	struct memory *mem;
+	struct decode_cache *cache;
+	u8 *program;
+	u8 *reassembled;
+	char *text;
+
+	// For rerunning the program with the other engines
+	struct memory *engine_mem;
+	struct decode_cache *engine_cache;
+	struct threaded_stats *threaded_stats;
+	struct jit *jit; // NULL if the JIT is not supported on this host
+};
+
+// State of `check_expected_output` while it goes through the lines of the expected output
+struct test_listing {
+	struct test_worker *worker;
+	struct test_job *job;
+	const char *path;
+	u32 line_number;
+	u32 program_size;
+	enum cpu_model model;
+
+	bool running; // Inside of an "execution" section
+	struct cpu_state cpu;
+	u32 total_clocks;
+
+	bool final_registers; // Inside of "Final registers:"
+	struct cpu_state expected;
+	bool expected_ip; // Older listings don't print it
+	char expected_flags[16];
+};
+
+static bool test_fail(struct test_listing *listing, const char *format, ...) {
+	struct test_job *job = listing->job;
+	int len = snprintf(job->error, sizeof(job->error), "%s:%u: ", listing->path, listing->line_number);
+	va_list args;
+	va_start(args, format);
+	vsnprintf(job->error + len, sizeof(job->error) - len, format, args);
+	va_end(args);
+	return false;
+}
+
+// Returns `__REG_COUNT` if it's not a 16bit register
+static enum reg_value test_reg_from_str(const char *name) {
+	for (enum reg_value reg = REG_AX; reg <= REG_DI; reg++) {
+		if (strequal(name, reg_to_str(reg))) return reg;
+	}
+	return __REG_COUNT;
+}
+
+static void test_start_execution(struct test_listing *listing) {
+	struct test_worker *worker = listing->worker;
+	memset(worker->mem->mem, 0, MEMORY_SIZE);
+	reset_decode_cache(worker->cache);
+	struct memory_segment segment = { .data = worker->program, .size = listing->program_size, .start = 0 };
+	load_mem_segments(worker->mem, &segment, 1);
+
+	memset(&listing->cpu, 0, sizeof(listing->cpu));
+	listing->total_clocks = 0;
+	listing->running = true;
+	listing->job->runs++;
+}
+
+// `value` is the new value from "<name>:<old>-><new>" of an executed line
+static bool test_check_change(struct test_listing *listing, const char *name, const char *value) {
+	struct cpu_state *cpu = &listing->cpu;
+	if (strequal(name, "flags")) {
+		char flags[16];
+		flags_to_str(flags, sizeof(flags), get_cpu_flags(cpu));
+		if (!strequal(flags, value)) return test_fail(listing, "expected flags '%s', got '%s'", value, flags);
+		return true;
+	}
+
+	u16 expected = strtol(value, NULL, 0);
+	if (strequal(name, "ip")) {
+		if (cpu->ip != expected) return test_fail(listing, "expected ip = 0x%04x, got 0x%04x", expected, cpu->ip);
+		return true;
+	}
+
+	enum reg_value reg = test_reg_from_str(name);
+	if (reg == __REG_COUNT) return true;
+	u16 gotten = cpu->regs[REG16_INDEX(reg)];
+	if (gotten != expected) return test_fail(listing, "expected %s = 0x%04x, got 0x%04x", name, expected, gotten);
+	return true;
+}
+
+// Executes one instruction for a line like "add si, 2 ; Clocks: +4 = 16 | si:0x0->0x2 ip:0xb->0xe flags:CPAS->"
+static bool test_check_step(struct test_listing *listing, const char *changes) {
+	struct test_worker *worker = listing->worker;
+	struct cpu_state *cpu = &listing->cpu;
+	if (cpu->ip >= listing->program_size) return test_fail(listing, "program ended before this instruction");
+
+	u16 ip = cpu->ip;
+	struct instruction inst;
+	enum decode_error err = decode_instruction_cached(worker->cache, worker->mem, &cpu->ip, &inst);
+	if (err != DECODE_OK) return test_fail(listing, "failed to decode instruction at 0x%04x: %s", ip, decode_error_to_str(err));
+
+	bool has_clocks = has_clock_estimation(&inst);
+	u32 clocks = has_clocks ? get_total_clocks(estimate_executed_clocks(listing->model, &inst, cpu)) : 0;
+	execute_instruction(worker->mem, cpu, &inst);
+	listing->total_clocks += clocks;
+	listing->job->steps++;
+
+	u32 expected_clocks, expected_total;
+	if (sscanf(changes, "Clocks: +%u = %u", &expected_clocks, &expected_total) == 2) {
+		if (!has_clocks) return test_fail(listing, "no clock estimation for this instruction");
+		if (clocks != expected_clocks || listing->total_clocks != expected_total) {
+			return test_fail(listing, "expected +%u = %u clocks, got +%u = %u", expected_clocks, expected_total, clocks, listing->total_clocks);
+		}
+		changes = strstr(changes, "| ");
+		if (changes == NULL) return true;
+		changes += 2;
+	}
+
+	while (*changes) {
+		size_t token_size = strcspn(changes, " ");
+		char token[64];
+		snprintf(token, sizeof(token), "%.*s", (int)token_size, changes);
+		changes += token_size + strspn(changes + token_size, " ");
+
+		char *colon = strchr(token, ':');
+		char *arrow = strstr(token, "->");
+		if (colon == NULL || arrow == NULL) continue;
+		*colon = '\0';
+		if (!test_check_change(listing, token, arrow + 2)) return false;
+	}
+	return true;
+}
+
+// Runs the program from scratch with `engine` and compares the end state with the checked run in `worker->mem`
+static bool test_check_engine(struct test_listing *listing, enum sim_engine engine) {
+	struct test_worker *worker = listing->worker;
+	struct memory *mem = worker->engine_mem;
+	memset(mem->mem, 0, MEMORY_SIZE);
+	reset_decode_cache(worker->engine_cache);
+	struct memory_segment segment = { .data = worker->program, .size = listing->program_size, .start = 0 };
+	load_mem_segments(mem, &segment, 1);
+
+	const char *name = "threaded engine";
+	struct cpu_state cpu = { 0 };
+	enum decode_error err;
+	if (engine == SIM_ENGINE_JIT) {
+		name = "JIT";
+		jit_flush(worker->jit);
+		if (jit_enable_verify(worker->jit, mem, &cpu)) return test_fail(listing, "failed to allocate memory for JIT verification");
+		err = run_jit(worker->jit, mem, &cpu, listing->program_size);
+		jit_disable_verify(worker->jit);
+		if (err != DECODE_OK && err != DECODE_ERR_EOF) return test_fail(listing, "JIT and interpreter diverged at 0x%04x", cpu.ip);
+	} else {
+		err = run_threaded(mem, &cpu, listing->program_size, worker->threaded_stats);
+		if (err != DECODE_OK && err != DECODE_ERR_EOF) return test_fail(listing, "%s failed to decode at 0x%04x: %s", name, cpu.ip, decode_error_to_str(err));
+	}
+
+	struct cpu_state *expected = &listing->cpu;
+	for (enum reg_value reg = REG_AX; reg <= REG_DI; reg++) {
+		u16 expected_value = expected->regs[REG16_INDEX(reg)];
+		u16 gotten = cpu.regs[REG16_INDEX(reg)];
+		if (expected_value != gotten) return test_fail(listing, "%s: expected %s = 0x%04x at the end, got 0x%04x", name, reg_to_str(reg), expected_value, gotten);
+	}
+	if (expected->ip != cpu.ip) return test_fail(listing, "%s: expected ip = 0x%04x at the end, got 0x%04x", name, expected->ip, cpu.ip);
+
+	char expected_flags[16], flags[16];
+	flags_to_str(expected_flags, sizeof(expected_flags), get_cpu_flags(expected));
+	flags_to_str(flags, sizeof(flags), get_cpu_flags(&cpu));
+	if (!strequal(expected_flags, flags)) return test_fail(listing, "%s: expected flags '%s' at the end, got '%s'", name, expected_flags, flags);
+
+	for (u32 i = 0; i < MEMORY_SIZE; i++) {
+		if (mem->mem[i] != worker->mem->mem[i]) {
+			return test_fail(listing, "%s: expected byte 0x%02x at 0x%04x at the end, got 0x%02x", name, worker->mem->mem[i], i, mem->mem[i]);
+		}
+	}
+	return true;
+}
+
+static bool test_check_final_registers(struct test_listing *listing) {
+	listing->final_registers = false;
+	listing->running = false;
+
+	struct cpu_state *cpu = &listing->cpu;
+	for (enum reg_value reg = REG_AX; reg <= REG_DI; reg++) {
+		u16 expected = listing->expected.regs[REG16_INDEX(reg)];
+		u16 gotten = cpu->regs[REG16_INDEX(reg)];
+		if (expected != gotten) return test_fail(listing, "expected %s = 0x%04x at the end, got 0x%04x", reg_to_str(reg), expected, gotten);
+	}
+	if (listing->expected_ip && listing->expected.ip != cpu->ip) {
+		return test_fail(listing, "expected ip = 0x%04x at the end, got 0x%04x", listing->expected.ip, cpu->ip);
+	}
+
+	char flags[16];
+	flags_to_str(flags, sizeof(flags), get_cpu_flags(cpu));
+	if (!strequal(flags, listing->expected_flags)) {
+		return test_fail(listing, "expected flags '%s' at the end, got '%s'", listing->expected_flags, flags);
+	}
+
+	if (!test_check_engine(listing, SIM_ENGINE_THREADED)) return false;
+	if (listing->worker->jit && !test_check_engine(listing, SIM_ENGINE_JIT)) return false;
+	return true;
+}
+
+static bool test_check_line(struct test_listing *listing, const char *line) {
+	if (listing->final_registers) {
+		char name[16];
+		char value[16] = "";
+		if (sscanf(line, " %15[a-z]: %15s", name, value) < 1) return test_check_final_registers(listing);
+
+		if (strequal(name, "flags")) {
+			strcpy(listing->expected_flags, value);
+		} else if (strequal(name, "ip")) {
+			listing->expected.ip = strtol(value, NULL, 0);
+			listing->expected_ip = true;
+		} else {
+			enum reg_value reg = test_reg_from_str(name);
+			if (reg == __REG_COUNT) return test_fail(listing, "unknown register '%s'", name);
+			listing->expected.regs[REG16_INDEX(reg)] = strtol(value, NULL, 0);
+		}
+		return true;
+	}
+
+	const char *changes = strstr(line, " ; ");
+	if (strstr(line, "**** 8086 ****")) {
+		listing->model = CPU_8086;
+	} else if (strstr(line, "**** 8088 ****")) {
+		listing->model = CPU_8088;
+	} else if (strncmp(line, "--- ", 4) == 0 && strstr(line, " execution ---")) {
+		test_start_execution(listing);
+	} else if (listing->running && strequal(line, "Final registers:")) {
+		if (listing->cpu.ip < listing->program_size) {
+			return test_fail(listing, "program didn't end, ip is 0x%04x", listing->cpu.ip);
+		}
+		listing->final_registers = true;
+		memset(&listing->expected, 0, sizeof(listing->expected));
+		listing->expected_ip = false;
+		listing->expected_flags[0] = '\0';
+	} else if (listing->running && changes) {
+		return test_check_step(listing, changes + 3);
+	}
+	return true;
+}
+
+// Runs the program in `worker->program` along the expected output in `path`, if there is one
+bool check_expected_output(struct test_worker *worker, struct test_job *job, const char *path, u32 program_size) {
+	struct mapped_file file;
+	if (map_file(path, &file)) return true;
+	job->has_expected = true;
+
+	struct test_listing listing = {
+		.worker = worker,
+		.job = job,
+		.path = path,
+		.program_size = program_size,
+		.model = CPU_8086,
+	};
+
+	bool passed = true;
+	size_t offset = 0;
+	while (passed && offset < file.size) {
+		const u8 *line_start = file.data + offset;
+		const u8 *newline = memchr(line_start, '\n', file.size - offset);
+		size_t line_size = newline ? (size_t)(newline - line_start) : file.size - offset;
+		offset += line_size + 1;
+		listing.line_number++;
+
+		char line[512];
+		if (line_size > 0 && line_start[line_size-1] == '\r') line_size--;
+		snprintf(line, sizeof(line), "%.*s", (int)line_size, (const char *)line_start);
+		passed = test_check_line(&listing, line);
+	}
+	if (passed && listing.final_registers) passed = test_check_final_registers(&listing);
+	if (passed && job->runs == 0) passed = test_fail(&listing, "no execution found");
+
+	unmap_file(&file);
+	return passed;
+}
+
+bool run_test(struct test_worker *worker, struct test_job *job) {
+	struct mapped_file source;
+	if (map_file(job->path, &source)) {
+		snprintf(job->error, sizeof(job->error), "failed to open '%s': %d", job->path, errno);
+		return false;
+	}
+	struct assemble_result result = assemble((const char *)source.data, source.size, worker->program, MEMORY_SIZE);
+	unmap_file(&source);
+	if (result.err != ASSEMBLE_OK) {
+		snprintf(job->error, sizeof(job->error), "%s:%u: %s", job->path, result.line, assemble_error_to_str(result.err));
+		return false;
+	}
+
+	int reassembled_size = reassemble(worker->program, result.size, worker->text, worker->reassembled, MEMORY_SIZE, job->error, sizeof(job->error));
+	if (reassembled_size == -1) return false;
+	u32 same = 0;
+	while (same < result.size && same < (u32)reassembled_size && worker->program[same] == worker->reassembled[same]) same++;
+	if (same != result.size || same != (u32)reassembled_size) {
+		snprintf(job->error, sizeof(job->error), "disassembly assembles differently, starting from byte %u", same);
+		return false;
+	}
+
+	char expected_path[MAX_PATH_SIZE];
+	snprintf(expected_path, sizeof(expected_path), "%.*s.txt", (int)(strlen(job->path) - 4), job->path);
+	return check_expected_output(worker, job, expected_path, result.size);
+}
+
+void *test_worker_main(void *arg) {
+	struct test_worker *worker = arg;
+	struct test_run *run = worker->run;
+
+	u32 job_index;
+	while ((job_index = atomic_fetch_add(&run->next_job, 1)) < run->job_count) {
+		struct test_job *job = &run->jobs[job_index];
+		uint64_t start = get_time_ns();
+		job->passed = run_test(worker, job);
+		job->time_ns = get_time_ns() - start;
+	}
+
+	return NULL;
+}
+
+// test-all [--jobs N] [<file|directory>...], by default runs everything in "examples"
+int run_test_all(int argc, char **argv, int first_arg) {
+	u32 worker_count = get_cpu_count();
+	char **paths = NULL;
+	u32 path_count = 0;
+	u32 path_capacity = 0;
+	bool has_paths = false;
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--jobs") && i+1 < argc) {
+			worker_count = atoi(argv[++i]);
+		} else {
+			collect_batch_paths(argv[i], &paths, &path_count, &path_capacity, true);
+			has_paths = true;
+		}
+	}
+	if (!has_paths) {
+		collect_batch_paths("examples", &paths, &path_count, &path_capacity, true);
+	}
+
+	struct test_run run = { .jobs = calloc(path_count ? path_count : 1, sizeof(struct test_job)) };
+	for (u32 i = 0; i < path_count; i++) {
+		if (strendswith(paths[i], ".asm")) {
+			run.jobs[run.job_count++].path = paths[i];
+		} else {
+			free(paths[i]);
+		}
+	}
+	free(paths);
+	if (run.job_count == 0) {
+		fprintf(stderr, "ERROR: No *.asm files found\n");
+		free(run.jobs);
+		return -1;
+	}
+
+	if (worker_count == 0) worker_count = 1;
+	if (worker_count > run.job_count) worker_count = run.job_count;
+
+	int rc = 0;
+	uint64_t start = get_time_ns();
+	struct test_worker *workers = calloc(worker_count, sizeof(struct test_worker));
+	for (u32 i = 0; i < worker_count; i++) {
+		struct test_worker *worker = &workers[i];
+		worker->run = &run;
+		worker->mem = calloc(1, sizeof(struct memory));
+		worker->cache = calloc(1, sizeof(struct decode_cache));
+		worker->program = malloc(MEMORY_SIZE);
+		worker->reassembled = malloc(MEMORY_SIZE);
+		worker->text = malloc(REASSEMBLE_TEXT_SIZE);
+		worker->engine_mem = calloc(1, sizeof(struct memory));
+		worker->engine_cache = calloc(1, sizeof(struct decode_cache));
+		worker->threaded_stats = calloc(1, sizeof(struct threaded_stats));
+		if (!worker->mem || !worker->cache || !worker->program || !worker->reassembled || !worker->text ||
+			!worker->engine_mem || !worker->engine_cache || !worker->threaded_stats) {
+			fprintf(stderr, "ERROR: Failed to allocate worker memory\n");
+			return -1;
+		}
+		worker->mem->decode_cache = worker->cache;
+		worker->engine_mem->decode_cache = worker->engine_cache;
+		worker->jit = malloc(sizeof(struct jit));
+		if (worker->jit && jit_init(worker->jit)) {
+			free(worker->jit);
+			worker->jit = NULL;
+		}
+		pthread_create(&worker->thread, NULL, test_worker_main, worker);
+	}
+	for (u32 i = 0; i < worker_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	uint64_t total_ns = get_time_ns() - start;
+
+	u32 passed_count = 0;
+	for (u32 i = 0; i < run.job_count; i++) {
+		struct test_job *job = &run.jobs[i];
+		printf("%s %8.3f ms  %s", job->passed ? "PASS" : "FAIL", job->time_ns / 1e6, job->path);
+		if (job->has_expected) {
+			printf(" (%u run%s, %" PRIu64 " steps)\n", job->runs, job->runs == 1 ? "" : "s", job->steps);
+		} else {
+			printf(" (round trip only)\n");
+		}
+		if (!job->passed) printf("     %s\n", job->error);
+		if (job->passed) passed_count++;
+	}
+	printf("%u passed, %u failed in %.3f ms on %u threads\n", passed_count, run.job_count - passed_count, total_ns / 1e6, worker_count);
+	if (passed_count != run.job_count) rc = -1;
+
+	for (u32 i = 0; i < worker_count; i++) {
+		free(workers[i].mem);
+		free(workers[i].cache);
+		free(workers[i].program);
+		free(workers[i].reassembled);
+		free(workers[i].text);
+		free(workers[i].engine_mem);
+		free(workers[i].engine_cache);
+		free(workers[i].threaded_stats);
+		if (workers[i].jit) {
+			jit_free(workers[i].jit);
+			free(workers[i].jit);
+		}
+	}
+	for (u32 i = 0; i < run.job_count; i++) {
+		free(run.jobs[i].path);
+	}
+	free(workers);
+	free(run.jobs);
+	return rc;
+}
+
+/* -------------------- Benchmarks ----------------------- */
+
+#define BENCH_DEFAULT_WARMUP 3
+#define BENCH_DEFAULT_ITERATIONS 15
+#define BENCH_DEFAULT_THRESHOLD 5.0 // Percent of median time per item, slower than that is a regression
+#define BENCH_MAX_ITERATIONS 1000
+#define BENCH_MAX_PROGRAMS 16
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MIX_PASSES 16        // Passes over the synthetic instruction mix per iteration
+#define BENCH_MIN_STEPS 1000000    // Guest instructions per iteration of execution benchmarks, programs are rerun to reach it
+#define BENCH_MAX_PROGRAM_STEPS 100000000
+
+// Repeated to fill memory for the decoder and clock estimation benchmarks
+static const char bench_mix_source[] =
+	"mov ax, bx\n"
+	"mov cl, 12\n"
+	"mov dx, 1000\n"
+	"mov [bx + si], ax\n"
+	"mov ax, [bp + di + 4]\n"
+	"mov word [bx], 7\n"
+	"mov [1000], ax\n"
+	"mov ax, [2000]\n"
+	"add ax, bx\n"
+	"add cx, 100\n"
+	"add [si + 2], dx\n"
+	"sub bx, [bp]\n"
+	"sub al, 3\n"
+	"cmp si, di\n"
+	"cmp word [di + 300], 5\n"
+	"jne $+2\n"
+	"je $+2\n"
+	"loop $+2\n";
+
+enum bench_kind {
+	BENCH_DECODE,  // `decode_instruction` over the synthetic mix
+	BENCH_CLOCKS,  // `estimate_executed_clocks` over the already decoded synthetic mix
+	BENCH_INSTRUCTION_CLOCKS, // `estimate_instruction_clocks` over the already decoded synthetic mix
+	BENCH_EXECUTE, // Running a program with one of the engines
+};
+
+struct bench {
+	char name[64];
+	const char *unit; // What the items of an iteration are
+	enum bench_kind kind;
+	enum sim_engine engine; // Only for BENCH_EXECUTE
+	const char *program;    // Only for BENCH_EXECUTE
+};
+
+struct bench_state {
+	struct memory *mem;
+	struct decode_cache *cache;
+	struct threaded_stats *threaded_stats;
+	struct jit *jit;
+
+	u32 mix_size;
+	struct instruction *mix;
+	u32 mix_count;
+
+	struct snapshot *snapshot; // Program as it was loaded
+	u32 program_size;
+	uint64_t program_steps;
+	// Rerunning the program leaves memory as the first run did, so it can be rerun without restoring the snapshot.
+	// Otherwise the snapshot is restored before every run, and the time it takes isn't counted.
+	bool rerunnable;
+
+	volatile uint64_t sink; // Results go here, so they can't be optimized away
+};
+
+struct bench_result {
+	char name[64];
+	const char *unit;
+	uint64_t items; // Per iteration
+	u32 iterations;
+	uint64_t min_ns, p10_ns, median_ns, p90_ns, max_ns; // Time per iteration
+};
+
+struct bench_baseline {
+	char name[64];
+	double ns_per_item;
+};
+
+// Fills memory with copies of `bench_mix_source` and decodes them once for the clock estimation benchmarks
+int setup_bench_mix(struct bench_state *state) {
+	u8 tile[256];
+	struct assemble_result result = assemble(bench_mix_source, sizeof(bench_mix_source) - 1, tile, sizeof(tile));
+	if (result.err != ASSEMBLE_OK) {
+		fprintf(stderr, "ERROR: Instruction mix:%d: %s\n", result.line, assemble_error_to_str(result.err));
+		return -1;
+	}
+
+	// Leave a bit of memory free, so `ip` can't wrap around while decoding the last instruction
+	state->mix_size = 0;
+	while (state->mix_size + result.size < MEMORY_SIZE - 256) {
+		memcpy(state->mem->mem + state->mix_size, tile, result.size);
+		state->mix_size += result.size;
+	}
+
+	state->mix_count = 0;
+	state->mix = malloc(state->mix_size * sizeof(struct instruction));
+	if (state->mix == NULL) return -1;
+	u16 ip = 0;
+	while (ip < state->mix_size) {
+		if (decode_instruction(state->mem, &ip, &state->mix[state->mix_count++]) != DECODE_OK) return -1;
+	}
+	return 0;
+}
+
+// Runs the program with the switch engine, returns how many instructions it took or -1 if it didn't finish
+int64_t count_bench_program_steps(struct bench_state *state, struct cpu_state *cpu) {
+	int64_t steps = 0;
+	struct instruction inst;
+	while (cpu->ip < state->program_size) {
+		enum decode_error err = decode_instruction_cached(state->cache, state->mem, &cpu->ip, &inst);
+		if (err == DECODE_ERR_EOF) break;
+		if (err != DECODE_OK || steps == BENCH_MAX_PROGRAM_STEPS) return -1;
+		execute_instruction(state->mem, cpu, &inst);
+		steps++;
+	}
+	return steps;
+}
+
+// Loads the program, counts how many instructions one run takes and checks if it can be rerun in place
+int setup_bench_program(struct bench_state *state, const char *path) {
+	struct memory *mem = state->mem;
+	memset(mem->mem, 0, MEMORY_SIZE);
+	reset_decode_cache(state->cache);
+	int size = load_program(mem, path);
+	if (size == -1) return -1;
+	state->program_size = size;
+
+	struct cpu_state cpu = { 0 };
+	take_snapshot(state->snapshot, mem, &cpu);
+
+	int64_t steps = count_bench_program_steps(state, &cpu);
+	if (steps == -1) {
+		fprintf(stderr, "ERROR: '%s' doesn't finish on its own\n", path);
+		return -1;
+	}
+	if (steps == 0) {
+		fprintf(stderr, "ERROR: '%s' doesn't execute anything\n", path);
+		return -1;
+	}
+	state->program_steps = steps;
+
+	// Programs like 52_memory_add_loop only take a few dozen instructions, restoring memory between each
+	// of their runs would take longer than the runs themselves
+	u8 *first_run = malloc(MEMORY_SIZE);
+	if (first_run == NULL) return -1;
+	memcpy(first_run, mem->mem, MEMORY_SIZE);
+	struct cpu_state first_cpu = cpu;
+
+	cpu = state->snapshot->cpu;
+	steps = count_bench_program_steps(state, &cpu);
+	state->rerunnable = (uint64_t)steps == state->program_steps &&
+		memcmp(first_run, mem->mem, MEMORY_SIZE) == 0 &&
+		memcmp(first_cpu.regs, cpu.regs, sizeof(cpu.regs)) == 0 &&
+		first_cpu.ip == cpu.ip &&
+		get_cpu_flags(&first_cpu) == get_cpu_flags(&cpu);
+	free(first_run);
+	return 0;
+}
+
+// Runs the program once from `cpu` with the benchmarked engine
+enum decode_error run_bench_program(struct bench_state *state, struct bench *bench, struct cpu_state *cpu) {
+	if (bench->engine == SIM_ENGINE_JIT) {
+		return run_jit(state->jit, state->mem, cpu, state->program_size);
+	} else if (bench->engine == SIM_ENGINE_THREADED) {
+		return run_threaded(state->mem, cpu, state->program_size, state->threaded_stats);
+	}
+
+	enum decode_error err = DECODE_OK;
+	struct instruction inst;
+	while (cpu->ip < state->program_size) {
+		err = decode_instruction_cached(state->cache, state->mem, &cpu->ip, &inst);
+		if (err != DECODE_OK) break;
+		execute_instruction(state->mem, cpu, &inst);
+	}
+	return err;
+}
+
+// Returns how many items were processed, or 0 on failure. The measured time is stored in `ns`.
+uint64_t run_bench_iteration(struct bench_state *state, struct bench *bench, uint64_t *ns) {
+	struct memory *mem = state->mem;
+	uint64_t items = 0;
+	struct instruction inst;
+
+	if (bench->kind == BENCH_EXECUTE) {
+		struct cpu_state cpu;
+		restore_snapshot(state->snapshot, mem, &cpu);
+		*ns = 0;
+		uint64_t start = get_time_ns();
+		while (items < BENCH_MIN_STEPS) {
+			if (!state->rerunnable) {
+				*ns += get_time_ns() - start;
+				restore_snapshot(state->snapshot, mem, &cpu);
+				start = get_time_ns();
+			}
+			cpu = state->snapshot->cpu;
+
+			enum decode_error err = run_bench_program(state, bench, &cpu);
+			if (err != DECODE_OK && err != DECODE_ERR_EOF) return 0;
+
+			state->sink += cpu.regs[0];
+			items += state->program_steps;
+		}
+		*ns += get_time_ns() - start;
+		return items;
+	}
+
+	uint64_t start = get_time_ns();
+	if (bench->kind == BENCH_DECODE) {
+		for (int pass = 0; pass < BENCH_MIX_PASSES; pass++) {
+			u16 ip = 0;
+			while (ip < state->mix_size) {
+				if (decode_instruction(mem, &ip, &inst) != DECODE_OK) return 0;
+				state->sink += inst.op;
+				items++;
+			}
+		}
+	} else if (bench->kind == BENCH_CLOCKS) {
+		struct cpu_state cpu = { .regs = { 1, 2, 3, 4, 5, 6, 7, 8 } }; // Mix of even and odd addresses
+		for (int pass = 0; pass < BENCH_MIX_PASSES; pass++) {
+			for (u32 i = 0; i < state->mix_count; i++) {
+				state->sink += get_total_clocks(estimate_executed_clocks(CPU_8086, &state->mix[i], &cpu));
+			}
+			items += state->mix_count;
+		}
+	} else if (bench->kind == BENCH_INSTRUCTION_CLOCKS) {
+		for (int pass = 0; pass < BENCH_MIX_PASSES; pass++) {
+			for (u32 i = 0; i < state->mix_count; i++) {
+				state->sink += estimate_instruction_clocks(&state->mix[i]);
+			}
+			items += state->mix_count;
+		}
+	}
+	*ns = get_time_ns() - start;
+
+	return items;
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// `times` must be sorted
+uint64_t get_percentile(const uint64_t *times, u32 count, u32 percent) {
+	return times[(uint64_t)(count - 1) * percent / 100];
+}
+
+void print_bench_result(FILE *dst, struct bench_result *result) {
+	fprintf(dst, "{\"name\":");
+	print_json_string(dst, result->name);
+	fprintf(dst, ",\"unit\":\"%s\",\"items\":%" PRIu64 ",\"iterations\":%u", result->unit, result->items, result->iterations);
+	fprintf(dst, ",\"min_ns\":%" PRIu64 ",\"p10_ns\":%" PRIu64 ",\"median_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+		result->min_ns, result->p10_ns, result->median_ns, result->p90_ns, result->max_ns);
+}
+
+// Reads results written by "bench --output", only the median time per item is used for comparing.
+// Returns the number of baselines, or -1 if the file couldn't be opened.
+int load_bench_baseline(const char *path, struct bench_baseline *baselines, u32 max_count) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) return -1;
+
+	u32 count = 0;
+	char line[512];
+	while (count < max_count && fgets(line, sizeof(line), file)) {
+		char *name = strstr(line, "\"name\":\"");
+		char *items = strstr(line, "\"items\":");
+		char *median = strstr(line, "\"median_ns\":");
+		if (name == NULL || items == NULL || median == NULL) continue;
+
+		struct bench_baseline *baseline = &baselines[count];
+		if (sscanf(name + 8, "%63[^\"]", baseline->name) != 1) continue;
+		double item_count = strtod(items + 8, NULL);
+		if (item_count <= 0) continue;
+		baseline->ns_per_item = strtod(median + 12, NULL) / item_count;
+		count++;
+	}
+
+	fclose(file);
+	return count;
+}
+
+// bench [--warmup N] [--iterations N] [--filter TEXT] [--program <file>]... [--output <file>] [--baseline <file> [--threshold PERCENT]]
+int run_bench(int argc, char **argv, int first_arg) {
+	u32 warmup = BENCH_DEFAULT_WARMUP;
+	u32 iterations = BENCH_DEFAULT_ITERATIONS;
+	double threshold = BENCH_DEFAULT_THRESHOLD;
+	const char *filter = NULL;
+	const char *output_path = NULL;
+	const char *baseline_path = NULL;
+	const char *programs[BENCH_MAX_PROGRAMS] = { "examples/52_memory_add_loop.asm", "examples/54_draw_rectangle.asm" };
+	u32 program_count = 2;
+	bool has_programs = false;
+
+	for (int i = first_arg; i < argc; i++) {
+		if (strequal(argv[i], "--warmup") && i+1 < argc) {
+			warmup = atoi(argv[++i]);
+		} else if (strequal(argv[i], "--iterations") && i+1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if (strequal(argv[i], "--threshold") && i+1 < argc) {
+			threshold = atof(argv[++i]);
+		} else if (strequal(argv[i], "--filter") && i+1 < argc) {
+			filter = argv[++i];
+		} else if (strequal(argv[i], "--output") && i+1 < argc) {
+			output_path = argv[++i];
+		} else if (strequal(argv[i], "--baseline") && i+1 < argc) {
+			baseline_path = argv[++i];
+		} else if (strequal(argv[i], "--program") && i+1 < argc) {
+			if (!has_programs) program_count = 0;
+			has_programs = true;
+			if (program_count == BENCH_MAX_PROGRAMS) {
+				fprintf(stderr, "ERROR: At most %d programs can be benchmarked\n", BENCH_MAX_PROGRAMS);
+				return -1;
+			}
+			programs[program_count++] = argv[++i];
+		} else {
+			fprintf(stderr, "ERROR: Unknown bench option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	if (iterations == 0 || iterations > BENCH_MAX_ITERATIONS) {
+		fprintf(stderr, "ERROR: Iterations must be between 1 and %d\n", BENCH_MAX_ITERATIONS);
+		return -1;
+	}
+
+	struct bench_baseline baselines[BENCH_MAX_RESULTS];
+	int baseline_count = 0;
+	if (baseline_path) {
+		baseline_count = load_bench_baseline(baseline_path, baselines, BENCH_MAX_RESULTS);
+		if (baseline_count == -1) {
+			fprintf(stderr, "ERROR: Opening baseline '%s': %d\n", baseline_path, errno);
+			return -1;
+		}
+	}
+
+	struct bench benches[3 + BENCH_MAX_PROGRAMS*3] = {
+		{ .name = "decode/mix", .unit = "instructions", .kind = BENCH_DECODE },
+		{ .name = "clocks/mix", .unit = "estimates", .kind = BENCH_CLOCKS },
+		{ .name = "clocks/instruction", .unit = "estimates", .kind = BENCH_INSTRUCTION_CLOCKS },
+	};
+	u32 bench_count = 3;
+	const char *engine_names[] = {
+		[SIM_ENGINE_SWITCH]   = "switch",
+		[SIM_ENGINE_THREADED] = "threaded",
+		[SIM_ENGINE_JIT]      = "jit",
+	};
+	for (u32 i = 0; i < program_count; i++) {
+		const char *name = strrchr(programs[i], '/');
+		name = name ? name + 1 : programs[i];
+		int name_size = strcspn(name, ".");
+		for (enum sim_engine engine = SIM_ENGINE_SWITCH; engine <= SIM_ENGINE_JIT; engine++) {
+			struct bench *bench = &benches[bench_count++];
+			snprintf(bench->name, sizeof(bench->name), "execute/%.*s/%s", name_size, name, engine_names[engine]);
+			bench->unit = "instructions";
+			bench->kind = BENCH_EXECUTE;
+			bench->engine = engine;
+			bench->program = programs[i];
+		}
+	}
+
+	struct bench_state state = {
+		.mem = calloc(1, sizeof(struct memory)),
+		.cache = calloc(1, sizeof(struct decode_cache)),
+		.threaded_stats = calloc(1, sizeof(struct threaded_stats)),
+		.snapshot = malloc(sizeof(struct snapshot)),
+	};
+	uint64_t *times = malloc((warmup + iterations) * sizeof(uint64_t));
+	if (!state.mem || !state.cache || !state.threaded_stats || !state.snapshot || !times) {
+		fprintf(stderr, "ERROR: Failed to allocate benchmark memory\n");
+		return -1;
+	}
+	state.mem->decode_cache = state.cache;
+
+	FILE *output = NULL;
+	if (output_path) {
+		output = fopen(output_path, "wb");
+		if (output == NULL) {
+			fprintf(stderr, "ERROR: Opening file '%s': %d\n", output_path, errno);
+			return -1;
+		}
+	}
+
+	int rc = 0;
+	u32 result_count = 0;
+	printf("%-40s %12s %12s %12s %14s\n", "benchmark", "median", "p10", "p90", "throughput");
+	for (u32 i = 0; i < bench_count; i++) {
+		struct bench *bench = &benches[i];
+		if (filter && !strstr(bench->name, filter)) continue;
+
+		int setup_rc = 0;
+		if (bench->kind == BENCH_EXECUTE) {
+			setup_rc = setup_bench_program(&state, bench->program);
+		} else {
+			setup_rc = state.mix ? 0 : setup_bench_mix(&state);
+		}
+		if (setup_rc) {
+			fprintf(stderr, "ERROR: Failed to set up '%s'\n", bench->name);
+			rc = -1;
+			continue;
+		}
+
+		if (bench->engine == SIM_ENGINE_JIT) {
+			state.jit = malloc(sizeof(struct jit));
+			if (state.jit == NULL || jit_init(state.jit)) {
+				printf("%-40s skipped, JIT is not supported on this host\n", bench->name);
+				free(state.jit);
+				state.jit = NULL;
+				continue;
+			}
+		}
+
+		uint64_t items = 0;
+		for (u32 j = 0; j < warmup + iterations; j++) {
+			items = run_bench_iteration(&state, bench, &times[j]);
+			if (items == 0) break;
+		}
+		if (state.jit) {
+			jit_free(state.jit);
+			free(state.jit);
+			state.jit = NULL;
+		}
+		if (items == 0) {
+			fprintf(stderr, "ERROR: '%s' failed to run\n", bench->name);
+			rc = -1;
+			continue;
+		}
+
+		uint64_t *measured = times + warmup;
+		qsort(measured, iterations, sizeof(uint64_t), compare_u64);
+		struct bench_result result = {
+			.unit = bench->unit,
+			.items = items,
+			.iterations = iterations,
+			.min_ns = measured[0],
+			.p10_ns = get_percentile(measured, iterations, 10),
+			.median_ns = get_percentile(measured, iterations, 50),
+			.p90_ns = get_percentile(measured, iterations, 90),
+			.max_ns = measured[iterations-1],
+		};
+		strcpy(result.name, bench->name);
+		if (output) print_bench_result(output, &result);
+		result_count++;
+
+		double ns_per_item = (double)result.median_ns / items;
+		printf("%-40s %9.3f ns %9.3f ns %9.3f ns %8.1f M/s", result.name, ns_per_item,
+			(double)result.p10_ns / items, (double)result.p90_ns / items, 1e3 / ns_per_item);
+		for (int j = 0; j < baseline_count; j++) {
+			if (!strequal(baselines[j].name, result.name)) continue;
+			double change = (ns_per_item - baselines[j].ns_per_item) / baselines[j].ns_per_item * 100;
+			printf("  %+6.1f%%", change);
+			if (change > threshold) {
+				printf(" REGRESSION");
+				rc = -1;
+			}
+		}
+		printf("\n");
+	}
+	printf("Times are per item, from %u iterations after %u warmup iterations\n", iterations, warmup);
+
+	if (output && fclose(output) != 0) {
+		fprintf(stderr, "ERROR: Writing file '%s': %d\n", output_path, errno);
+		rc = -1;
+	}
+	if (result_count == 0) {
+		fprintf(stderr, "ERROR: No benchmarks were run\n");
+		rc = -1;
+	}
+
+	free(state.mem);
+	free(state.cache);
+	free(state.threaded_stats);
+	free(state.snapshot);
+	free(state.mix);
+	free(times);
+	return rc;
+}
+
+int main(int argc, char **argv) {
+	init_decoder(); // Before any worker threads are started, see `init_decoder`
+
+	if (argc < 2) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	if (strequal(argv[1], "test-dump") && (argc == 3 || (argc == 4 && strequal(argv[3], "--nasm")))) {
+		return test_decoder(argv[2], argc == 4);
 
 	} else if (strequal(argv[1], "dump") && argc == 3) {
 		return dump_decompilation(argv[2]);
 
-	} else if (strequal(argv[1], "sim") && argc == 3) {
-		return run_simulation(argv[2]);
+	} else if (strequal(argv[1], "sim") && argc >= 3) {
+		struct sim_options options;
+		if (parse_sim_options(argc, argv, 3, &options)) return -1;
+		return run_simulation(argv[2], &options);
+
+	} else if (strequal(argv[1], "sim-dump") && argc >= 4) {
+		struct sim_options options;
+		if (parse_sim_options(argc, argv, 4, &options)) return -1;
+		return run_simulation_and_dump(argv[2], argv[3], &options);
+
+	} else if (strequal(argv[1], "profile") && argc >= 3) {
+		return run_profile(argc, argv, 2);
+
+	} else if (strequal(argv[1], "trace-dump") && argc == 3) {
+		return run_trace_dump(argv[2]);
+
+	} else if (strequal(argv[1], "dump-expand") && argc == 5) {
+		return run_dump_expand(argv[2], argv[3], argv[4]);
+
+	} else if (strequal(argv[1], "sim-batch") && argc >= 3) {
+		return run_batch(argc, argv, 2);
+
+	} else if (strequal(argv[1], "sim-lockstep") && argc >= 3) {
+		return run_lockstep_states(argc, argv, 2);
+
+	} else if (strequal(argv[1], "clocks") && argc >= 3) {
+		return run_clocks(argc, argv, 2);
+
+	} else if (strequal(argv[1], "test-all")) {
+		return run_test_all(argc, argv, 2);
 
-	} else if (strequal(argv[1], "sim-dump") && argc == 4) {
-		return run_simulation_and_dump(argv[2], argv[3]);
+	} else if (strequal(argv[1], "bench")) {
+		return run_bench(argc, argv, 2);
 
-	} else if (strequal(argv[1], "clocks") && argc == 3) {
-		return run_estimate_clocks(argv[2]);
+	} else if (strequal(argv[1], "precompile") && (argc == 3 || argc == 4)) {
+		return run_precompile(argv[2], argc == 4 ? argv[3] : NULL);
 
 	} else {
 		print_usage(argv[0]);
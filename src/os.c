@@ -0,0 +1,105 @@
+#include <time.h>
+
+#if defined(IS_LINUX)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Read-only view of a whole file. On Linux the file is memory mapped, elsewhere it is read into a heap buffer.
+struct mapped_file {
+    u8 *data;
+    size_t size;
+};
+
+int map_file(const char *filename, struct mapped_file *file) {
+    file->data = NULL;
+    file->size = 0;
+
+#if defined(IS_LINUX)
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        file->data = data;
+        file->size = st.st_size;
+    }
+
+    close(fd);
+    return 0;
+#else
+    FILE *stream = fopen(filename, "rb");
+    if (stream == NULL) {
+        return -1;
+    }
+
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(stream);
+        return -1;
+    }
+
+    if (size > 0) {
+        file->data = malloc(size);
+        if (file->data == NULL || fread(file->data, 1, size, stream) != (size_t)size) {
+            free(file->data);
+            file->data = NULL;
+            fclose(stream);
+            return -1;
+        }
+        file->size = size;
+    }
+
+    fclose(stream);
+    return 0;
+#endif
+}
+
+void unmap_file(struct mapped_file *file) {
+    if (file->data == NULL) return;
+
+#if defined(IS_LINUX)
+    munmap(file->data, file->size);
+#else
+    free(file->data);
+#endif
+    file->data = NULL;
+    file->size = 0;
+}
+
+int get_cpu_count() {
+#if defined(IS_LINUX)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#else
+    const char *count = getenv("NUMBER_OF_PROCESSORS");
+    return (count && atoi(count) > 0) ? atoi(count) : 1;
+#endif
+}
+
+// Monotonic time in nanoseconds, only meaningful as a difference between two calls
+uint64_t get_time_ns() {
+#if defined(IS_LINUX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -9,6 +9,8 @@
 
 #if defined(IS_LINUX)
     #include <stdio.h>
+    #include <limits.h>
+    #include <unistd.h>
     #define MAX_PATH_SIZE PATH_MAX
 #elif defined(IS_WINDOWS)
     #define MAX_PATH_SIZE 260
@@ -0,0 +1,742 @@
+// Two pass assembler for the subset of NASM syntax which "decoder.c" understands:
+//     mov, add, sub, cmp, conditional jumps and loops
+//     labels ("name:"), "$" for the address of the current line, "bits 16", "db" and "dw"
+//     numbers in decimal, hex ("0x10", "10h"), binary ("0b10", "10b") or characters ('a'),
+//     combined with + - * / % and parentheses
+//
+// The first pass only measures lines to find the addresses of labels, the second one emits bytes.
+// A value which depends on a label defined further down isn't known during the first pass,
+// so it always gets the long encoding (16 bit displacement or immediate) to keep the size of the line
+// the same in both passes. Otherwise the shortest encoding is picked, the same one NASM would pick.
+// Jumps are always short.
+
+#define ASSEMBLE_MAX_LABELS 4096
+
+enum assemble_error {
+    ASSEMBLE_OK,
+    ASSEMBLE_ERR_SYNTAX,
+    ASSEMBLE_ERR_UNKNOWN_INSTRUCTION,
+    ASSEMBLE_ERR_INVALID_OPERANDS,
+    ASSEMBLE_ERR_MISSING_SIZE,
+    ASSEMBLE_ERR_OUT_OF_RANGE,
+    ASSEMBLE_ERR_UNKNOWN_LABEL,
+    ASSEMBLE_ERR_DUPLICATE_LABEL,
+    ASSEMBLE_ERR_TOO_MANY_LABELS,
+    ASSEMBLE_ERR_JUMP_TOO_FAR,
+    ASSEMBLE_ERR_TOO_BIG,
+    ASSEMBLE_ERR_ALLOCATION,
+};
+
+struct assemble_result {
+    enum assemble_error err;
+    u32 line; // Line of the error, starting from 1
+    u32 size; // Number of bytes written to the output
+};
+
+struct asm_label {
+    const char *name; // Points into the source
+    u32 name_size;
+    u32 line;
+    u16 address;
+};
+
+struct assembler {
+    const char *cursor;   // Position in the current line
+    const char *line_end;
+    u32 line;
+    u32 line_address;     // Value of "$"
+    u32 address;
+
+    bool emitting;        // False during the first pass
+    u8 *output;
+    u32 max_size;
+
+    struct asm_label *labels;
+    u32 label_count;
+};
+
+enum asm_operand_kind {
+    ASM_OPERAND_REG,
+    ASM_OPERAND_MEM,
+    ASM_OPERAND_IMMEDIATE,
+};
+
+struct asm_operand {
+    enum asm_operand_kind kind;
+    u8 size;        // 1 for "byte", 2 for "word", 0 if not given
+    bool forward;   // Value or displacement depends on a label defined further down
+    enum reg_value reg;
+    struct mem_value mem;
+    i32 value;
+};
+
+// Bytes of a single instruction
+struct asm_encoding {
+    u8 bytes[MAX_INSTRUCTION_SIZE];
+    u8 size;
+};
+
+static const struct {
+    const char *name;
+    enum operation op;
+} asm_mnemonics[] = {
+    { "mov", OP_MOV }, { "add", OP_ADD }, { "sub", OP_SUB }, { "cmp", OP_CMP },
+    { "je", OP_JE }, { "jz", OP_JE },
+    { "jl", OP_JL }, { "jnge", OP_JL },
+    { "jle", OP_JLE }, { "jng", OP_JLE },
+    { "jb", OP_JB }, { "jnae", OP_JB }, { "jc", OP_JB },
+    { "jbe", OP_JBE }, { "jna", OP_JBE },
+    { "jp", OP_JP }, { "jpe", OP_JP },
+    { "jo", OP_JO },
+    { "js", OP_JS },
+    { "jne", OP_JNE }, { "jnz", OP_JNE },
+    { "jnl", OP_JNL }, { "jge", OP_JNL },
+    { "jnle", OP_JNLE }, { "jg", OP_JNLE },
+    { "jnb", OP_JNB }, { "jae", OP_JNB }, { "jnc", OP_JNB },
+    { "jnbe", OP_JNBE }, { "ja", OP_JNBE },
+    { "jnp", OP_JNP }, { "jpo", OP_JNP },
+    { "jno", OP_JNO },
+    { "jns", OP_JNS },
+    { "loop", OP_LOOP },
+    { "loopz", OP_LOOPZ }, { "loope", OP_LOOPZ },
+    { "loopnz", OP_LOOPNZ }, { "loopne", OP_LOOPNZ },
+    { "jcxz", OP_JCXZ },
+};
+
+const char *assemble_error_to_str(enum assemble_error err) {
+    switch (err) {
+    case ASSEMBLE_OK:
+        return "ok";
+    case ASSEMBLE_ERR_SYNTAX:
+        return "Syntax error";
+    case ASSEMBLE_ERR_UNKNOWN_INSTRUCTION:
+        return "Unknown or unsupported instruction";
+    case ASSEMBLE_ERR_INVALID_OPERANDS:
+        return "Invalid combination of operands";
+    case ASSEMBLE_ERR_MISSING_SIZE:
+        return "Operation size not specified, use \"byte\" or \"word\"";
+    case ASSEMBLE_ERR_OUT_OF_RANGE:
+        return "Value doesn't fit in the operand";
+    case ASSEMBLE_ERR_UNKNOWN_LABEL:
+        return "Label is not defined";
+    case ASSEMBLE_ERR_DUPLICATE_LABEL:
+        return "Label is defined more than once";
+    case ASSEMBLE_ERR_TOO_MANY_LABELS:
+        return "Too many labels";
+    case ASSEMBLE_ERR_JUMP_TOO_FAR:
+        return "Jump target is too far away for a short jump";
+    case ASSEMBLE_ERR_TOO_BIG:
+        return "Program doesn't fit in the output";
+    case ASSEMBLE_ERR_ALLOCATION:
+        return "Failed to allocate memory for labels";
+    default:
+        return "<unknown>";
+    }
+}
+
+static bool is_asm_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_asm_ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
+
+static bool is_asm_ident_char(char c) {
+    return is_asm_ident_start(c) || is_asm_digit(c);
+}
+
+static char asm_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Case insensitive, like mnemonics and registers in NASM
+static bool asm_name_equal(const char *name, u32 name_size, const char *keyword) {
+    for (u32 i = 0; i < name_size; i++) {
+        if (keyword[i] == '\0' || asm_lower(name[i]) != keyword[i]) return false;
+    }
+    return keyword[name_size] == '\0';
+}
+
+static int asm_find_reg(const char *name, u32 name_size) {
+    for (enum reg_value reg = REG_AL; reg < __REG_COUNT; reg++) {
+        if (asm_name_equal(name, name_size, reg_to_str(reg))) return reg;
+    }
+    return -1;
+}
+
+static void asm_skip_space(struct assembler *as) {
+    while (as->cursor < as->line_end && (*as->cursor == ' ' || *as->cursor == '\t' || *as->cursor == '\r')) {
+        as->cursor++;
+    }
+}
+
+static bool asm_at_line_end(struct assembler *as) {
+    asm_skip_space(as);
+    return as->cursor == as->line_end || *as->cursor == ';';
+}
+
+static bool asm_accept(struct assembler *as, char c) {
+    asm_skip_space(as);
+    if (as->cursor < as->line_end && *as->cursor == c) {
+        as->cursor++;
+        return true;
+    }
+    return false;
+}
+
+// Returns the size of the identifier, or 0 if there is none at the cursor
+static u32 asm_read_ident(struct assembler *as, const char **name) {
+    asm_skip_space(as);
+    *name = as->cursor;
+    if (as->cursor == as->line_end || !is_asm_ident_start(*as->cursor)) return 0;
+    while (as->cursor < as->line_end && is_asm_ident_char(*as->cursor)) {
+        as->cursor++;
+    }
+    return as->cursor - *name;
+}
+
+// Same as `asm_read_ident`, but only consumes the identifier if it is `keyword`
+static bool asm_accept_keyword(struct assembler *as, const char *keyword) {
+    const char *start = as->cursor;
+    const char *name;
+    u32 name_size = asm_read_ident(as, &name);
+    if (name_size > 0 && asm_name_equal(name, name_size, keyword)) return true;
+    as->cursor = start;
+    return false;
+}
+
+static struct asm_label *asm_find_label(struct assembler *as, const char *name, u32 name_size) {
+    for (u32 i = 0; i < as->label_count; i++) {
+        struct asm_label *label = &as->labels[i];
+        if (label->name_size == name_size && memcmp(label->name, name, name_size) == 0) return label;
+    }
+    return NULL;
+}
+
+static enum assemble_error asm_parse_number(struct assembler *as, i32 *value) {
+    const char *start = as->cursor;
+    while (as->cursor < as->line_end && is_asm_ident_char(*as->cursor)) {
+        as->cursor++;
+    }
+    const char *end = as->cursor;
+
+    u32 base = 10;
+    if (end - start > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+        base = 16;
+        start += 2;
+    } else if (end - start > 2 && start[0] == '0' && (start[1] == 'b' || start[1] == 'B')) {
+        base = 2;
+        start += 2;
+    } else if (end - start > 1 && asm_lower(end[-1]) == 'h') {
+        base = 16;
+        end--;
+    } else if (end - start > 1 && asm_lower(end[-1]) == 'b') {
+        base = 2;
+        end--;
+    }
+
+    i32 result = 0;
+    for (const char *c = start; c < end; c++) {
+        char digit = asm_lower(*c);
+        u32 digit_value;
+        if (is_asm_digit(digit)) {
+            digit_value = digit - '0';
+        } else if (digit >= 'a' && digit <= 'f') {
+            digit_value = digit - 'a' + 10;
+        } else if (digit == '_') {
+            continue;
+        } else {
+            return ASSEMBLE_ERR_SYNTAX;
+        }
+        if (digit_value >= base) return ASSEMBLE_ERR_SYNTAX;
+
+        result = result * base + digit_value;
+        if (result > 0xFFFFF) return ASSEMBLE_ERR_OUT_OF_RANGE;
+    }
+
+    *value = result;
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_parse_expr(struct assembler *as, i32 *value, bool *forward);
+
+static enum assemble_error asm_parse_factor(struct assembler *as, i32 *value, bool *forward) {
+    if (asm_accept(as, '(')) {
+        enum assemble_error err = asm_parse_expr(as, value, forward);
+        if (err != ASSEMBLE_OK) return err;
+        return asm_accept(as, ')') ? ASSEMBLE_OK : ASSEMBLE_ERR_SYNTAX;
+    }
+    if (asm_accept(as, '-')) {
+        enum assemble_error err = asm_parse_factor(as, value, forward);
+        *value = -*value;
+        return err;
+    }
+    if (asm_accept(as, '+')) {
+        return asm_parse_factor(as, value, forward);
+    }
+
+    asm_skip_space(as);
+    if (as->cursor == as->line_end) return ASSEMBLE_ERR_SYNTAX;
+
+    char c = *as->cursor;
+    if (c == '$' && (as->cursor+1 == as->line_end || !is_asm_ident_char(as->cursor[1]))) {
+        as->cursor++;
+        *value = as->line_address;
+        return ASSEMBLE_OK;
+    }
+    if (is_asm_digit(c)) {
+        return asm_parse_number(as, value);
+    }
+    if (c == '\'' || c == '"') {
+        if (as->line_end - as->cursor < 3 || as->cursor[2] != c) return ASSEMBLE_ERR_SYNTAX;
+        *value = (u8)as->cursor[1];
+        as->cursor += 3;
+        return ASSEMBLE_OK;
+    }
+
+    const char *name;
+    u32 name_size = asm_read_ident(as, &name);
+    if (name_size == 0 || asm_find_reg(name, name_size) != -1) return ASSEMBLE_ERR_SYNTAX;
+
+    // During the first pass only labels above this line are known
+    struct asm_label *label = asm_find_label(as, name, name_size);
+    if (label == NULL) {
+        if (as->emitting) return ASSEMBLE_ERR_UNKNOWN_LABEL;
+        *value = 0;
+        *forward = true;
+    } else {
+        *value = label->address;
+        if (label->line > as->line) *forward = true;
+    }
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_parse_term(struct assembler *as, i32 *value, bool *forward) {
+    enum assemble_error err = asm_parse_factor(as, value, forward);
+    while (err == ASSEMBLE_OK) {
+        char op;
+        if (asm_accept(as, '*')) {
+            op = '*';
+        } else if (asm_accept(as, '/')) {
+            op = '/';
+        } else if (asm_accept(as, '%')) {
+            op = '%';
+        } else {
+            break;
+        }
+
+        i32 rhs;
+        err = asm_parse_factor(as, &rhs, forward);
+        if (err != ASSEMBLE_OK) break;
+        if (op == '*') {
+            *value *= rhs;
+        } else if (rhs == 0) {
+            // Forward labels are 0 during the first pass
+            if (as->emitting || !*forward) err = ASSEMBLE_ERR_SYNTAX;
+            *value = 0;
+        } else if (op == '/') {
+            *value /= rhs;
+        } else {
+            *value %= rhs;
+        }
+        if (*value > 0xFFFFF || *value < -0xFFFFF) err = ASSEMBLE_ERR_OUT_OF_RANGE;
+    }
+    return err;
+}
+
+static enum assemble_error asm_parse_expr(struct assembler *as, i32 *value, bool *forward) {
+    enum assemble_error err = asm_parse_term(as, value, forward);
+    while (err == ASSEMBLE_OK) {
+        i32 sign;
+        if (asm_accept(as, '+')) {
+            sign = 1;
+        } else if (asm_accept(as, '-')) {
+            sign = -1;
+        } else {
+            break;
+        }
+
+        i32 rhs;
+        err = asm_parse_term(as, &rhs, forward);
+        *value += sign * rhs;
+    }
+    return err;
+}
+
+// Parses the inside of "[...]", after the opening bracket.
+// Look at "Table 4-10. R/M (Register/Memory) Field Encoding" for which register pairs exist.
+static enum assemble_error asm_parse_mem(struct assembler *as, struct asm_operand *operand) {
+    int base = -1;  // bx or bp
+    int index = -1; // si or di
+    i32 disp = 0;
+    bool first = true;
+    while (!asm_accept(as, ']')) {
+        i32 sign = 1;
+        if (asm_accept(as, '-')) {
+            sign = -1;
+        } else if (!asm_accept(as, '+') && !first) {
+            return ASSEMBLE_ERR_SYNTAX;
+        }
+        first = false;
+
+        const char *start = as->cursor;
+        const char *name;
+        u32 name_size = asm_read_ident(as, &name);
+        int reg = name_size > 0 ? asm_find_reg(name, name_size) : -1;
+        if (reg == -1) {
+            as->cursor = start;
+            i32 value;
+            enum assemble_error err = asm_parse_term(as, &value, &operand->forward);
+            if (err != ASSEMBLE_OK) return err;
+            disp += sign * value;
+        } else if (sign < 0) {
+            return ASSEMBLE_ERR_INVALID_OPERANDS;
+        } else if ((reg == REG_BX || reg == REG_BP) && base == -1) {
+            base = reg;
+        } else if ((reg == REG_SI || reg == REG_DI) && index == -1) {
+            index = reg;
+        } else {
+            return ASSEMBLE_ERR_INVALID_OPERANDS;
+        }
+    }
+    if (first) return ASSEMBLE_ERR_SYNTAX;
+    if (disp < -0x8000 || disp > 0xFFFF) return ASSEMBLE_ERR_OUT_OF_RANGE;
+
+    if (base == REG_BX) {
+        operand->mem.base = index == REG_SI ? MEM_BASE_BX_SI : index == REG_DI ? MEM_BASE_BX_DI : MEM_BASE_BX;
+    } else if (base == REG_BP) {
+        operand->mem.base = index == REG_SI ? MEM_BASE_BP_SI : index == REG_DI ? MEM_BASE_BP_DI : MEM_BASE_BP;
+    } else if (index != -1) {
+        operand->mem.base = index == REG_SI ? MEM_BASE_SI : MEM_BASE_DI;
+    } else {
+        operand->mem.base = MEM_BASE_DIRECT_ADDRESS;
+    }
+    operand->mem.disp = disp;
+    operand->kind = ASM_OPERAND_MEM;
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_parse_operand(struct assembler *as, struct asm_operand *operand) {
+    memset(operand, 0, sizeof(*operand));
+    if (asm_accept_keyword(as, "byte")) {
+        operand->size = 1;
+    } else if (asm_accept_keyword(as, "word")) {
+        operand->size = 2;
+    }
+
+    if (asm_accept(as, '[')) {
+        return asm_parse_mem(as, operand);
+    }
+
+    const char *start = as->cursor;
+    const char *name;
+    u32 name_size = asm_read_ident(as, &name);
+    int reg = name_size > 0 ? asm_find_reg(name, name_size) : -1;
+    if (reg != -1) {
+        if (operand->size != 0) return ASSEMBLE_ERR_INVALID_OPERANDS;
+        operand->kind = ASM_OPERAND_REG;
+        operand->reg = reg;
+        return ASSEMBLE_OK;
+    }
+
+    as->cursor = start;
+    operand->kind = ASM_OPERAND_IMMEDIATE;
+    return asm_parse_expr(as, &operand->value, &operand->forward);
+}
+
+static void asm_push_u8(struct asm_encoding *enc, u8 value) {
+    assert(enc->size < MAX_INSTRUCTION_SIZE);
+    enc->bytes[enc->size++] = value;
+}
+
+static void asm_push_u16(struct asm_encoding *enc, u16 value) {
+    asm_push_u8(enc, value & 0xFF);
+    asm_push_u8(enc, value >> 8);
+}
+
+static bool is_asm_reg_wide(enum reg_value reg) {
+    return reg >= REG_AX;
+}
+
+static bool does_value_fit(i32 value, bool wide) {
+    return wide ? (value >= -0x8000 && value <= 0xFFFF) : (value >= -0x80 && value <= 0xFF);
+}
+
+// Value can be encoded as a sign extended byte
+static bool does_value_fit_i8(i32 value) {
+    return (value >= -0x80 && value <= 0x7F) || (value >= 0xFF80 && value <= 0xFFFF);
+}
+
+// Reverse of `decode_reg_or_mem`, pushes the mod/reg/rm byte and the displacement
+static void asm_push_mod_rm(struct asm_encoding *enc, u8 reg, struct asm_operand *rm) {
+    if (rm->kind == ASM_OPERAND_REG) {
+        asm_push_u8(enc, 0b11000000 | (reg << 3) | (rm->reg & 0b111));
+        return;
+    }
+
+    i16 disp = rm->mem.disp;
+    if (rm->mem.base == MEM_BASE_DIRECT_ADDRESS) {
+        asm_push_u8(enc, 0b00000110 | (reg << 3));
+        asm_push_u16(enc, disp);
+    } else if (disp == 0 && !rm->forward && rm->mem.base != MEM_BASE_BP) {
+        asm_push_u8(enc, 0b00000000 | (reg << 3) | rm->mem.base);
+    } else if (disp >= -0x80 && disp <= 0x7F && !rm->forward) {
+        asm_push_u8(enc, 0b01000000 | (reg << 3) | rm->mem.base);
+        asm_push_u8(enc, disp);
+    } else {
+        asm_push_u8(enc, 0b10000000 | (reg << 3) | rm->mem.base);
+        asm_push_u16(enc, disp);
+    }
+}
+
+static void asm_push_immediate(struct asm_encoding *enc, i32 value, bool wide) {
+    if (wide) {
+        asm_push_u16(enc, value);
+    } else {
+        asm_push_u8(enc, value);
+    }
+}
+
+// Width of a two operand instruction, from the registers or the "byte"/"word" specifiers.
+// Returns -1 if they disagree and 0 if nothing specifies it.
+static int get_asm_operation_size(struct asm_operand *dest, struct asm_operand *src) {
+    int size = 0;
+    struct asm_operand *operands[2] = { dest, src };
+    for (int i = 0; i < 2; i++) {
+        int operand_size = operands[i]->size;
+        if (operands[i]->kind == ASM_OPERAND_REG) {
+            operand_size = is_asm_reg_wide(operands[i]->reg) ? 2 : 1;
+        }
+        if (operand_size == 0) continue;
+        if (size != 0 && size != operand_size) return -1;
+        size = operand_size;
+    }
+    return size;
+}
+
+// Handy reference: Table 4-12. 8086 Instruction Encoding
+static enum assemble_error asm_encode_two_operands(enum operation op, struct asm_operand *dest, struct asm_operand *src, struct asm_encoding *enc) {
+    if (dest->kind == ASM_OPERAND_IMMEDIATE || (dest->kind == ASM_OPERAND_MEM && src->kind == ASM_OPERAND_MEM)) {
+        return ASSEMBLE_ERR_INVALID_OPERANDS;
+    }
+
+    int size = get_asm_operation_size(dest, src);
+    if (size == -1) return ASSEMBLE_ERR_INVALID_OPERANDS;
+    if (size == 0) return ASSEMBLE_ERR_MISSING_SIZE;
+    bool wide = size == 2;
+
+    if (src->kind == ASM_OPERAND_IMMEDIATE && !does_value_fit(src->value, wide)) {
+        return ASSEMBLE_ERR_OUT_OF_RANGE;
+    }
+
+    bool is_dest_acc = dest->kind == ASM_OPERAND_REG && (dest->reg == REG_AL || dest->reg == REG_AX);
+    bool is_src_acc = src->kind == ASM_OPERAND_REG && (src->reg == REG_AL || src->reg == REG_AX);
+
+    if (op == OP_MOV) {
+        if (src->kind == ASM_OPERAND_IMMEDIATE) {
+            if (dest->kind == ASM_OPERAND_REG) {
+                asm_push_u8(enc, 0b10110000 | (wide << 3) | (dest->reg & 0b111));
+            } else {
+                asm_push_u8(enc, 0b11000110 | wide);
+                asm_push_mod_rm(enc, 0, dest);
+            }
+            asm_push_immediate(enc, src->value, wide);
+        } else if (is_dest_acc && src->kind == ASM_OPERAND_MEM && src->mem.base == MEM_BASE_DIRECT_ADDRESS) {
+            asm_push_u8(enc, 0b10100000 | wide);
+            asm_push_u16(enc, src->mem.disp);
+        } else if (is_src_acc && dest->kind == ASM_OPERAND_MEM && dest->mem.base == MEM_BASE_DIRECT_ADDRESS) {
+            asm_push_u8(enc, 0b10100010 | wide);
+            asm_push_u16(enc, dest->mem.disp);
+        } else if (src->kind == ASM_OPERAND_MEM) {
+            asm_push_u8(enc, 0b10001010 | wide);
+            asm_push_mod_rm(enc, dest->reg & 0b111, src);
+        } else {
+            asm_push_u8(enc, 0b10001000 | wide);
+            asm_push_mod_rm(enc, src->reg & 0b111, dest);
+        }
+        return ASSEMBLE_OK;
+    }
+
+    u8 variant = 0;
+    for (u8 i = 0; i < ARRAY_LEN(alu_variant_lookup); i++) {
+        if (alu_variant_lookup[i].supported && alu_variant_lookup[i].op == op) variant = i;
+    }
+
+    if (src->kind == ASM_OPERAND_IMMEDIATE) {
+        if (is_dest_acc && !wide) {
+            asm_push_u8(enc, (variant << 3) | 0b100);
+            asm_push_immediate(enc, src->value, false);
+        } else if (wide && does_value_fit_i8(src->value) && !src->forward) {
+            asm_push_u8(enc, 0b10000011);
+            asm_push_mod_rm(enc, variant, dest);
+            asm_push_u8(enc, src->value);
+        } else if (is_dest_acc) {
+            asm_push_u8(enc, (variant << 3) | 0b101);
+            asm_push_immediate(enc, src->value, true);
+        } else {
+            asm_push_u8(enc, 0b10000000 | wide);
+            asm_push_mod_rm(enc, variant, dest);
+            asm_push_immediate(enc, src->value, wide);
+        }
+    } else if (src->kind == ASM_OPERAND_MEM) {
+        asm_push_u8(enc, (variant << 3) | 0b010 | wide);
+        asm_push_mod_rm(enc, dest->reg & 0b111, src);
+    } else {
+        asm_push_u8(enc, (variant << 3) | 0b000 | wide);
+        asm_push_mod_rm(enc, src->reg & 0b111, dest);
+    }
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_encode_jump(struct assembler *as, enum operation op, struct asm_operand *target, struct asm_encoding *enc) {
+    if (target->kind != ASM_OPERAND_IMMEDIATE || target->size != 0) return ASSEMBLE_ERR_INVALID_OPERANDS;
+
+    u8 opcode = 0;
+    for (u8 i = 0; i < ARRAY_LEN(cond_jmp_lookup); i++) {
+        if (cond_jmp_lookup[i] == op) opcode = 0b01110000 | i;
+    }
+    for (u8 i = 0; i < ARRAY_LEN(cond_loop_jmp_lookup); i++) {
+        if (cond_loop_jmp_lookup[i] == op) opcode = 0b11100000 | i;
+    }
+
+    i32 offset = target->value - (i32)(as->line_address + 2);
+    if (as->emitting && (offset < -0x80 || offset > 0x7F)) return ASSEMBLE_ERR_JUMP_TOO_FAR;
+
+    asm_push_u8(enc, opcode);
+    asm_push_u8(enc, offset);
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_emit(struct assembler *as, const u8 *bytes, u32 size) {
+    if (as->address + size > as->max_size) return ASSEMBLE_ERR_TOO_BIG;
+    if (as->emitting) memcpy(as->output + as->address, bytes, size);
+    as->address += size;
+    return ASSEMBLE_OK;
+}
+
+// "db" and "dw", a list of values separated by commas
+static enum assemble_error asm_parse_data(struct assembler *as, bool wide) {
+    do {
+        i32 value;
+        bool forward = false;
+        enum assemble_error err = asm_parse_expr(as, &value, &forward);
+        if (err != ASSEMBLE_OK) return err;
+        if (!does_value_fit(value, wide)) return ASSEMBLE_ERR_OUT_OF_RANGE;
+
+        u8 bytes[2] = { value & 0xFF, (value >> 8) & 0xFF };
+        err = asm_emit(as, bytes, wide ? 2 : 1);
+        if (err != ASSEMBLE_OK) return err;
+    } while (asm_accept(as, ','));
+    return ASSEMBLE_OK;
+}
+
+static enum assemble_error asm_parse_line(struct assembler *as) {
+    as->line_address = as->address;
+    if (asm_at_line_end(as)) return ASSEMBLE_OK;
+
+    const char *name;
+    u32 name_size = asm_read_ident(as, &name);
+    if (name_size == 0) return ASSEMBLE_ERR_SYNTAX;
+
+    if (asm_accept(as, ':')) {
+        if (!as->emitting) {
+            if (asm_find_label(as, name, name_size)) return ASSEMBLE_ERR_DUPLICATE_LABEL;
+            if (as->label_count == ASSEMBLE_MAX_LABELS) return ASSEMBLE_ERR_TOO_MANY_LABELS;
+            as->labels[as->label_count++] = (struct asm_label){
+                .name = name,
+                .name_size = name_size,
+                .line = as->line,
+                .address = as->address
+            };
+        }
+
+        if (asm_at_line_end(as)) return ASSEMBLE_OK;
+        name_size = asm_read_ident(as, &name);
+        if (name_size == 0) return ASSEMBLE_ERR_SYNTAX;
+    }
+
+    enum assemble_error err = ASSEMBLE_OK;
+    if (asm_name_equal(name, name_size, "bits")) {
+        i32 bits;
+        bool forward = false;
+        err = asm_parse_expr(as, &bits, &forward);
+        if (err == ASSEMBLE_OK && bits != 16) err = ASSEMBLE_ERR_INVALID_OPERANDS;
+    } else if (asm_name_equal(name, name_size, "db") || asm_name_equal(name, name_size, "dw")) {
+        err = asm_parse_data(as, asm_lower(name[1]) == 'w');
+    } else {
+        int mnemonic = -1;
+        for (u32 i = 0; i < ARRAY_LEN(asm_mnemonics); i++) {
+            if (asm_name_equal(name, name_size, asm_mnemonics[i].name)) mnemonic = i;
+        }
+        if (mnemonic == -1) return ASSEMBLE_ERR_UNKNOWN_INSTRUCTION;
+        enum operation op = asm_mnemonics[mnemonic].op;
+
+        struct asm_encoding enc = { 0 };
+        struct asm_operand dest, src;
+        if (op == OP_MOV || op == OP_ADD || op == OP_SUB || op == OP_CMP) {
+            err = asm_parse_operand(as, &dest);
+            if (err == ASSEMBLE_OK && !asm_accept(as, ',')) err = ASSEMBLE_ERR_SYNTAX;
+            if (err == ASSEMBLE_OK) err = asm_parse_operand(as, &src);
+            if (err == ASSEMBLE_OK) err = asm_encode_two_operands(op, &dest, &src, &enc);
+        } else {
+            asm_accept_keyword(as, "short");
+            err = asm_parse_operand(as, &dest);
+            if (err == ASSEMBLE_OK) err = asm_encode_jump(as, op, &dest, &enc);
+        }
+        if (err == ASSEMBLE_OK) err = asm_emit(as, enc.bytes, enc.size);
+    }
+
+    if (err == ASSEMBLE_OK && !asm_at_line_end(as)) err = ASSEMBLE_ERR_SYNTAX;
+    return err;
+}
+
+static enum assemble_error asm_run_pass(struct assembler *as, const char *source, size_t size, struct assemble_result *result) {
+    const char *end = source + size;
+    const char *line = source;
+    as->line = 0;
+    as->address = 0;
+    while (line < end) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) line_end = end;
+
+        as->line++;
+        as->cursor = line;
+        as->line_end = line_end;
+        enum assemble_error err = asm_parse_line(as);
+        if (err != ASSEMBLE_OK) {
+            result->line = as->line;
+            return err;
+        }
+
+        line = line_end + 1;
+    }
+    return ASSEMBLE_OK;
+}
+
+// Assembles `source` into `output`, which has room for `max_size` bytes.
+// On failure `result.line` tells where, and `output` could be partially written.
+struct assemble_result assemble(const char *source, size_t size, u8 *output, u32 max_size) {
+    struct assemble_result result = { 0 };
+    struct assembler as = {
+        .output = output,
+        .max_size = max_size,
+        .labels = malloc(ASSEMBLE_MAX_LABELS * sizeof(struct asm_label)),
+    };
+    if (as.labels == NULL) {
+        result.err = ASSEMBLE_ERR_ALLOCATION;
+        return result;
+    }
+
+    result.err = asm_run_pass(&as, source, size, &result);
+    if (result.err == ASSEMBLE_OK) {
+        as.emitting = true;
+        result.err = asm_run_pass(&as, source, size, &result);
+    }
+    if (result.err == ASSEMBLE_OK) {
+        result.size = as.address;
+    }
+
+    free(as.labels);
+    return result;
+}
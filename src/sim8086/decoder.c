@@ -34,6 +34,29 @@ const enum operation cond_loop_jmp_lookup[4] = {
     [0b11] = OP_JCXZ
 };
 
+// Bytes of a single instruction are pulled from here. Reading past `size` doesn't fail right away,
+// it only marks `overrun` so handlers don't need to check every pull.
+struct decode_input {
+    const u8 *data;
+    size_t size;
+    size_t offset;
+    bool overrun;
+};
+
+static u8 pull_u8(struct decode_input *input) {
+    if (input->offset >= input->size) {
+        input->overrun = true;
+        return 0;
+    }
+    return input->data[input->offset++];
+}
+
+static u16 pull_u16(struct decode_input *input) {
+    u8 low = pull_u8(input);
+    u8 high = pull_u8(input);
+    return low | (high << 8);
+}
+
 static i16 extend_sign_bit(i8 number) {
     if (number & 0b10000000) {
         return number | (0b11111111 << 8);
@@ -72,8 +95,7 @@ static enum mem_base decode_mem_base(u8 rm) {
 // Table 4-10. R/M (Register/Memory) Field Encoding
 static void decode_reg_or_mem(
         struct reg_or_mem_value *value,
-        struct memory *mem,
-        u16 *addr,
+        struct decode_input *input,
         u8 rm,
         u8 mod,
         bool wide
@@ -82,19 +104,19 @@ static void decode_reg_or_mem(
         value->is_reg = true;
         value->reg = decode_reg(rm, wide);
     } else if (mod == 0b10) { // Mod = 0b10, memory with i16 displacement
-        i16 displacement = pull_u16_at(mem, addr);
+        i16 displacement = pull_u16(input);
         value->is_reg = false;
         value->mem.base = decode_mem_base(rm);
         value->mem.disp = displacement;
     } else if (mod == 0b01) { // Mod = 0b01, memory with i8 displacement
-        i8 displacement = pull_u8_at(mem, addr);
+        i8 displacement = pull_u8(input);
         value->is_reg = false;
         value->mem.base = decode_mem_base(rm);
         value->mem.disp = extend_sign_bit(displacement);
     } else if (mod == 0b00) { // Mod = 0b00, memory no displacement (most of the time)
         value->is_reg = false;
         if (rm == 0b110) { // Direct address
-            u16 address = pull_u16_at(mem, addr);
+            u16 address = pull_u16(input);
             value->mem.base = MEM_BASE_DIRECT_ADDRESS;
             value->mem.disp = address;
         } else {
@@ -108,14 +130,13 @@ static void decode_reg_or_mem(
 
 static void deocde_reg_or_mem_to_src(
         struct src_value *value,
-        struct memory *mem,
-        u16 *addr,
+        struct decode_input *input,
         u8 rm,
         u8 mod,
         bool wide
     ) {
     struct reg_or_mem_value reg_or_mem;
-    decode_reg_or_mem(&reg_or_mem, mem, addr, rm, mod, wide);
+    decode_reg_or_mem(&reg_or_mem, input, rm, mod, wide);
     if (reg_or_mem.is_reg) {
         value->variant = SRC_VALUE_REG;
         value->reg = reg_or_mem.reg;
@@ -125,204 +146,319 @@ static void deocde_reg_or_mem_to_src(
     }
 }
 
-// TODO: change to readinf from a byte buffer
-// TODO: add handling for 'DECODE_ERR_MISSING_BYTES'
-// Handy reference: Table 4-12. 8086 Instruction Encoding
-enum decode_error decode_instruction(struct memory *mem, u16 *addr, struct instruction *output) {
-    u8 byte1 = pull_u8_at(mem, addr);
-
-    // MOVE: Register memory to/from register
-    if ((byte1 & 0b11111100) == 0b10001000) {
-        u8 byte2 = pull_u8_at(mem, addr);
-        bool wide = byte1 & 0b1;
-        bool direction = (byte1 & 0b10) >> 1;
-
-        u8 mod = (byte2 & 0b11000000) >> 6;
-        u8 reg = (byte2 & 0b00111000) >> 3;
-        u8 rm  =  byte2 & 0b00000111;
-
-        output->op = OP_MOV;
-        if (direction) {
-            output->dest.is_reg = true;
-            output->dest.reg = decode_reg(reg, wide);
-            deocde_reg_or_mem_to_src(&output->src, mem, addr, rm, mod, wide);
-        } else {
-            output->src.variant = SRC_VALUE_REG;
-            output->src.reg = decode_reg(reg, wide);
-            decode_reg_or_mem(&output->dest, mem, addr, rm, mod, wide);
-        }
 
-    // MOVE: Immediate to register
-    } else if ((byte1 & 0b11110000) == 0b10110000) {
-        bool wide = (byte1 & 0b1000) >> 3;
-        u8 reg = byte1 & 0b111;
+// Every handler gets the fields that could be pre-extracted from the first byte,
+// so it only needs to pull the remaining bytes of the instruction.
+struct opcode_entry {
+    enum decode_error (*decode)(
+        struct decode_input *input,
+        struct instruction *output,
+        const struct opcode_entry *entry
+    );
+    enum operation op;
+    bool wide;
+    bool direction;
+    bool sign_extend;
+    u8 reg;
+};
 
-        output->op = OP_MOV;
+// Used by opcodes which store the ADD/SUB/CMP variant in the "reg" field of the second byte.
+// Unset variants (ADC, SBB, AND, ...) are not supported yet.
+static const struct {
+    bool supported;
+    enum operation op;
+} alu_variant_lookup[8] = {
+    [0b000] = { true, OP_ADD },
+    [0b101] = { true, OP_SUB },
+    [0b111] = { true, OP_CMP },
+};
+
+static struct opcode_entry opcode_table[256];
+static bool opcode_table_initialized = false;
+
+// MOVE: Register memory to/from register
+// ADD/SUB/CMP: Reg/memory with register to either
+static enum decode_error decode_reg_mem_with_reg(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    u8 byte2 = pull_u8(input);
+    u8 mod = (byte2 & 0b11000000) >> 6;
+    u8 reg = (byte2 & 0b00111000) >> 3;
+    u8 rm  =  byte2 & 0b00000111;
+
+    output->op = entry->op;
+    if (entry->direction) {
         output->dest.is_reg = true;
-        output->dest.reg = decode_reg(reg, wide);
+        output->dest.reg = decode_reg(reg, entry->wide);
+        deocde_reg_or_mem_to_src(&output->src, input, rm, mod, entry->wide);
+    } else {
+        output->src.variant = SRC_VALUE_REG;
+        output->src.reg = decode_reg(reg, entry->wide);
+        decode_reg_or_mem(&output->dest, input, rm, mod, entry->wide);
+    }
 
-        if (wide) {
-            output->src.variant = SRC_VALUE_IMMEDIATE16;
-            output->src.immediate = pull_u16_at(mem, addr);
-        } else {
-            output->src.variant = SRC_VALUE_IMMEDIATE8;
-            output->src.immediate = pull_u8_at(mem, addr);
-        }
+    return DECODE_OK;
+}
 
+// MOVE: Immediate to register
+static enum decode_error decode_mov_imm_to_reg(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    output->op = OP_MOV;
+    output->dest.is_reg = true;
+    output->dest.reg = decode_reg(entry->reg, entry->wide);
 
-    // MOVE: Immediate to register/memory
-    } else if ((byte1 & 0b11111110) == 0b11000110) {
-        u8 byte2 = pull_u8_at(mem, addr);
+    if (entry->wide) {
+        output->src.variant = SRC_VALUE_IMMEDIATE16;
+        output->src.immediate = pull_u16(input);
+    } else {
+        output->src.variant = SRC_VALUE_IMMEDIATE8;
+        output->src.immediate = pull_u8(input);
+    }
 
-        bool wide = byte1 & 0b1;
-        u8 mod = (byte2 & 0b11000000) >> 6;
-        u8 rm  = byte2 & 0b00000111;
+    return DECODE_OK;
+}
 
-        output->op = OP_MOV;
-        decode_reg_or_mem(&output->dest, mem, addr, rm, mod, wide);
+// MOVE: Immediate to register/memory
+static enum decode_error decode_mov_imm_to_reg_mem(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    u8 byte2 = pull_u8(input);
+    u8 mod = (byte2 & 0b11000000) >> 6;
+    u8 rm  = byte2 & 0b00000111;
 
-        if (wide) {
-            output->src.variant = SRC_VALUE_IMMEDIATE16;
-            output->src.immediate = pull_u16_at(mem, addr);
-        } else {
-            output->src.variant = SRC_VALUE_IMMEDIATE8;
-            output->src.immediate = pull_u8_at(mem, addr);
-        }
+    output->op = OP_MOV;
+    decode_reg_or_mem(&output->dest, input, rm, mod, entry->wide);
 
-    // MOVE: Memory to accumulator
-    } else if ((byte1 & 0b11111110) == 0b10100000) {
-        output->op = OP_MOV;
-        output->dest.is_reg = true;
-        output->dest.reg = REG_AX;
-        output->src.variant = SRC_VALUE_MEM;
-        output->src.mem.base = MEM_BASE_DIRECT_ADDRESS;
+    if (entry->wide) {
+        output->src.variant = SRC_VALUE_IMMEDIATE16;
+        output->src.immediate = pull_u16(input);
+    } else {
+        output->src.variant = SRC_VALUE_IMMEDIATE8;
+        output->src.immediate = pull_u8(input);
+    }
 
-        bool wide = byte1 & 0b1;
-        if (wide) {
-            output->src.mem.disp = pull_u16_at(mem, addr);
-        } else {
-            output->src.mem.disp = pull_u8_at(mem, addr);
-        }
+    return DECODE_OK;
+}
 
-    // MOVE: Accumulator to memory
-    } else if ((byte1 & 0b11111110) == 0b10100010) {
-        bool wide = byte1 & 0b1;
+// MOVE: Memory to accumulator
+static enum decode_error decode_mov_mem_to_acc(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    output->op = OP_MOV;
+    output->dest.is_reg = true;
+    output->dest.reg = entry->wide ? REG_AX : REG_AL;
+    output->src.variant = SRC_VALUE_MEM;
+    output->src.mem.base = MEM_BASE_DIRECT_ADDRESS;
+    output->src.mem.disp = pull_u16(input); // Address is always 16 bits, even for AL
 
-        output->op = OP_MOV;
-        output->src.variant = SRC_VALUE_REG;
-        output->src.reg = wide ? REG_AX : REG_AL;
-        output->dest.is_reg = false;
-        output->dest.mem.base = MEM_BASE_DIRECT_ADDRESS;
+    return DECODE_OK;
+}
 
-        if (wide) {
-            output->dest.mem.disp = pull_u16_at(mem, addr);
-        } else {
-            output->dest.mem.disp = pull_u8_at(mem, addr);
-        }
+// MOVE: Accumulator to memory
+static enum decode_error decode_mov_acc_to_mem(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    output->op = OP_MOV;
+    output->src.variant = SRC_VALUE_REG;
+    output->src.reg = entry->wide ? REG_AX : REG_AL;
+    output->dest.is_reg = false;
+    output->dest.mem.base = MEM_BASE_DIRECT_ADDRESS;
+    output->dest.mem.disp = pull_u16(input); // Address is always 16 bits, even for AL
 
-    // ADD/SUB/CMP: Reg/memory with register to either
-    } else if ((byte1 & 0b11000100) == 0b00000000) {
-        u8 variant = (byte1 & 0b00111000) >> 3;
-        if (variant == 0b000) {
-            output->op = OP_ADD;
-        } else if (variant == 0b101) {
-            output->op = OP_SUB;
-        } else if (variant == 0b111) {
-            output->op = OP_CMP;
-        }
+    return DECODE_OK;
+}
+
+// ADD/SUB/CMP: immediate with register/memory
+static enum decode_error decode_alu_imm_to_reg_mem(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    u8 byte2 = pull_u8(input);
+    u8 variant = (byte2 & 0b00111000) >> 3;
+    if (!alu_variant_lookup[variant].supported) {
+        return DECODE_ERR_UNKNOWN_OP;
+    }
 
-        bool wide      =  byte1 & 0b01;
-        bool direction = (byte1 & 0b10) >> 1;
+    u8 mod = (byte2 & 0b11000000) >> 6;
+    u8 rm  = byte2 & 0b00000111;
 
-        u8 byte2 = pull_u8_at(mem, addr);
-        u8 mod = (byte2 & 0b11000000) >> 6;
-        u8 reg = (byte2 & 0b00111000) >> 3;
-        u8 rm  =  byte2 & 0b00000111;
+    output->op = alu_variant_lookup[variant].op;
+    decode_reg_or_mem(&output->dest, input, rm, mod, entry->wide);
 
-        if (direction) {
-            output->dest.is_reg = true;
-            output->dest.reg = decode_reg(reg, wide);
-            deocde_reg_or_mem_to_src(&output->src, mem, addr, rm, mod, wide);
+    if (entry->wide) {
+        output->src.variant = SRC_VALUE_IMMEDIATE16;
+        if (entry->sign_extend) {
+            output->src.immediate = pull_u8(input);
+            output->src.immediate = extend_sign_bit(output->src.immediate);
         } else {
-            output->src.variant = SRC_VALUE_REG;
-            output->src.reg = decode_reg(reg, wide);
-            decode_reg_or_mem(&output->dest, mem, addr, rm, mod, wide);
+            output->src.immediate = pull_u16(input);
         }
+    } else {
+        output->src.variant = SRC_VALUE_IMMEDIATE8;
+        output->src.immediate = pull_u8(input);
+    }
 
-    // ADD/SUB/CMP: immediate with register/memory
-    } else if ((byte1 & 0b11111100) == 0b10000000) {
-        u8 byte2 = pull_u8_at(mem, addr);
-        u8 variant = (byte2 & 0b00111000) >> 3;
-
-        if (variant == 0b000) {
-            output->op = OP_ADD;
-        } else if (variant == 0b101) {
-            output->op = OP_SUB;
-        } else if (variant == 0b111) {
-            output->op = OP_CMP;
-        }
+    return DECODE_OK;
+}
 
-        bool wide        =  byte1 & 0b01;
-        bool sign_extend = (byte1 & 0b10) >> 1;
-        u8 mod = (byte2 & 0b11000000) >> 6;
-        u8 rm  = byte2 & 0b00000111;
-
-        decode_reg_or_mem(&output->dest, mem, addr, rm, mod, wide);
-
-        if (wide) {
-            output->src.variant = SRC_VALUE_IMMEDIATE16;
-            if (sign_extend) {
-                output->src.immediate = pull_u8_at(mem, addr);
-                output->src.immediate = extend_sign_bit(output->src.immediate);
-            } else {
-                output->src.immediate = pull_u16_at(mem, addr);
-            }
-        } else {
-            output->src.variant = SRC_VALUE_IMMEDIATE8;
-            output->src.immediate = pull_u8_at(mem, addr);
-        }
+// ADD/SUB/CMP: immediate with accumulator
+static enum decode_error decode_alu_imm_to_acc(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    output->op = entry->op;
+    output->dest.is_reg = true;
+    output->dest.reg = entry->wide ? REG_AX : REG_AL;
 
-    // ADD/SUB/CMP: immediate with accumulator
-    } else if ((byte1 & 0b11000110) == 0b00000100) {
-        bool wide = byte1 & 0b1;
+    if (entry->wide) {
+        output->src.variant = SRC_VALUE_IMMEDIATE16;
+        output->src.immediate = pull_u16(input);
+    } else {
+        output->src.variant = SRC_VALUE_IMMEDIATE8;
+        output->src.immediate = pull_u8(input);
+    }
 
-        output->dest.is_reg = true;
-        output->dest.reg = wide ? REG_AX : REG_AL;
-
-        u8 variant = (byte1 & 0b00111000) >> 3;
-        if (variant == 0b000) {
-            output->op = OP_ADD;
-        } else if (variant == 0b101) {
-            output->op = OP_SUB;
-        } else if (variant == 0b111) {
-            output->op = OP_CMP;
-        }
+    return DECODE_OK;
+}
 
-        if (wide) {
-            output->src.variant = SRC_VALUE_IMMEDIATE16;
-            output->src.immediate = pull_u16_at(mem, addr);
-        } else {
-            output->src.variant = SRC_VALUE_IMMEDIATE8;
-            output->src.immediate = pull_u8_at(mem, addr);
+// Conditional jumps
+// Conditional loop jumps
+static enum decode_error decode_short_jmp(struct decode_input *input, struct instruction *output, const struct opcode_entry *entry) {
+    output->op = entry->op;
+    output->jmp_offset = pull_u8(input);
+    return DECODE_OK;
+}
+
+// Handy reference: Table 4-12. 8086 Instruction Encoding
+static void init_opcode_table() {
+    for (int byte1 = 0; byte1 < 256; byte1++) {
+        struct opcode_entry *entry = &opcode_table[byte1];
+        memset(entry, 0, sizeof(*entry));
+
+        if ((byte1 & 0b11111100) == 0b10001000) {
+            entry->decode = decode_reg_mem_with_reg;
+            entry->op = OP_MOV;
+            entry->wide = byte1 & 0b1;
+            entry->direction = (byte1 & 0b10) >> 1;
+
+        } else if ((byte1 & 0b11110000) == 0b10110000) {
+            entry->decode = decode_mov_imm_to_reg;
+            entry->wide = (byte1 & 0b1000) >> 3;
+            entry->reg = byte1 & 0b111;
+
+        } else if ((byte1 & 0b11111110) == 0b11000110) {
+            entry->decode = decode_mov_imm_to_reg_mem;
+            entry->wide = byte1 & 0b1;
+
+        } else if ((byte1 & 0b11111110) == 0b10100000) {
+            entry->decode = decode_mov_mem_to_acc;
+            entry->wide = byte1 & 0b1;
+
+        } else if ((byte1 & 0b11111110) == 0b10100010) {
+            entry->decode = decode_mov_acc_to_mem;
+            entry->wide = byte1 & 0b1;
+
+        } else if ((byte1 & 0b11000100) == 0b00000000) {
+            u8 variant = (byte1 & 0b00111000) >> 3;
+            if (!alu_variant_lookup[variant].supported) continue;
+
+            entry->decode = decode_reg_mem_with_reg;
+            entry->op = alu_variant_lookup[variant].op;
+            entry->wide = byte1 & 0b01;
+            entry->direction = (byte1 & 0b10) >> 1;
+
+        } else if ((byte1 & 0b11111100) == 0b10000000) {
+            entry->decode = decode_alu_imm_to_reg_mem;
+            entry->wide = byte1 & 0b01;
+            entry->sign_extend = (byte1 & 0b10) >> 1;
+
+        } else if ((byte1 & 0b11000110) == 0b00000100) {
+            u8 variant = (byte1 & 0b00111000) >> 3;
+            if (!alu_variant_lookup[variant].supported) continue;
+
+            entry->decode = decode_alu_imm_to_acc;
+            entry->op = alu_variant_lookup[variant].op;
+            entry->wide = byte1 & 0b1;
+
+        } else if ((byte1 & 0b11110000) == 0b01110000) {
+            entry->decode = decode_short_jmp;
+            entry->op = cond_jmp_lookup[byte1 & 0b00001111];
+
+        } else if ((byte1 & 0b11111100) == 0b11100000) {
+            entry->decode = decode_short_jmp;
+            entry->op = cond_loop_jmp_lookup[byte1 & 0b00000011];
         }
+    }
 
-    // Conditional jumps
-    } else if ((byte1 & 0b11110000) == 0b01110000) {
-        i8 jmp_offset = pull_u8_at(mem, addr);
-        u8 opcode = byte1 & 0b00001111;
-        output->op = cond_jmp_lookup[opcode];
-        output->jmp_offset = jmp_offset;
+    opcode_table_initialized = true;
+}
 
-    // Conditional loop jumps
-    } else if ((byte1 & 0b11111100) == 0b11100000) {
-        i8 jmp_offset = pull_u8_at(mem, addr);
-        u8 opcode = byte1 & 0b00000011;
-        output->op = cond_loop_jmp_lookup[opcode];
-        output->jmp_offset = jmp_offset;
+// Builds the opcode table. Decoding does it on first use, which isn't thread safe, so programs decoding
+// from several threads must call this before starting them.
+void init_decoder() {
+    if (!opcode_table_initialized) {
+        init_opcode_table();
+    }
+}
 
-    } else {
+// Decodes a single instruction at `*offset` of `data`, and advances `*offset` past it.
+// Returns `DECODE_ERR_EOF` if there is nothing left to decode and `DECODE_ERR_MISSING_BYTES`
+// if the instruction is cut off by the end of the buffer. On error `*offset` is left unchanged.
+enum decode_error decode_instruction_from_span(const u8 *data, size_t size, size_t *offset, struct instruction *output) {
+    if (!opcode_table_initialized) {
+        init_opcode_table();
+    }
+
+    if (*offset >= size) {
+        return DECODE_ERR_EOF;
+    }
+
+    struct decode_input input = { .data = data, .size = size, .offset = *offset };
+    u8 byte1 = pull_u8(&input);
+    const struct opcode_entry *entry = &opcode_table[byte1];
+    if (entry->decode == NULL) {
         return DECODE_ERR_UNKNOWN_OP;
     }
 
+    output->wide = entry->wide;
+    enum decode_error err = entry->decode(&input, output, entry);
+    if (err != DECODE_OK) {
+        return err;
+    }
+    if (input.overrun) {
+        return DECODE_ERR_MISSING_BYTES;
+    }
+
+    *offset = input.offset;
     return DECODE_OK;
 }
+
+// Memory wraps around, so instructions near the end are copied out to be decoded as a single span.
+enum decode_error decode_instruction(struct memory *mem, u16 *addr, struct instruction *output) {
+    const u8 *data = mem->mem + *addr;
+    size_t size = MEMORY_SIZE - *addr;
+
+    u8 wrapped[MAX_INSTRUCTION_SIZE];
+    if (size < MAX_INSTRUCTION_SIZE) {
+        for (int i = 0; i < MAX_INSTRUCTION_SIZE; i++) {
+            wrapped[i] = read_u8_at(mem, *addr + i);
+        }
+        data = wrapped;
+        size = MAX_INSTRUCTION_SIZE;
+    }
+
+    size_t offset = 0;
+    enum decode_error err = decode_instruction_from_span(data, size, &offset, output);
+    if (err == DECODE_OK) {
+        *addr += offset;
+    }
+    return err;
+}
+
+// Same as `decode_instruction`, but reuses the previous decoding if bytes at `addr` were not modified since.
+enum decode_error decode_instruction_cached(struct decode_cache *cache, struct memory *mem, u16 *addr, struct instruction *output) {
+    struct decode_cache_entry *entry = &cache->entries[*addr];
+    if (entry->valid) {
+        cache->hits++;
+        unpack_instruction(output, &entry->inst);
+        *addr += entry->size;
+        return DECODE_OK;
+    }
+
+    cache->misses++;
+    u16 start = *addr;
+    enum decode_error err = decode_instruction(mem, addr, output);
+    if (err == DECODE_OK) {
+        entry->valid = true;
+        entry->kind = 0;
+        entry->handler = cache->unlinked_handler;
+        entry->size = *addr - start;
+        pack_instruction(&entry->inst, output);
+    }
+    return err;
+}
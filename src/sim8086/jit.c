@@ -0,0 +1,525 @@
+// Basic block JIT for x86-64 hosts.
+//
+// A block is a run of instructions up to and including the first jump/loop. While a block runs
+// guest registers live in host registers r8-r15 (in `cpu_state.regs` order), `rbx` points at the
+// `struct cpu_state` and `rbp` at the `struct memory`.
+//
+// Only 16bit MOV/ADD/SUB/CMP between registers and immediates are translated to native code,
+// everything else in a block is executed by calling back into `execute_instruction`. Flags are only
+// recorded for the last flag setting instruction of a block, no instruction in between can observe them,
+// and for flag setters which are followed by a write to memory that could leave the block early (see below).
+//
+// Blocks are cached by their starting address. Because blocks are decoded through the decode cache, any write
+// to their bytes bumps `decode_cache.invalidations`, and then the whole JIT cache is flushed before the next block.
+// A block can also patch itself, so after every instruction writing memory the generated code checks the counter
+// and leaves the block early if it changed.
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(SIM8086_EMCC)
+#define SIM8086_JIT
+#include <sys/mman.h>
+#include <stddef.h>
+#endif
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+
+struct jit_block {
+    u16 start_ip;
+    u16 inst_count;
+    void (*code)(struct cpu_state *cpu, struct memory *mem);
+    // Instructions which are executed through `execute_instruction`, the generated code points into this
+    struct instruction insts[JIT_MAX_BLOCK_INSTRUCTIONS];
+};
+
+struct jit_stats {
+    uint64_t blocks_compiled;
+    uint64_t blocks_executed;
+    uint64_t native_compiled;   // Instructions translated to native code, counted once per compiled block
+    uint64_t fallback_compiled; // Instructions compiled into calls to `execute_instruction`
+    uint64_t flushes;
+};
+
+struct jit {
+    struct jit_block *blocks[MEMORY_SIZE];
+    u8 *code;
+    size_t code_used;
+    uint64_t seen_invalidations;
+    u16 block_executed; // Instructions executed by the last block, less than `inst_count` if it left early
+    struct jit_stats stats;
+
+    // Differential testing, every block is also run on the interpreter and the results are compared
+    bool verify;
+    struct memory *shadow_mem;
+    struct cpu_state shadow_cpu;
+};
+
+#ifdef SIM8086_JIT
+
+struct jit_emitter {
+    u8 *code;
+    size_t size;
+    size_t capacity;
+};
+
+static void jit_emit_u8(struct jit_emitter *e, u8 value) {
+    if (e->size < e->capacity) {
+        e->code[e->size] = value;
+    }
+    e->size++;
+}
+
+static void jit_emit_u16(struct jit_emitter *e, u16 value) {
+    jit_emit_u8(e, value & 0xFF);
+    jit_emit_u8(e, value >> 8);
+}
+
+static void jit_emit_u32(struct jit_emitter *e, u32 value) {
+    jit_emit_u16(e, value & 0xFFFF);
+    jit_emit_u16(e, value >> 16);
+}
+
+static void jit_emit_u64(struct jit_emitter *e, uint64_t value) {
+    jit_emit_u32(e, value & 0xFFFFFFFF);
+    jit_emit_u32(e, value >> 32);
+}
+
+#define JIT_CPU_OFFSET(field) ((u32)offsetof(struct cpu_state, field))
+
+// Guest register `index` (into `cpu_state.regs`) lives in host register r8+index
+static u32 jit_guest_reg_offset(u8 index) {
+    return JIT_CPU_OFFSET(regs) + index * 2;
+}
+
+// movzx r(8+index)d, word [rbx + offset]
+static void jit_emit_load_guest_reg(struct jit_emitter *e, u8 index) {
+    jit_emit_u8(e, 0x44);
+    jit_emit_u8(e, 0x0F);
+    jit_emit_u8(e, 0xB7);
+    jit_emit_u8(e, 0x83 | (index << 3));
+    jit_emit_u32(e, jit_guest_reg_offset(index));
+}
+
+// mov word [rbx + offset], r(8+index)w
+static void jit_emit_store_guest_reg_to(struct jit_emitter *e, u8 index, u32 offset) {
+    jit_emit_u8(e, 0x66);
+    jit_emit_u8(e, 0x44);
+    jit_emit_u8(e, 0x89);
+    jit_emit_u8(e, 0x83 | (index << 3));
+    jit_emit_u32(e, offset);
+}
+
+static void jit_emit_load_all_guest_regs(struct jit_emitter *e) {
+    for (u8 i = 0; i < 8; i++) jit_emit_load_guest_reg(e, i);
+}
+
+static void jit_emit_store_all_guest_regs(struct jit_emitter *e) {
+    for (u8 i = 0; i < 8; i++) jit_emit_store_guest_reg_to(e, i, jit_guest_reg_offset(i));
+}
+
+// mov word [rbx + offset], imm16
+static void jit_emit_store_imm16(struct jit_emitter *e, u32 offset, u16 value) {
+    jit_emit_u8(e, 0x66);
+    jit_emit_u8(e, 0xC7);
+    jit_emit_u8(e, 0x83);
+    jit_emit_u32(e, offset);
+    jit_emit_u16(e, value);
+}
+
+// mov byte [rbx + offset], imm8
+static void jit_emit_store_imm8(struct jit_emitter *e, u32 offset, u8 value) {
+    jit_emit_u8(e, 0xC6);
+    jit_emit_u8(e, 0x83);
+    jit_emit_u32(e, offset);
+    jit_emit_u8(e, value);
+}
+
+// mov word [rbx + offset], ax
+static void jit_emit_store_ax(struct jit_emitter *e, u32 offset) {
+    jit_emit_u8(e, 0x66);
+    jit_emit_u8(e, 0x89);
+    jit_emit_u8(e, 0x83);
+    jit_emit_u32(e, offset);
+}
+
+// mov ax, r(8+index)w
+static void jit_emit_mov_ax_from_guest(struct jit_emitter *e, u8 index) {
+    jit_emit_u8(e, 0x66);
+    jit_emit_u8(e, 0x44);
+    jit_emit_u8(e, 0x89);
+    jit_emit_u8(e, 0xC0 | (index << 3));
+}
+
+static void jit_emit_prologue(struct jit_emitter *e) {
+    jit_emit_u8(e, 0x53);                                          // push rbx
+    jit_emit_u8(e, 0x55);                                          // push rbp
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x54);                    // push r12
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x55);                    // push r13
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x56);                    // push r14
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x57);                    // push r15
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x83); jit_emit_u8(e, 0xEC); jit_emit_u8(e, 0x08); // sub rsp, 8
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x89); jit_emit_u8(e, 0xFB); // mov rbx, rdi
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x89); jit_emit_u8(e, 0xF5); // mov rbp, rsi
+    jit_emit_load_all_guest_regs(e);
+}
+
+static void jit_emit_epilogue(struct jit_emitter *e) {
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x83); jit_emit_u8(e, 0xC4); jit_emit_u8(e, 0x08); // add rsp, 8
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x5F);                    // pop r15
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x5E);                    // pop r14
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x5D);                    // pop r13
+    jit_emit_u8(e, 0x41); jit_emit_u8(e, 0x5C);                    // pop r12
+    jit_emit_u8(e, 0x5D);                                          // pop rbp
+    jit_emit_u8(e, 0x5B);                                          // pop rbx
+    jit_emit_u8(e, 0xC3);                                          // ret
+}
+
+// Guest registers must already be stored back into `cpu_state` when this is called
+static void jit_emit_execute_call(struct jit_emitter *e, struct instruction *inst) {
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x89); jit_emit_u8(e, 0xEF); // mov rdi, rbp
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x89); jit_emit_u8(e, 0xDE); // mov rsi, rbx
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0xBA);                       // mov rdx, inst
+    jit_emit_u64(e, (uint64_t)(uintptr_t)inst);
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0xB8);                       // mov rax, execute_instruction
+    jit_emit_u64(e, (uint64_t)(uintptr_t)&execute_instruction);
+    jit_emit_u8(e, 0xFF); jit_emit_u8(e, 0xD0);                       // call rax
+}
+
+static bool jit_is_native(struct instruction *inst) {
+    switch (inst->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CMP:
+        break;
+    default:
+        return false;
+    }
+
+    bool is_src_reg_or_imm = inst->src.variant == SRC_VALUE_REG || inst->src.variant == SRC_VALUE_IMMEDIATE16;
+    return inst->wide && inst->dest.is_reg && is_src_reg_or_imm;
+}
+
+static bool jit_is_flag_setter(struct instruction *inst) {
+    return inst->op == OP_ADD || inst->op == OP_SUB || inst->op == OP_CMP;
+}
+
+static bool jit_is_block_terminator(struct instruction *inst) {
+    return inst->op != OP_MOV && !jit_is_flag_setter(inst);
+}
+
+static bool jit_writes_memory(struct instruction *inst) {
+    return (inst->op == OP_MOV || inst->op == OP_ADD || inst->op == OP_SUB) && !inst->dest.is_reg;
+}
+
+// After an instruction which wrote memory: if that bumped `invalidations`, the block might have patched itself,
+// so record how many instructions ran and leave. `cpu_state` must already be up to date, with `ip` after the instruction.
+static void jit_emit_invalidation_check(struct jit_emitter *e, struct jit *jit, struct decode_cache *cache, u16 executed) {
+    struct jit_emitter epilogue = { 0 }; // Only measures the size
+    jit_emit_epilogue(&epilogue);
+
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0xB8);                       // mov rax, &cache->invalidations
+    jit_emit_u64(e, (uint64_t)(uintptr_t)&cache->invalidations);
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x8B); jit_emit_u8(e, 0x00); // mov rax, [rax]
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0xBA);                       // mov rdx, seen_invalidations
+    jit_emit_u64(e, jit->seen_invalidations);
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0x39); jit_emit_u8(e, 0xD0); // cmp rax, rdx
+    jit_emit_u8(e, 0x74); jit_emit_u8(e, 10 + 5 + epilogue.size);     // je past the exit
+    jit_emit_u8(e, 0x48); jit_emit_u8(e, 0xB8);                       // mov rax, &jit->block_executed
+    jit_emit_u64(e, (uint64_t)(uintptr_t)&jit->block_executed);
+    jit_emit_u8(e, 0x66); jit_emit_u8(e, 0xC7); jit_emit_u8(e, 0x00); // mov word [rax], executed
+    jit_emit_u16(e, executed);
+    jit_emit_epilogue(e);
+}
+
+static void jit_emit_native(struct jit_emitter *e, struct instruction *inst, bool record_flags) {
+    u8 dest = REG16_INDEX(inst->dest.reg);
+    bool is_src_reg = inst->src.variant == SRC_VALUE_REG;
+    u8 src = is_src_reg ? REG16_INDEX(inst->src.reg) : 0;
+    u16 imm = inst->src.immediate;
+
+    if (inst->op == OP_MOV) {
+        jit_emit_u8(e, 0x66);
+        if (is_src_reg) {
+            jit_emit_u8(e, 0x45); jit_emit_u8(e, 0x89); jit_emit_u8(e, 0xC0 | (src << 3) | dest); // mov r16, r16
+        } else {
+            jit_emit_u8(e, 0x41); jit_emit_u8(e, 0xB8 + dest); jit_emit_u16(e, imm);           // mov r16, imm16
+        }
+        return;
+    }
+
+    // CMP only changes flags, nothing to do if they are never observed
+    if (inst->op == OP_CMP && !record_flags) return;
+
+    if (record_flags) {
+        jit_emit_store_guest_reg_to(e, dest, JIT_CPU_OFFSET(lazy_flags.dest));
+        if (is_src_reg) {
+            jit_emit_store_guest_reg_to(e, src, JIT_CPU_OFFSET(lazy_flags.src));
+        } else {
+            jit_emit_store_imm16(e, JIT_CPU_OFFSET(lazy_flags.src), imm);
+        }
+    }
+
+    // ADD/SUB operate on the guest register directly, CMP on a copy in ax
+    bool in_ax = inst->op == OP_CMP;
+    if (in_ax) jit_emit_mov_ax_from_guest(e, dest);
+
+    u8 reg_opcode = inst->op == OP_ADD ? 0x01 : 0x29;
+    u8 imm_ext = inst->op == OP_ADD ? 0 : 5;
+    u8 target = in_ax ? 0 : dest;
+
+    jit_emit_u8(e, 0x66);
+    if (is_src_reg) {
+        jit_emit_u8(e, in_ax ? 0x44 : 0x45);
+        jit_emit_u8(e, reg_opcode);
+        jit_emit_u8(e, 0xC0 | (src << 3) | target);
+    } else {
+        if (!in_ax) jit_emit_u8(e, 0x41);
+        jit_emit_u8(e, 0x81);
+        jit_emit_u8(e, 0xC0 | (imm_ext << 3) | target);
+        jit_emit_u16(e, imm);
+    }
+
+    if (record_flags) {
+        if (in_ax) {
+            jit_emit_store_ax(e, JIT_CPU_OFFSET(lazy_flags.result));
+        } else {
+            jit_emit_store_guest_reg_to(e, dest, JIT_CPU_OFFSET(lazy_flags.result));
+        }
+        jit_emit_store_imm8(e, JIT_CPU_OFFSET(lazy_flags.op), inst->op == OP_ADD ? LAZY_FLAGS_ADD : LAZY_FLAGS_SUB);
+        jit_emit_store_imm8(e, JIT_CPU_OFFSET(lazy_flags.wide), 1);
+    }
+}
+
+#endif // SIM8086_JIT
+
+// Returns 0 on success, -1 if the JIT is not supported on this host
+int jit_init(struct jit *jit) {
+    memset(jit, 0, sizeof(*jit));
+#ifdef SIM8086_JIT
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return -1;
+    }
+    jit->code = code;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void jit_flush(struct jit *jit) {
+    for (u32 i = 0; i < MEMORY_SIZE; i++) {
+        free(jit->blocks[i]);
+        jit->blocks[i] = NULL;
+    }
+    jit->code_used = 0;
+    jit->stats.flushes++;
+}
+
+void jit_free(struct jit *jit) {
+    jit_flush(jit);
+#ifdef SIM8086_JIT
+    if (jit->code) {
+        munmap(jit->code, JIT_CODE_SIZE);
+    }
+#endif
+    jit->code = NULL;
+}
+
+#ifdef SIM8086_JIT
+
+static enum decode_error jit_compile_block(struct jit *jit, struct memory *mem, u16 start_ip, u16 end_ip, struct jit_block **result) {
+    struct jit_block *block = calloc(1, sizeof(struct jit_block));
+    if (block == NULL) {
+        panic("Failed to allocate JIT block\n");
+    }
+    block->start_ip = start_ip;
+
+    // Decode the whole block first, so the last flag setter is known before emitting code
+    u8 inst_sizes[JIT_MAX_BLOCK_INSTRUCTIONS];
+    u16 ip = start_ip;
+    int last_flag_setter = -1;
+    while (block->inst_count < JIT_MAX_BLOCK_INSTRUCTIONS && ip < end_ip) {
+        struct instruction *inst = &block->insts[block->inst_count];
+        u16 inst_ip = ip;
+        enum decode_error err = decode_instruction_cached(mem->decode_cache, mem, &ip, inst);
+        if (err != DECODE_OK) {
+            if (block->inst_count == 0) {
+                free(block);
+                return err;
+            }
+            ip = inst_ip;
+            break;
+        }
+
+        if (jit_is_flag_setter(inst)) last_flag_setter = block->inst_count;
+        inst_sizes[block->inst_count] = ip - inst_ip;
+        block->inst_count++;
+        if (jit_is_block_terminator(inst)) break;
+    }
+
+    struct jit_emitter e = {
+        .code = jit->code + jit->code_used,
+        .capacity = JIT_CODE_SIZE - jit->code_used
+    };
+
+    // Leaving the block early after a memory write needs the flags as they were at that point
+    bool record_flags[JIT_MAX_BLOCK_INSTRUCTIONS] = { 0 };
+    if (last_flag_setter != -1) record_flags[last_flag_setter] = true;
+    int flag_setter = -1;
+    for (int i = 0; i+1 < block->inst_count; i++) {
+        if (jit_is_flag_setter(&block->insts[i])) {
+            flag_setter = i;
+        } else if (jit_writes_memory(&block->insts[i]) && flag_setter != -1) {
+            record_flags[flag_setter] = true;
+        }
+    }
+
+    jit_emit_prologue(&e);
+
+    u16 inst_ip = start_ip;
+    bool terminated = false;
+    for (int i = 0; i < block->inst_count; i++) {
+        struct instruction *inst = &block->insts[i];
+        u16 next_ip = inst_ip + inst_sizes[i];
+
+        if (jit_is_native(inst)) {
+            jit_emit_native(&e, inst, record_flags[i]);
+            jit->stats.native_compiled++;
+        } else if (jit_is_block_terminator(inst)) {
+            // Jumps expect `ip` to already point past them, and they end the block
+            jit_emit_store_all_guest_regs(&e);
+            jit_emit_store_imm16(&e, JIT_CPU_OFFSET(ip), next_ip);
+            jit_emit_execute_call(&e, inst);
+            jit_emit_epilogue(&e);
+            terminated = true;
+            jit->stats.fallback_compiled++;
+        } else {
+            jit_emit_store_all_guest_regs(&e);
+            jit_emit_store_imm16(&e, JIT_CPU_OFFSET(ip), next_ip);
+            jit_emit_execute_call(&e, inst);
+            if (jit_writes_memory(inst) && i+1 < block->inst_count) {
+                jit_emit_invalidation_check(&e, jit, mem->decode_cache, i+1);
+            }
+            jit_emit_load_all_guest_regs(&e);
+            jit->stats.fallback_compiled++;
+        }
+
+        inst_ip = next_ip;
+    }
+
+    if (!terminated) {
+        jit_emit_store_all_guest_regs(&e);
+        jit_emit_store_imm16(&e, JIT_CPU_OFFSET(ip), inst_ip);
+        jit_emit_epilogue(&e);
+    }
+
+    if (e.size > e.capacity) {
+        // Out of code space, start over with an empty cache
+        free(block);
+        jit_flush(jit);
+        return jit_compile_block(jit, mem, start_ip, end_ip, result);
+    }
+
+    block->code = (void (*)(struct cpu_state *, struct memory *))(void *)e.code;
+    jit->code_used += e.size;
+    jit->blocks[start_ip] = block;
+    jit->stats.blocks_compiled++;
+
+    *result = block;
+    return DECODE_OK;
+}
+
+#endif // SIM8086_JIT
+
+static bool jit_verify_block(struct jit *jit, struct memory *mem, struct cpu_state *cpu, struct jit_block *block) {
+    for (int i = 0; i < jit->block_executed; i++) {
+        struct instruction inst;
+        enum decode_error err = decode_instruction(jit->shadow_mem, &jit->shadow_cpu.ip, &inst);
+        if (err != DECODE_OK) {
+            fprintf(stderr, "JIT verify: interpreter failed to decode at 0x%04x: %s\n", jit->shadow_cpu.ip, decode_error_to_str(err));
+            return false;
+        }
+        execute_instruction(jit->shadow_mem, &jit->shadow_cpu, &inst);
+    }
+
+    bool ok = true;
+    if (memcmp(cpu->regs, jit->shadow_cpu.regs, sizeof(cpu->regs)) != 0) {
+        for (int i = 0; i < 8; i++) {
+            if (cpu->regs[i] != jit->shadow_cpu.regs[i]) {
+                fprintf(stderr, "JIT verify: block 0x%04x, %s is 0x%04x, interpreter has 0x%04x\n",
+                        block->start_ip, reg_to_str(REG_AX + i), cpu->regs[i], jit->shadow_cpu.regs[i]);
+            }
+        }
+        ok = false;
+    }
+    if (cpu->ip != jit->shadow_cpu.ip) {
+        fprintf(stderr, "JIT verify: block 0x%04x, ip is 0x%04x, interpreter has 0x%04x\n", block->start_ip, cpu->ip, jit->shadow_cpu.ip);
+        ok = false;
+    }
+    if (get_cpu_flags(cpu) != get_cpu_flags(&jit->shadow_cpu)) {
+        fprintf(stderr, "JIT verify: block 0x%04x, flags are 0x%04x, interpreter has 0x%04x\n",
+                block->start_ip, get_cpu_flags(cpu), get_cpu_flags(&jit->shadow_cpu));
+        ok = false;
+    }
+    if (memcmp(mem->mem, jit->shadow_mem->mem, MEMORY_SIZE) != 0) {
+        fprintf(stderr, "JIT verify: block 0x%04x, memory differs from interpreter\n", block->start_ip);
+        ok = false;
+    }
+    return ok;
+}
+
+// Enables differential testing, `mem` and `cpu` must be in their initial state
+int jit_enable_verify(struct jit *jit, struct memory *mem, struct cpu_state *cpu) {
+    jit->shadow_mem = malloc(sizeof(struct memory));
+    if (jit->shadow_mem == NULL) return -1;
+
+    memcpy(jit->shadow_mem->mem, mem->mem, MEMORY_SIZE);
+    jit->shadow_mem->decode_cache = NULL;
+    jit->shadow_mem->write_log = NULL;
+    jit->shadow_cpu = *cpu;
+    jit->verify = true;
+    return 0;
+}
+
+void jit_disable_verify(struct jit *jit) {
+    free(jit->shadow_mem);
+    jit->shadow_mem = NULL;
+    jit->verify = false;
+}
+
+// Runs until `cpu->ip` reaches `end_ip` or an instruction fails to decode.
+// `mem->decode_cache` must be set, it is used to detect writes to translated code.
+// Returns `DECODE_ERR_UNKNOWN_OP` if the JIT is not supported on this host, or if verification failed.
+enum decode_error run_jit(struct jit *jit, struct memory *mem, struct cpu_state *cpu, u16 end_ip) {
+#ifdef SIM8086_JIT
+    struct decode_cache *cache = mem->decode_cache;
+    assert(cache != NULL);
+    assert(jit->code != NULL);
+
+    while (cpu->ip < end_ip) {
+        if (cache->invalidations != jit->seen_invalidations) {
+            jit_flush(jit);
+            jit->seen_invalidations = cache->invalidations;
+        }
+
+        struct jit_block *block = jit->blocks[cpu->ip];
+        if (block == NULL) {
+            enum decode_error err = jit_compile_block(jit, mem, cpu->ip, end_ip, &block);
+            if (err != DECODE_OK) return err;
+        }
+
+        jit->block_executed = block->inst_count;
+        block->code(cpu, mem);
+        jit->stats.blocks_executed++;
+
+        if (jit->verify && !jit_verify_block(jit, mem, cpu, block)) {
+            return DECODE_ERR_UNKNOWN_OP;
+        }
+    }
+
+    return DECODE_OK;
+#else
+    return DECODE_ERR_UNKNOWN_OP;
+#endif
+}
@@ -0,0 +1,299 @@
+// Undo journal for stepping backwards.
+//
+// Every step appends one record to a byte ring buffer with what the instruction changed:
+//     u8  size                  size of the whole record, repeated at the end so it can be walked both ways
+//     u16 old ip
+//     u16 changed               bits 0-7 for `cpu_state.regs`, bit 8 for `cpu_state.lazy_flags`
+//     u16 old registers...      only the changed ones
+//     ... old lazy flags        only if they changed
+//     u8  write count
+//     (u16 address, u8 old value)...
+//     u8  size
+// Once the ring is full the oldest records are dropped.
+//
+// Every `checkpoint_interval` steps a full copy of memory and registers is also stored (in a ring of `checkpoint_count`),
+// so that jumping far back can restore a checkpoint and re-execute forward, instead of undoing every step.
+
+#define JOURNAL_CHANGED_FLAGS (1 << 8)
+
+struct journal_checkpoint {
+    bool valid;
+    uint64_t step;
+    struct cpu_state cpu;
+    u8 mem[MEMORY_SIZE];
+};
+
+struct journal {
+    u8 *ring;
+    u32 ring_size;
+    uint64_t ring_start; // Byte positions, only taken modulo `ring_size` when accessing `ring`
+    uint64_t ring_end;
+
+    uint64_t step;        // Number of executed steps
+    uint64_t oldest_step; // Step before the oldest record in the ring
+
+    struct journal_checkpoint *checkpoints;
+    u32 checkpoint_count;
+    u32 checkpoint_interval;
+
+    struct write_log write_log;
+};
+
+// Returns 0 on success, -1 if allocation failed. `checkpoint_count` can be 0.
+int journal_init(struct journal *journal, u32 ring_size, u32 checkpoint_count, u32 checkpoint_interval) {
+    memset(journal, 0, sizeof(*journal));
+    journal->ring = malloc(ring_size);
+    journal->ring_size = ring_size;
+    journal->checkpoint_count = checkpoint_interval > 0 ? checkpoint_count : 0;
+    journal->checkpoint_interval = checkpoint_interval;
+    if (journal->checkpoint_count > 0) {
+        journal->checkpoints = calloc(journal->checkpoint_count, sizeof(struct journal_checkpoint));
+    }
+
+    if (journal->ring == NULL || (journal->checkpoint_count > 0 && journal->checkpoints == NULL)) {
+        free(journal->ring);
+        free(journal->checkpoints);
+        return -1;
+    }
+    return 0;
+}
+
+void journal_free(struct journal *journal) {
+    free(journal->ring);
+    free(journal->checkpoints);
+    journal->ring = NULL;
+    journal->checkpoints = NULL;
+}
+
+// Forgets all history, the current state becomes step 0
+void journal_clear(struct journal *journal) {
+    journal->ring_start = journal->ring_end;
+    journal->step = 0;
+    journal->oldest_step = 0;
+    for (u32 i = 0; i < journal->checkpoint_count; i++) {
+        journal->checkpoints[i].valid = false;
+    }
+}
+
+static u8 journal_byte_at(struct journal *journal, uint64_t pos) {
+    return journal->ring[pos % journal->ring_size];
+}
+
+static u16 journal_u16_at(struct journal *journal, uint64_t pos) {
+    return journal_byte_at(journal, pos) | (journal_byte_at(journal, pos + 1) << 8);
+}
+
+static void journal_push_u8(struct journal *journal, u8 value) {
+    journal->ring[journal->ring_end % journal->ring_size] = value;
+    journal->ring_end++;
+}
+
+static void journal_push_u16(struct journal *journal, u16 value) {
+    journal_push_u8(journal, value & 0xFF);
+    journal_push_u8(journal, value >> 8);
+}
+
+static void journal_drop_oldest(struct journal *journal) {
+    journal->ring_start += journal_byte_at(journal, journal->ring_start);
+    journal->oldest_step++;
+}
+
+static void journal_append(struct journal *journal, struct cpu_state *before, struct cpu_state *after) {
+    u16 changed = 0;
+    u32 size = 2 + 2 + 1 + 1 + 1; // sizes, ip, changed, write count
+    for (int i = 0; i < 8; i++) {
+        if (before->regs[i] != after->regs[i]) {
+            changed |= 1 << i;
+            size += 2;
+        }
+    }
+    if (memcmp(&before->lazy_flags, &after->lazy_flags, sizeof(before->lazy_flags)) != 0) {
+        changed |= JOURNAL_CHANGED_FLAGS;
+        size += sizeof(before->lazy_flags);
+    }
+    size += journal->write_log.count * 3;
+    assert(size <= 255 && size <= journal->ring_size);
+
+    while (journal->ring_end + size - journal->ring_start > journal->ring_size) {
+        journal_drop_oldest(journal);
+    }
+
+    journal_push_u8(journal, size);
+    journal_push_u16(journal, before->ip);
+    journal_push_u16(journal, changed);
+    for (int i = 0; i < 8; i++) {
+        if (changed & (1 << i)) journal_push_u16(journal, before->regs[i]);
+    }
+    if (changed & JOURNAL_CHANGED_FLAGS) {
+        u8 *flags = (u8 *)&before->lazy_flags;
+        for (u32 i = 0; i < sizeof(before->lazy_flags); i++) journal_push_u8(journal, flags[i]);
+    }
+    journal_push_u8(journal, journal->write_log.count);
+    for (int i = 0; i < journal->write_log.count; i++) {
+        journal_push_u16(journal, journal->write_log.address[i]);
+        journal_push_u8(journal, journal->write_log.old_value[i]);
+    }
+    journal_push_u8(journal, size);
+}
+
+// Position of the first byte of the newest record
+static uint64_t journal_newest_record(struct journal *journal) {
+    return journal->ring_end - journal_byte_at(journal, journal->ring_end - 1);
+}
+
+static uint64_t journal_writes_of_record(struct journal *journal, uint64_t record) {
+    u16 changed = journal_u16_at(journal, record + 3);
+    uint64_t pos = record + 5;
+    for (int i = 0; i < 8; i++) {
+        if (changed & (1 << i)) pos += 2;
+    }
+    if (changed & JOURNAL_CHANGED_FLAGS) pos += sizeof(((struct cpu_state *)0)->lazy_flags);
+    return pos;
+}
+
+// Undoes the newest record and removes it from the ring
+static void journal_undo_newest(struct journal *journal, struct memory *mem, struct cpu_state *cpu) {
+    uint64_t record = journal_newest_record(journal);
+
+    cpu->ip = journal_u16_at(journal, record + 1);
+    u16 changed = journal_u16_at(journal, record + 3);
+    uint64_t pos = record + 5;
+    for (int i = 0; i < 8; i++) {
+        if (changed & (1 << i)) {
+            cpu->regs[i] = journal_u16_at(journal, pos);
+            pos += 2;
+        }
+    }
+    if (changed & JOURNAL_CHANGED_FLAGS) {
+        u8 *flags = (u8 *)&cpu->lazy_flags;
+        for (u32 i = 0; i < sizeof(cpu->lazy_flags); i++) flags[i] = journal_byte_at(journal, pos++);
+    }
+
+    // Undo writes in reverse, without logging them
+    struct write_log *log = mem->write_log;
+    mem->write_log = NULL;
+    u8 write_count = journal_byte_at(journal, pos);
+    for (int i = write_count - 1; i >= 0; i--) {
+        uint64_t write = pos + 1 + i * 3;
+        write_u8_at(mem, journal_u16_at(journal, write), journal_byte_at(journal, write + 2));
+    }
+    mem->write_log = log;
+
+    journal->ring_end = record;
+    journal->step--;
+}
+
+static bool journal_record_writes_to(struct journal *journal, uint64_t record, u16 address) {
+    uint64_t pos = journal_writes_of_record(journal, record);
+    u8 write_count = journal_byte_at(journal, pos);
+    for (int i = 0; i < write_count; i++) {
+        if (journal_u16_at(journal, pos + 1 + i * 3) == address) return true;
+    }
+    return false;
+}
+
+static void journal_restore_checkpoint(struct journal *journal, struct journal_checkpoint *checkpoint, struct memory *mem, struct cpu_state *cpu) {
+    for (u32 page = 0; page < MEMORY_PAGE_COUNT; page++) {
+        u32 start = page * MEMORY_PAGE_SIZE;
+        if (memcmp(mem->mem + start, checkpoint->mem + start, MEMORY_PAGE_SIZE) != 0) {
+            load_mem_from_buff(mem, checkpoint->mem + start, MEMORY_PAGE_SIZE, start);
+        }
+    }
+
+    *cpu = checkpoint->cpu;
+    journal->step = checkpoint->step;
+    journal->oldest_step = checkpoint->step;
+    journal->ring_start = journal->ring_end;
+}
+
+// Executes one instruction and records it, the decoded instruction is written to `inst`.
+// `mem->write_log` is pointed at the journal while executing.
+enum decode_error journal_step(struct journal *journal, struct memory *mem, struct cpu_state *cpu, struct instruction *inst) {
+    if (journal->checkpoint_count > 0 && journal->step % journal->checkpoint_interval == 0) {
+        struct journal_checkpoint *checkpoint = &journal->checkpoints[(journal->step / journal->checkpoint_interval) % journal->checkpoint_count];
+        checkpoint->valid = true;
+        checkpoint->step = journal->step;
+        checkpoint->cpu = *cpu;
+        memcpy(checkpoint->mem, mem->mem, MEMORY_SIZE);
+    }
+
+    struct cpu_state before = *cpu;
+    enum decode_error err;
+    if (mem->decode_cache) {
+        err = decode_instruction_cached(mem->decode_cache, mem, &cpu->ip, inst);
+    } else {
+        err = decode_instruction(mem, &cpu->ip, inst);
+    }
+    if (err != DECODE_OK) {
+        cpu->ip = before.ip;
+        return err;
+    }
+
+    journal->write_log.count = 0;
+    struct write_log *log = mem->write_log;
+    mem->write_log = &journal->write_log;
+    execute_instruction(mem, cpu, inst);
+    mem->write_log = log;
+
+    journal_append(journal, &before, cpu);
+    journal->step++;
+    return DECODE_OK;
+}
+
+// Goes back `count` steps, or as far as the journal and checkpoints allow.
+// Returns how many steps it actually went back.
+uint64_t journal_step_back(struct journal *journal, struct memory *mem, struct cpu_state *cpu, uint64_t count) {
+    uint64_t start_step = journal->step;
+    uint64_t target = count > journal->step ? 0 : journal->step - count;
+
+    // Closest checkpoint at or before the target, re-executing from it could be cheaper than undoing
+    struct journal_checkpoint *best = NULL;
+    for (u32 i = 0; i < journal->checkpoint_count; i++) {
+        struct journal_checkpoint *checkpoint = &journal->checkpoints[i];
+        if (!checkpoint->valid || checkpoint->step > target) continue;
+        if (best == NULL || checkpoint->step > best->step) best = checkpoint;
+    }
+
+    bool can_undo = target >= journal->oldest_step;
+    if (best && (!can_undo || target - best->step < journal->step - target)) {
+        journal_restore_checkpoint(journal, best, mem, cpu);
+        struct instruction inst;
+        while (journal->step < target) {
+            journal_step(journal, mem, cpu, &inst);
+        }
+    } else {
+        while (journal->step > target && journal->step > journal->oldest_step) {
+            journal_undo_newest(journal, mem, cpu);
+        }
+    }
+
+    // Checkpoints from the future would be wrong if the state gets changed from the outside before
+    // executing forward again, they get taken again when passing them
+    for (u32 i = 0; i < journal->checkpoint_count; i++) {
+        if (journal->checkpoints[i].step > journal->step) journal->checkpoints[i].valid = false;
+    }
+
+    return start_step - journal->step;
+}
+
+// Goes back to just before the last instruction that wrote to `address`, so `ip` points at it.
+// Returns false and doesn't change anything if the journal has no such write.
+bool journal_run_back_to_write(struct journal *journal, struct memory *mem, struct cpu_state *cpu, u16 address) {
+    uint64_t distance = 0;
+    uint64_t record = journal->ring_end;
+    bool found = false;
+    while (record > journal->ring_start) {
+        record -= journal_byte_at(journal, record - 1);
+        distance++;
+        if (journal_record_writes_to(journal, record, address)) {
+            found = true;
+            break;
+        }
+    }
+    if (!found) return false;
+
+    for (uint64_t i = 0; i < distance; i++) {
+        journal_undo_newest(journal, mem, cpu);
+    }
+    return true;
+}
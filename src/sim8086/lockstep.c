@@ -0,0 +1,414 @@
+// Lockstep engine, runs the same program on `LOCKSTEP_LANES` CPUs at once.
+//
+// Registers and lazy flags are stored as structure of arrays, one SIMD vector per register (GCC vector extensions,
+// compiled to SSE2/AVX2 on the host, and to wasm SIMD because the web build passes -msimd128, see `run_sweep` in
+// "web.c"). Every step the lanes with the lowest `ip` are selected, one instruction is decoded for all of them and
+// executed with the other lanes masked off.
+// So lanes stay together until their branches diverge, and join again when they reach the same `ip`.
+//
+// Each lane has its own `struct memory`, memory operands are accessed lane by lane.
+// Results must match `execute_instruction` exactly.
+
+// One vector of u16 lanes per register, 128bit (SSE2, wasm SIMD) unless 256bit AVX2 is enabled
+#if defined(__AVX2__)
+#define LOCKSTEP_LANES 16
+#else
+#define LOCKSTEP_LANES 8
+#endif
+
+#define lanes_u16 u16 __attribute__((vector_size(LOCKSTEP_LANES * sizeof(u16))))
+
+enum lockstep_lane_status {
+    LOCKSTEP_RUNNING,
+    LOCKSTEP_FINISHED,     // `ip` reached `end_ip`
+    LOCKSTEP_DECODE_ERROR,
+    LOCKSTEP_STEP_LIMIT,
+};
+
+struct lockstep {
+    lanes_u16 regs[8]; // Same order as `cpu_state.regs`
+    lanes_u16 ip;
+
+    // Same meaning as `cpu_state.lazy_flags`, but per lane
+    lanes_u16 lazy_op;
+    lanes_u16 lazy_wide;
+    lanes_u16 lazy_dest;
+    lanes_u16 lazy_src;
+    lanes_u16 lazy_result;
+    lanes_u16 lazy_flags;
+
+    struct memory *mems[LOCKSTEP_LANES];
+    u32 lane_count; // Lanes past this are unused
+    u8 status[LOCKSTEP_LANES]; // `enum lockstep_lane_status`
+    uint64_t steps[LOCKSTEP_LANES];
+    enum cpu_model model; // Used for `clocks`
+    u32 clocks[LOCKSTEP_LANES];
+    bool has_clocks[LOCKSTEP_LANES];
+};
+
+static lanes_u16 lockstep_broadcast(u16 value) {
+    lanes_u16 result = { 0 };
+    return result + value;
+}
+
+// Picks `a` in lanes where `mask` is all ones, otherwise `b`
+static lanes_u16 lockstep_select(lanes_u16 mask, lanes_u16 a, lanes_u16 b) {
+    return (a & mask) | (b & ~mask);
+}
+
+void lockstep_set_lane(struct lockstep *ls, u32 lane, struct cpu_state *cpu) {
+    for (int i = 0; i < 8; i++) {
+        ls->regs[i][lane] = cpu->regs[i];
+    }
+    ls->ip[lane] = cpu->ip;
+    ls->lazy_op[lane] = cpu->lazy_flags.op;
+    ls->lazy_wide[lane] = cpu->lazy_flags.wide;
+    ls->lazy_dest[lane] = cpu->lazy_flags.dest;
+    ls->lazy_src[lane] = cpu->lazy_flags.src;
+    ls->lazy_result[lane] = cpu->lazy_flags.result;
+    ls->lazy_flags[lane] = cpu->lazy_flags.flags;
+}
+
+void lockstep_get_lane(struct lockstep *ls, u32 lane, struct cpu_state *cpu) {
+    for (int i = 0; i < 8; i++) {
+        cpu->regs[i] = ls->regs[i][lane];
+    }
+    cpu->ip = ls->ip[lane];
+    cpu->lazy_flags.op = ls->lazy_op[lane];
+    cpu->lazy_flags.wide = ls->lazy_wide[lane];
+    cpu->lazy_flags.dest = ls->lazy_dest[lane];
+    cpu->lazy_flags.src = ls->lazy_src[lane];
+    cpu->lazy_flags.result = ls->lazy_result[lane];
+    cpu->lazy_flags.flags = ls->lazy_flags[lane];
+}
+
+// Vector version of `get_cpu_flags`
+static lanes_u16 lockstep_get_flags(struct lockstep *ls) {
+    lanes_u16 wide = (lanes_u16)(ls->lazy_wide != 0);
+    lanes_u16 mask = lockstep_select(wide, lockstep_broadcast(0xFFFF), lockstep_broadcast(0xFF));
+    lanes_u16 sign_bit = lockstep_select(wide, lockstep_broadcast(0x8000), lockstep_broadcast(0x80));
+    lanes_u16 dest = ls->lazy_dest;
+    lanes_u16 src = ls->lazy_src;
+    lanes_u16 result = ls->lazy_result;
+    lanes_u16 is_add = (lanes_u16)(ls->lazy_op == LAZY_FLAGS_ADD);
+    lanes_u16 is_none = (lanes_u16)(ls->lazy_op == LAZY_FLAGS_NONE);
+
+    // Carry/borrow out of the sign bit
+    lanes_u16 add_carries = (dest & src) | ((dest | src) & ~result);
+    lanes_u16 sub_borrows = (~dest & src) | ((~dest | src) & result);
+    lanes_u16 carry = lockstep_select(is_add, add_carries, sub_borrows) & sign_bit;
+
+    lanes_u16 add_overflow = ~(dest ^ src) & (dest ^ result);
+    lanes_u16 sub_overflow = (dest ^ src) & (dest ^ result);
+    lanes_u16 overflow = lockstep_select(is_add, add_overflow, sub_overflow) & sign_bit;
+
+    lanes_u16 parity = result & 0xFF;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+
+    lanes_u16 flags = { 0 };
+    flags |= (lanes_u16)(carry != 0) & FLAG_CARRY;
+    flags |= (lanes_u16)((parity & 1) == 0) & FLAG_PARITY;
+    flags |= (dest ^ src ^ result) & FLAG_AUX_CARRY;
+    flags |= (lanes_u16)((result & mask) == 0) & FLAG_ZERO;
+    flags |= (lanes_u16)((result & sign_bit) != 0) & FLAG_SIGN;
+    flags |= (lanes_u16)(overflow != 0) & FLAG_OVERFLOW;
+
+    return lockstep_select(is_none, ls->lazy_flags, flags);
+}
+
+// Vector version of `is_jump_condition_met`, all ones in lanes where the jump is taken
+static lanes_u16 lockstep_jump_condition(struct lockstep *ls, enum operation op) {
+    lanes_u16 flags = lockstep_get_flags(ls);
+    lanes_u16 carry    = (lanes_u16)((flags & FLAG_CARRY) != 0);
+    lanes_u16 parity   = (lanes_u16)((flags & FLAG_PARITY) != 0);
+    lanes_u16 zero     = (lanes_u16)((flags & FLAG_ZERO) != 0);
+    lanes_u16 sign     = (lanes_u16)((flags & FLAG_SIGN) != 0);
+    lanes_u16 overflow = (lanes_u16)((flags & FLAG_OVERFLOW) != 0);
+
+    switch (op) {
+    case OP_JE:   return zero;
+    case OP_JNE:  return ~zero;
+    case OP_JL:   return sign ^ overflow;
+    case OP_JNL:  return ~(sign ^ overflow);
+    case OP_JLE:  return zero | (sign ^ overflow);
+    case OP_JNLE: return ~(zero | (sign ^ overflow));
+    case OP_JB:   return carry;
+    case OP_JNB:  return ~carry;
+    case OP_JBE:  return carry | zero;
+    case OP_JNBE: return ~(carry | zero);
+    case OP_JP:   return parity;
+    case OP_JNP:  return ~parity;
+    case OP_JO:   return overflow;
+    case OP_JNO:  return ~overflow;
+    case OP_JS:   return sign;
+    case OP_JNS:  return ~sign;
+    default: panic("Operation '%s' is not a conditional jump\n", operation_to_str(op));
+    }
+}
+
+// Vector version of `is_jump_taken`, must be called before executing the jump
+static lanes_u16 lockstep_jump_taken(struct lockstep *ls, struct instruction *inst) {
+    lanes_u16 cx = ls->regs[REG16_INDEX(REG_CX)];
+    switch (inst->op) {
+    case OP_LOOP:   return (lanes_u16)(cx != 1);
+    case OP_LOOPZ:  return (lanes_u16)(cx != 1) & lockstep_jump_condition(ls, OP_JE);
+    case OP_LOOPNZ: return (lanes_u16)(cx != 1) & lockstep_jump_condition(ls, OP_JNE);
+    case OP_JCXZ:   return (lanes_u16)(cx == 0);
+    default:        return lockstep_jump_condition(ls, inst->op);
+    }
+}
+
+static void lockstep_set_lazy_flags(struct lockstep *ls, lanes_u16 mask, enum lazy_flags_op op, lanes_u16 dest, lanes_u16 src, lanes_u16 result, bool wide) {
+    ls->lazy_op     = lockstep_select(mask, lockstep_broadcast(op), ls->lazy_op);
+    ls->lazy_wide   = lockstep_select(mask, lockstep_broadcast(wide), ls->lazy_wide);
+    ls->lazy_dest   = lockstep_select(mask, dest, ls->lazy_dest);
+    ls->lazy_src    = lockstep_select(mask, src, ls->lazy_src);
+    ls->lazy_result = lockstep_select(mask, result, ls->lazy_result);
+}
+
+static lanes_u16 lockstep_read_reg(struct lockstep *ls, enum reg_value reg) {
+    if (reg >= REG_AX) {
+        return ls->regs[REG16_INDEX(reg)];
+    }
+
+    u8 index = REG8_INDEX(reg);
+    lanes_u16 value = ls->regs[index >> 1];
+    return (index & 1) ? value >> 8 : value & 0xFF;
+}
+
+static void lockstep_write_reg(struct lockstep *ls, lanes_u16 mask, enum reg_value reg, lanes_u16 value) {
+    lanes_u16 *target;
+    if (reg >= REG_AX) {
+        target = &ls->regs[REG16_INDEX(reg)];
+    } else {
+        u8 index = REG8_INDEX(reg);
+        target = &ls->regs[index >> 1];
+        if (index & 1) {
+            value = (*target & 0x00FF) | (value << 8);
+        } else {
+            value = (*target & 0xFF00) | (value & 0xFF);
+        }
+    }
+    *target = lockstep_select(mask, value, *target);
+}
+
+static lanes_u16 lockstep_mem_address(struct lockstep *ls, struct mem_value *value) {
+    lanes_u16 bx = ls->regs[REG16_INDEX(REG_BX)];
+    lanes_u16 bp = ls->regs[REG16_INDEX(REG_BP)];
+    lanes_u16 si = ls->regs[REG16_INDEX(REG_SI)];
+    lanes_u16 di = ls->regs[REG16_INDEX(REG_DI)];
+
+    switch (value->base) {
+    case MEM_BASE_BX_SI: return bx + si + value->disp;
+    case MEM_BASE_BX_DI: return bx + di + value->disp;
+    case MEM_BASE_BP_SI: return bp + si + value->disp;
+    case MEM_BASE_BP_DI: return bp + di + value->disp;
+    case MEM_BASE_SI:    return si + value->disp;
+    case MEM_BASE_DI:    return di + value->disp;
+    case MEM_BASE_BP:    return bp + value->disp;
+    case MEM_BASE_BX:    return bx + value->disp;
+    default:             return lockstep_broadcast(value->direct_address);
+    }
+}
+
+static lanes_u16 lockstep_read_mem(struct lockstep *ls, lanes_u16 mask, struct mem_value *value, bool wide) {
+    lanes_u16 addr = lockstep_mem_address(ls, value);
+    lanes_u16 result = { 0 };
+    for (u32 lane = 0; lane < ls->lane_count; lane++) {
+        if (!mask[lane]) continue;
+        struct memory *mem = ls->mems[lane];
+        result[lane] = wide ? read_u16_at(mem, addr[lane]) : read_u8_at(mem, addr[lane]);
+    }
+    return result;
+}
+
+static void lockstep_write_mem(struct lockstep *ls, lanes_u16 mask, struct mem_value *value, lanes_u16 data, bool wide) {
+    lanes_u16 addr = lockstep_mem_address(ls, value);
+    for (u32 lane = 0; lane < ls->lane_count; lane++) {
+        if (!mask[lane]) continue;
+        struct memory *mem = ls->mems[lane];
+        if (wide) {
+            write_u16_at(mem, addr[lane], data[lane]);
+        } else {
+            write_u8_at(mem, addr[lane], data[lane]);
+        }
+    }
+}
+
+static lanes_u16 lockstep_read_dest(struct lockstep *ls, lanes_u16 mask, struct instruction *inst) {
+    if (inst->dest.is_reg) {
+        return lockstep_read_reg(ls, inst->dest.reg);
+    } else {
+        return lockstep_read_mem(ls, mask, &inst->dest.mem, inst->wide);
+    }
+}
+
+static void lockstep_write_dest(struct lockstep *ls, lanes_u16 mask, struct instruction *inst, lanes_u16 value) {
+    if (inst->dest.is_reg) {
+        lockstep_write_reg(ls, mask, inst->dest.reg, value);
+    } else {
+        lockstep_write_mem(ls, mask, &inst->dest.mem, value, inst->wide);
+    }
+}
+
+static lanes_u16 lockstep_read_src(struct lockstep *ls, lanes_u16 mask, struct instruction *inst) {
+    switch (inst->src.variant) {
+    case SRC_VALUE_REG:
+        return lockstep_read_reg(ls, inst->src.reg);
+    case SRC_VALUE_IMMEDIATE8:
+    case SRC_VALUE_IMMEDIATE16:
+        return lockstep_broadcast(inst->src.immediate);
+    case SRC_VALUE_MEM:
+        return lockstep_read_mem(ls, mask, &inst->src.mem, inst->wide);
+    default:
+        panic("Unhandled src variant %d\n", inst->src.variant);
+    }
+}
+
+// Same as `execute_instruction`, but only for lanes in `mask`. `ip` must already point past the instruction.
+void lockstep_execute(struct lockstep *ls, lanes_u16 mask, struct instruction *inst) {
+    switch (inst->op) {
+    case OP_MOV:
+        lockstep_write_dest(ls, mask, inst, lockstep_read_src(ls, mask, inst));
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CMP: {
+        lanes_u16 dest = lockstep_read_dest(ls, mask, inst);
+        lanes_u16 src = lockstep_read_src(ls, mask, inst);
+        lanes_u16 result = inst->op == OP_ADD ? dest + src : dest - src;
+        lockstep_set_lazy_flags(ls, mask, inst->op == OP_ADD ? LAZY_FLAGS_ADD : LAZY_FLAGS_SUB, dest, src, result, inst->wide);
+        if (inst->op != OP_CMP) {
+            lockstep_write_dest(ls, mask, inst, result);
+        }
+        break;
+    }
+    case OP_JE:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JB:
+    case OP_JBE:
+    case OP_JP:
+    case OP_JO:
+    case OP_JS:
+    case OP_JNE:
+    case OP_JNL:
+    case OP_JNLE:
+    case OP_JNB:
+    case OP_JNBE:
+    case OP_JNP:
+    case OP_JNO:
+    case OP_JNS: {
+        lanes_u16 taken = mask & lockstep_jump_condition(ls, inst->op);
+        ls->ip += taken & (u16)inst->jmp_offset;
+        break;
+    }
+    case OP_LOOP:
+    case OP_LOOPZ:
+    case OP_LOOPNZ: {
+        lanes_u16 *cx = &ls->regs[REG16_INDEX(REG_CX)];
+        *cx = lockstep_select(mask, *cx - 1, *cx);
+
+        lanes_u16 taken = mask & (lanes_u16)(*cx != 0);
+        if (inst->op == OP_LOOPZ) {
+            taken &= lockstep_jump_condition(ls, OP_JE);
+        } else if (inst->op == OP_LOOPNZ) {
+            taken &= lockstep_jump_condition(ls, OP_JNE);
+        }
+        ls->ip += taken & (u16)inst->jmp_offset;
+        break;
+    }
+    case OP_JCXZ: {
+        lanes_u16 taken = mask & (lanes_u16)(ls->regs[REG16_INDEX(REG_CX)] == 0);
+        ls->ip += taken & (u16)inst->jmp_offset;
+        break;
+    }
+    default:
+        todo("Unhandled instruction execution '%s'\n", operation_to_str(inst->op));
+    }
+}
+
+// Runs all lanes until each of them reaches `end_ip`, fails to decode or runs for `max_steps`.
+// `ls->mems` and the lane states must be set up before.
+void run_lockstep(struct lockstep *ls, u16 end_ip, uint64_t max_steps) {
+    for (u32 lane = 0; lane < ls->lane_count; lane++) {
+        ls->status[lane] = LOCKSTEP_RUNNING;
+        ls->steps[lane] = 0;
+        ls->clocks[lane] = 0;
+        ls->has_clocks[lane] = true;
+    }
+
+    while (true) {
+        // Lowest `ip` goes first, so lanes that jumped ahead wait for the others to catch up
+        int leader = -1;
+        for (u32 lane = 0; lane < ls->lane_count; lane++) {
+            if (ls->status[lane] != LOCKSTEP_RUNNING) continue;
+            if (ls->ip[lane] >= end_ip) {
+                ls->status[lane] = LOCKSTEP_FINISHED;
+                continue;
+            }
+            if (ls->steps[lane] >= max_steps) {
+                ls->status[lane] = LOCKSTEP_STEP_LIMIT;
+                continue;
+            }
+            if (leader == -1 || ls->ip[lane] < ls->ip[leader]) {
+                leader = lane;
+            }
+        }
+        if (leader == -1) break;
+
+        u16 ip = ls->ip[leader];
+        u16 next_ip = ip;
+        struct instruction inst;
+        enum decode_error err = decode_instruction(ls->mems[leader], &next_ip, &inst);
+        u16 size = next_ip - ip;
+
+        // Lanes at the same `ip` only share the instruction if their code bytes are the same
+        lanes_u16 mask = { 0 };
+        for (u32 lane = 0; lane < ls->lane_count; lane++) {
+            if (ls->status[lane] != LOCKSTEP_RUNNING || ls->ip[lane] != ip) continue;
+
+            bool same_code = true;
+            for (u16 i = 0; i < size && lane != leader; i++) {
+                if (read_u8_at(ls->mems[lane], ip + i) != read_u8_at(ls->mems[leader], ip + i)) {
+                    same_code = false;
+                    break;
+                }
+            }
+            if (same_code) mask[lane] = 0xFFFF;
+        }
+
+        if (err != DECODE_OK) {
+            for (u32 lane = 0; lane < ls->lane_count; lane++) {
+                if (mask[lane]) ls->status[lane] = LOCKSTEP_DECODE_ERROR;
+            }
+            continue;
+        }
+
+        // Clocks depend on the state before executing: if jumps are taken, and odd addresses on the 8086
+        lanes_u16 taken = { 0 };
+        lanes_u16 address = { 0 };
+        if (inst.op >= OP_JE) {
+            taken = lockstep_jump_taken(ls, &inst);
+        } else if (!inst.dest.is_reg) {
+            address = lockstep_mem_address(ls, &inst.dest.mem);
+        } else if (inst.src.variant == SRC_VALUE_MEM) {
+            address = lockstep_mem_address(ls, &inst.src.mem);
+        }
+
+        ls->ip = lockstep_select(mask, ls->ip + size, ls->ip);
+        lockstep_execute(ls, mask, &inst);
+
+        bool has_clocks = has_clock_estimation(&inst);
+        for (u32 lane = 0; lane < ls->lane_count; lane++) {
+            if (!mask[lane]) continue;
+            ls->steps[lane]++;
+            if (has_clocks) {
+                ls->clocks[lane] += get_total_clocks(get_instruction_clocks(ls->model, &inst, taken[lane] != 0, address[lane]));
+            }
+            ls->has_clocks[lane] = ls->has_clocks[lane] && has_clocks;
+        }
+    }
+}
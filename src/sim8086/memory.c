@@ -1,24 +1,109 @@
 // TODO: add error codes
 
+// An instruction can start up to `MAX_INSTRUCTION_SIZE-1` bytes before the written address,
+// so all of those entries need to be checked.
+static void invalidate_decoded_at(struct decode_cache *cache, u16 address) {
+    for (int i = 0; i < MAX_INSTRUCTION_SIZE; i++) {
+        struct decode_cache_entry *entry = &cache->entries[(u16)(address - i)];
+        if (entry->valid && entry->size > i) {
+            entry->valid = false;
+            entry->kind = 0;
+            entry->handler = cache->unlinked_handler;
+            cache->invalidations++;
+        }
+    }
+}
+
+// Forgets every decoded instruction, for when memory was replaced without going through the functions here.
+// Entries are left unlinked the same way as invalidated ones, so any engine can use the cache afterwards.
+void reset_decode_cache(struct decode_cache *cache) {
+    for (u32 i = 0; i < MEMORY_SIZE; i++) {
+        struct decode_cache_entry *entry = &cache->entries[i];
+        if (entry->valid) cache->invalidations++;
+        memset(entry, 0, sizeof(*entry));
+        entry->handler = cache->unlinked_handler;
+    }
+}
+
+static void mark_dirty_range(struct memory *mem, u32 start, u32 size) {
+    if (size == 0) return;
+    u32 first_page = start / MEMORY_PAGE_SIZE;
+    u32 last_page = (start + size - 1) / MEMORY_PAGE_SIZE;
+    memset(mem->dirty_pages + first_page, 0xFF, last_page - first_page + 1);
+}
+
+void clear_dirty_pages(struct memory *mem, u8 bit) {
+    for (u32 i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        mem->dirty_pages[i] &= ~bit;
+    }
+}
+
+// Writes ranges of pages with `bit` set into `ranges` (must fit `MAX_DIRTY_RANGES`) and clears the bit.
+// Returns the number of ranges.
+u32 take_dirty_ranges(struct memory *mem, u8 bit, struct memory_range *ranges) {
+    u32 count = 0;
+    u32 page = 0;
+    while (page < MEMORY_PAGE_COUNT) {
+        if (!(mem->dirty_pages[page] & bit)) {
+            page++;
+            continue;
+        }
+
+        u32 first_page = page;
+        while (page < MEMORY_PAGE_COUNT && (mem->dirty_pages[page] & bit)) {
+            mem->dirty_pages[page] &= ~bit;
+            page++;
+        }
+        ranges[count].start = first_page * MEMORY_PAGE_SIZE;
+        ranges[count].size = (page - first_page) * MEMORY_PAGE_SIZE;
+        count++;
+    }
+    return count;
+}
+
+static void invalidate_decoded_range(struct memory *mem, u32 start, u32 size) {
+    if (mem->decode_cache == NULL) return;
+
+    for (u32 i = 0; i < size; i++) {
+        invalidate_decoded_at(mem->decode_cache, start + i);
+    }
+}
+
 int load_mem_from_buff(struct memory *mem, u8 *buff, u16 buff_size, u16 start)
 {
     if (start + buff_size > MEMORY_SIZE) return -1;
     memcpy(mem->mem + start, buff, buff_size);
+    mark_dirty_range(mem, start, buff_size);
+    invalidate_decoded_range(mem, start, buff_size);
     return 0;
 }
 
 int load_mem_from_stream(struct memory *mem, FILE *stream, u16 start) {
-    u32 offset = 0;
-    while (true) {
-        u8 byte = fgetc(stream);
-        if (feof(stream)) break;
-        if (start + offset >= MEMORY_SIZE) return -1;
-        mem->mem[start + offset] = byte;
-        offset++;
-    }
+    u32 offset = fread(mem->mem + start, 1, MEMORY_SIZE - start, stream);
+    mark_dirty_range(mem, start, offset);
+    invalidate_decoded_range(mem, start, offset);
+    if (ferror(stream) || fgetc(stream) != EOF) return -1;
     return offset;
 }
 
+// Copies all segments into memory. Nothing is copied if any of them doesn't fit,
+// later segments overwrite earlier ones where they overlap.
+// Returns the end of the highest segment, or -1 on failure.
+int load_mem_segments(struct memory *mem, const struct memory_segment *segments, u32 count) {
+    u32 end = 0;
+    for (u32 i = 0; i < count; i++) {
+        if (segments[i].start > MEMORY_SIZE || segments[i].size > MEMORY_SIZE - segments[i].start) return -1;
+        if (segments[i].start + segments[i].size > end) end = segments[i].start + segments[i].size;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        memcpy(mem->mem + segments[i].start, segments[i].data, segments[i].size);
+        mark_dirty_range(mem, segments[i].start, segments[i].size);
+        invalidate_decoded_range(mem, segments[i].start, segments[i].size);
+    }
+    return end;
+}
+
 int load_mem_from_file(struct memory *mem, const char *filename, u16 start) {
     FILE *stream = fopen(filename, "rb");
     if (stream == NULL) {
@@ -39,7 +124,18 @@ u16 read_u16_at(struct memory *mem, u16 address) {
 }
 
 void write_u8_at(struct memory *mem, u16 address, u8 value) {
+    if (mem->write_log) {
+        struct write_log *log = mem->write_log;
+        assert(log->count < WRITE_LOG_SIZE);
+        log->address[log->count] = address;
+        log->old_value[log->count] = mem->mem[address % MEMORY_SIZE];
+        log->count++;
+    }
     mem->mem[address % MEMORY_SIZE] = value;
+    mem->dirty_pages[address / MEMORY_PAGE_SIZE] = 0xFF;
+    if (mem->decode_cache) {
+        invalidate_decoded_at(mem->decode_cache, address);
+    }
 }
 
 void write_u16_at(struct memory *mem, u16 address, u16 value) {
@@ -0,0 +1,170 @@
+// Predecoded program image, so that running the same program again doesn't need to assemble or decode it.
+//
+// File starts with a 32 byte header, all numbers are little endian:
+//     "S86P"
+//     u32 version
+//     u64 image hash            `hash_precompiled_bytes` of the image, checked when opening
+//     u64 source hash           of the file the image was made from, a different hash means the file is stale
+//     u32 image size
+//     u32 instruction count
+// Followed by the image, padded with zeroes to a multiple of 8 bytes, and then `struct precompiled_inst` for
+// every instruction. Instructions are decoded linearly from address 0, bytes which can't be decoded are skipped.
+// Files are used in place (see `open_precompiled`), so `struct precompiled_inst` is also the file format.
+// Block starts and clocks aren't needed for running, "dump" shows them.
+
+#define PRECOMPILED_MAGIC "S86P"
+#define PRECOMPILED_VERSION 1
+#define PRECOMPILED_HEADER_SIZE 32
+#define PRECOMPILED_IMAGE_PADDING(size) (((size) + 7) & ~7)
+
+#define PRECOMPILED_BLOCK_START (1 << 0) // Jump target, first instruction or the one after a jump
+
+struct precompiled_inst {
+    u16 address;
+    u8 size;
+    u8 flags;
+    u16 clocks[2]; // Indexed by `enum cpu_model`, with jumps taken and memory operands at even addresses
+    struct packed_instruction inst;
+};
+_Static_assert(sizeof(struct precompiled_inst) == 16, "precompiled instruction must be 16 bytes");
+
+struct precompiled {
+    uint64_t image_hash;
+    uint64_t source_hash;
+    const u8 *image;
+    u32 image_size;
+    const struct precompiled_inst *insts;
+    u32 inst_count;
+};
+
+// FNV-1a
+uint64_t hash_precompiled_bytes(const u8 *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static void precompiled_put_u32(u8 *buff, u32 value) {
+    for (int i = 0; i < 4; i++) buff[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static void precompiled_put_u64(u8 *buff, uint64_t value) {
+    for (int i = 0; i < 8; i++) buff[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static u32 precompiled_get_u32(const u8 *buff) {
+    return buff[0] | (buff[1] << 8) | (buff[2] << 16) | ((u32)buff[3] << 24);
+}
+
+static uint64_t precompiled_get_u64(const u8 *buff) {
+    return precompiled_get_u32(buff) | ((uint64_t)precompiled_get_u32(buff + 4) << 32);
+}
+
+// Returns the whole file in a buffer allocated with `malloc`, or NULL if allocation failed
+u8 *build_precompiled(const u8 *image, u32 image_size, uint64_t source_hash, u32 *file_size) {
+    assert(image_size <= MEMORY_SIZE);
+    struct precompiled_inst *insts = calloc(image_size + 1, sizeof(struct precompiled_inst));
+    if (insts == NULL) return NULL;
+
+    u32 inst_count = 0;
+    size_t offset = 0;
+    while (offset < image_size) {
+        struct instruction inst;
+        size_t start = offset;
+        if (decode_instruction_from_span(image, image_size, &offset, &inst) != DECODE_OK) {
+            offset = start + 1;
+            continue;
+        }
+
+        struct precompiled_inst *entry = &insts[inst_count++];
+        entry->address = start;
+        entry->size = offset - start;
+        entry->clocks[CPU_8086] = get_total_clocks(get_instruction_clocks(CPU_8086, &inst, true, 0));
+        entry->clocks[CPU_8088] = get_total_clocks(get_instruction_clocks(CPU_8088, &inst, true, 0));
+        pack_instruction(&entry->inst, &inst);
+    }
+
+    // Mark block starts, instructions are sorted by address so jump targets can be found with a binary search
+    for (u32 i = 0; i < inst_count; i++) {
+        struct instruction inst;
+        unpack_instruction(&inst, &insts[i].inst);
+        if (i == 0) insts[i].flags |= PRECOMPILED_BLOCK_START;
+        if (inst.op < OP_JE || inst.op > OP_JCXZ) continue;
+
+        if (i+1 < inst_count) insts[i+1].flags |= PRECOMPILED_BLOCK_START;
+        u16 target = insts[i].address + insts[i].size + inst.jmp_offset;
+        u32 low = 0, high = inst_count;
+        while (low < high) {
+            u32 middle = (low + high) / 2;
+            if (insts[middle].address < target) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low < inst_count && insts[low].address == target) insts[low].flags |= PRECOMPILED_BLOCK_START;
+    }
+
+    u32 padded_size = PRECOMPILED_IMAGE_PADDING(image_size);
+    u32 size = PRECOMPILED_HEADER_SIZE + padded_size + inst_count * sizeof(struct precompiled_inst);
+    u8 *file = calloc(size, 1);
+    if (file == NULL) {
+        free(insts);
+        return NULL;
+    }
+
+    memcpy(file, PRECOMPILED_MAGIC, 4);
+    precompiled_put_u32(file + 4, PRECOMPILED_VERSION);
+    precompiled_put_u64(file + 8, hash_precompiled_bytes(image, image_size));
+    precompiled_put_u64(file + 16, source_hash);
+    precompiled_put_u32(file + 24, image_size);
+    precompiled_put_u32(file + 28, inst_count);
+    memcpy(file + PRECOMPILED_HEADER_SIZE, image, image_size);
+    memcpy(file + PRECOMPILED_HEADER_SIZE + padded_size, insts, inst_count * sizeof(struct precompiled_inst));
+
+    free(insts);
+    *file_size = size;
+    return file;
+}
+
+// Points `precompiled` into `data` without copying, `data` must be 8 byte aligned and outlive it.
+// Returns false if the file is not valid or was made by a different version.
+bool open_precompiled(struct precompiled *precompiled, const u8 *data, size_t size) {
+    if (size < PRECOMPILED_HEADER_SIZE || memcmp(data, PRECOMPILED_MAGIC, 4) != 0) return false;
+    if (precompiled_get_u32(data + 4) != PRECOMPILED_VERSION) return false;
+
+    precompiled->image_hash = precompiled_get_u64(data + 8);
+    precompiled->source_hash = precompiled_get_u64(data + 16);
+    precompiled->image_size = precompiled_get_u32(data + 24);
+    precompiled->inst_count = precompiled_get_u32(data + 28);
+    if (precompiled->image_size > MEMORY_SIZE || precompiled->inst_count > MEMORY_SIZE) return false;
+
+    u32 padded_size = PRECOMPILED_IMAGE_PADDING(precompiled->image_size);
+    if (size != PRECOMPILED_HEADER_SIZE + padded_size + (size_t)precompiled->inst_count * sizeof(struct precompiled_inst)) return false;
+    precompiled->image = data + PRECOMPILED_HEADER_SIZE;
+    precompiled->insts = (const struct precompiled_inst *)(data + PRECOMPILED_HEADER_SIZE + padded_size);
+
+    if (hash_precompiled_bytes(precompiled->image, precompiled->image_size) != precompiled->image_hash) return false;
+    for (u32 i = 0; i < precompiled->inst_count; i++) {
+        const struct precompiled_inst *inst = &precompiled->insts[i];
+        if (inst->size == 0 || inst->size > MAX_INSTRUCTION_SIZE || inst->address + inst->size > precompiled->image_size) return false;
+        if (inst->inst.op >= __OP_COUNT || inst->inst.dest >= __REG_COUNT || inst->inst.src >= __REG_COUNT) return false;
+    }
+    return true;
+}
+
+// Fills in the decode cache for an image that was loaded at `start`, the same as decoding every instruction once
+void prefill_decode_cache(struct decode_cache *cache, const struct precompiled *precompiled, u16 start) {
+    for (u32 i = 0; i < precompiled->inst_count; i++) {
+        const struct precompiled_inst *inst = &precompiled->insts[i];
+        struct decode_cache_entry *entry = &cache->entries[(u16)(start + inst->address)];
+        entry->valid = true;
+        entry->kind = 0;
+        entry->handler = cache->unlinked_handler;
+        entry->size = inst->size;
+        entry->inst = inst->inst;
+    }
+}
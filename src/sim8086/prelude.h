@@ -3,4 +3,14 @@
 #include "utils.c"
 #include "memory.c"
 #include "decoder.c"
-#include "simulator.c"
\ No newline at end of file
+#include "assembler.c"
+#include "simulator.c"
+#include "snapshot.c"
+#include "lockstep.c"
+#include "journal.c"
+#include "trace.c"
+#include "profile.c"
+#include "static_clocks.c"
+#include "precompiled.c"
+#include "threaded.c"
+#include "jit.c"
\ No newline at end of file
@@ -0,0 +1,81 @@
+// Execution counts and estimated clocks per instruction address and per basic block.
+//
+// Everything is counted in flat arrays indexed by address, so profiling only costs a few increments per step.
+// Blocks are as they get executed: a block starts at the first instruction after a jump
+// (or at the first one executed) and ends at the next jump.
+
+struct profile {
+    uint64_t counts[MEMORY_SIZE];
+    uint64_t clocks[MEMORY_SIZE];
+
+    // Indexed by the address of the first instruction of a block
+    uint64_t block_counts[MEMORY_SIZE];
+    uint64_t block_clocks[MEMORY_SIZE];
+    u16 block_ends[MEMORY_SIZE]; // Address of the jump which ended the block
+
+    uint64_t total_steps;
+    uint64_t total_clocks;
+    bool missing_clocks; // Some executed instruction had no clock estimation, see `has_clock_estimation`
+};
+
+static bool is_block_end(struct instruction *inst) {
+    return inst->op >= OP_JE && inst->op <= OP_JCXZ;
+}
+
+// Runs until `ip` reaches `end_ip` or `max_steps` instructions were executed (0 means no limit).
+// Counts are added to what is already in `profile`.
+enum decode_error run_profiled(struct profile *profile, struct memory *mem, struct cpu_state *cpu, u32 end_ip, uint64_t max_steps, enum cpu_model model) {
+    struct instruction inst;
+    u16 block_start = cpu->ip;
+    u16 last_ip = cpu->ip;
+    bool in_block = false;
+    uint64_t steps = 0;
+    enum decode_error result = DECODE_OK;
+    while (cpu->ip < end_ip && (max_steps == 0 || steps < max_steps)) {
+        u16 ip = cpu->ip;
+        enum decode_error err;
+        if (mem->decode_cache) {
+            err = decode_instruction_cached(mem->decode_cache, mem, &cpu->ip, &inst);
+        } else {
+            err = decode_instruction(mem, &cpu->ip, &inst);
+        }
+        if (err != DECODE_OK) {
+            cpu->ip = ip;
+            result = err;
+            break;
+        }
+
+        if (!in_block) {
+            block_start = ip;
+            profile->block_counts[block_start]++;
+            in_block = true;
+        }
+
+        u32 clocks = 0;
+        if (has_clock_estimation(&inst)) {
+            clocks = get_total_clocks(estimate_executed_clocks(model, &inst, cpu));
+        } else {
+            profile->missing_clocks = true;
+        }
+        profile->counts[ip]++;
+        profile->clocks[ip] += clocks;
+        profile->block_clocks[block_start] += clocks;
+        profile->total_clocks += clocks;
+
+        execute_instruction(mem, cpu, &inst);
+        last_ip = ip;
+        steps++;
+
+        if (is_block_end(&inst)) {
+            profile->block_ends[block_start] = ip;
+            in_block = false;
+        }
+    }
+
+    // Block was cut short by the end of the program or the step limit
+    if (in_block) {
+        profile->block_ends[block_start] = last_ip;
+    }
+    profile->total_steps += steps;
+    return result;
+}
@@ -27,6 +27,7 @@
 
 #define ARRAY_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
 #define MEMORY_SIZE 65536 // 2^16
+#define MAX_INSTRUCTION_SIZE 6 // opcode + mod/reg/rm + 16bit displacement + 16bit immediate
 
 enum operation {
     OP_MOV,
@@ -109,33 +110,151 @@ struct src_value {
     };
 };
 
-// TODO: Store "wide" flag on instruction, it is useful to know when doing most operations
 struct instruction {
     enum operation op;
+    bool wide;
     struct reg_or_mem_value dest;
     struct src_value src;
     i8 jmp_offset;
 };
 
+#define PACKED_WIDE      0b0001
+#define PACKED_DEST_MEM  0b0010
+#define PACKED_SRC_SHIFT 2 // `enum src_value_variant` is stored in bits 2-3
+
+// Same information as `struct instruction`, but packed into 8 bytes.
+// Only one of the operands can be a memory location, so they can share `disp`.
+// Use `pack_instruction` and `unpack_instruction` to convert between the two.
+struct packed_instruction {
+    u8 op;
+    u8 flags;
+    u8 dest; // `enum reg_value` or `enum mem_base`, depending on `PACKED_DEST_MEM`
+    u8 src;  // `enum reg_value` or `enum mem_base`, depending on src variant
+    u16 disp;
+    u16 immediate; // Also stores `jmp_offset`
+};
+_Static_assert(sizeof(struct packed_instruction) <= 8, "packed instruction must fit in 8 bytes");
+
+struct decode_cache_entry {
+    // Filled in by the threaded engine, see "threaded.c".
+    // `kind` is 0 and `handler` is `decode_cache.unlinked_handler` until the entry gets linked.
+    const void *handler;
+    u8 kind;
+    // Only used by fused entries, which also depend on the bytes of the following jump
+    bool fused_flags_live;
+    u32 fused_epoch; // Lower bits of `decode_cache.invalidations` at the time of linking
+
+    bool valid;
+    u8 size;
+    struct packed_instruction inst;
+};
+
+// Decoded instructions indexed by the address of their first byte.
+// Entries get invalidated when any of their bytes are written to, see `struct memory`.
+struct decode_cache {
+    struct decode_cache_entry entries[MEMORY_SIZE];
+    const void *unlinked_handler;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+};
+
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+
+// Bits of `memory.dirty_pages`. Every write sets all of them, and each user of dirty tracking clears only its own bit.
+#define DIRTY_SNAPSHOT (1 << 0) // Page differs from the last snapshot, see "snapshot.c"
+#define DIRTY_DUMP     (1 << 1) // Page changed since the program was loaded, used by sparse memory dumps
+#define DIRTY_WEB      (1 << 2) // Page changed since the web UI last asked for dirty ranges
+
+// Consecutive dirty pages merged together, at most every other page can start a new range
+#define MAX_DIRTY_RANGES (MEMORY_PAGE_COUNT / 2)
+
+struct memory_range {
+    u32 start;
+    u32 size;
+};
+
+// Image to be copied into memory at `start`, see `load_mem_segments`
+struct memory_segment {
+    const u8 *data;
+    u32 size;
+    u32 start;
+};
+
+#define WRITE_LOG_SIZE 8 // No instruction writes more than this many bytes
+
+// Old values of the bytes written by one instruction, see "journal.c"
+struct write_log {
+    u8 count;
+    u16 address[WRITE_LOG_SIZE];
+    u8 old_value[WRITE_LOG_SIZE];
+};
+
 struct memory {
     u8 mem[MEMORY_SIZE];
+
+    // Optional, if set writes to memory will invalidate cached instructions that overlap them
+    struct decode_cache *decode_cache;
+
+    // Optional, if set the old value of every written byte is appended to it
+    struct write_log *write_log;
+
+    u8 dirty_pages[MEMORY_PAGE_COUNT];
 };
 
+enum cpu_model {
+    CPU_8086,
+    CPU_8088, // Same as the 8086, but with an 8-bit data bus, so every word transfer takes 4 more clocks
+};
+
+struct instruction_clocks {
+    u32 base;
+    u32 ea;      // Effective address calculation
+    u32 penalty; // Word transfers on the 8088, or at odd addresses on the 8086
+};
+
+// Bits of the 8086 FLAGS register, see "2.3 Flags" in the manual
+#define FLAG_CARRY     (1 << 0)
+#define FLAG_PARITY    (1 << 2)
+#define FLAG_AUX_CARRY (1 << 4)
+#define FLAG_ZERO      (1 << 6)
+#define FLAG_SIGN      (1 << 7)
+#define FLAG_OVERFLOW  (1 << 11)
+
+enum lazy_flags_op {
+    LAZY_FLAGS_NONE,
+    LAZY_FLAGS_ADD,
+    LAZY_FLAGS_SUB, // Also used by CMP
+};
+
+// Index into `cpu_state.regs` and `cpu_state.regs8`, for a 16bit and 8bit `enum reg_value` respectively.
+// The 8bit registers AL, CL, DL, BL, AH, CH, DH, BH are the low byte of AX, CX, DX, BX and then the high byte.
+#define REG16_INDEX(reg) ((reg) - REG_AX)
+#define REG8_INDEX(reg) ((((reg) & 0b11) << 1) | ((reg) >> 2))
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "cpu_state.regs8 assumes a little-endian host"
+#endif
+
 struct cpu_state {
-    u16 ax;
-    u16 bx;
-    u16 cx;
-    u16 dx;
-    u16 sp;
-    u16 bp;
-    u16 si;
-    u16 di;
+    // Same order as the 16bit registers in `enum reg_value`: AX, CX, DX, BX, SP, BP, SI, DI.
+    // `regs8` is the byte view of the same registers: AL, AH, CL, CH, DL, DH, BL, BH.
+    union {
+        u16 regs[8];
+        u8 regs8[16];
+    };
+    u16 ip; // Placed right after `regs`, so all registers can be read as one array of 9
 
+    // Arithmetic flags are not computed when an instruction executes. Only the inputs of the last
+    // flag setting operation are recorded, and flags are derived from them when something reads them.
+    // Use `get_cpu_flags`, `set_cpu_flags` and `is_jump_condition_met` instead of accessing this directly.
     struct {
-        bool zero;
-        bool sign;
-        // TODO: Add all flags
-    } flags;
-
-    u16 ip;
+        u8 op; // `enum lazy_flags_op`
+        bool wide;
+        u16 dest;
+        u16 src;
+        u16 result;
+        u16 flags; // Used as is when `op` is `LAZY_FLAGS_NONE`
+    } lazy_flags;
 };
\ No newline at end of file
@@ -1,93 +1,33 @@
 
 u16 read_reg_value(struct cpu_state *cpu, enum reg_value reg)
 {
-    switch (reg) {
-    case REG_AL: return cpu->ax & 0xFF;
-    case REG_CL: return cpu->cx & 0xFF;
-    case REG_DL: return cpu->dx & 0xFF;
-    case REG_BL: return cpu->bx & 0xFF;
-    case REG_AH: return (cpu->ax >> 8) & 0xFF;
-    case REG_CH: return (cpu->cx >> 8) & 0xFF;
-    case REG_DH: return (cpu->dx >> 8) & 0xFF;
-    case REG_BH: return (cpu->bx >> 8) & 0xFF;
-    case REG_AX: return cpu->ax;
-    case REG_CX: return cpu->cx;
-    case REG_DX: return cpu->dx;
-    case REG_BX: return cpu->bx;
-    case REG_SP: return cpu->sp;
-    case REG_BP: return cpu->bp;
-    case REG_SI: return cpu->si;
-    case REG_DI: return cpu->di;
-    default: panic("Unhandled register '%s'", reg_to_str(reg));
+    if (reg >= REG_AX) {
+        return cpu->regs[REG16_INDEX(reg)];
+    } else {
+        return cpu->regs8[REG8_INDEX(reg)];
     }
 }
 
 void write_reg_value(struct cpu_state *cpu, enum reg_value reg, u16 value)
 {
-    switch (reg) {
-    case REG_AL:
-        cpu->ax = (cpu->ax & 0xFF00) & value;
-        break;
-    case REG_CL:
-        cpu->cx = (cpu->cx & 0xFF00) & value;
-        break;
-    case REG_DL:
-        cpu->dx = (cpu->dx & 0xFF00) & value;
-        break;
-    case REG_BL:
-        cpu->bx = (cpu->bx & 0xFF00) & value;
-        break;
-    case REG_AH:
-        cpu->ax = (cpu->ax & 0x00FF) & (value << 8);
-        break;
-    case REG_CH:
-        cpu->cx = (cpu->cx & 0x00FF) & (value << 8);
-        break;
-    case REG_DH:
-        cpu->dx = (cpu->dx & 0x00FF) & (value << 8);
-        break;
-    case REG_BH:
-        cpu->bx = (cpu->bx & 0x00FF) & (value << 8);
-        break;
-    case REG_AX:
-        cpu->ax = value;
-        break;
-    case REG_CX:
-        cpu->cx = value;
-        break;
-    case REG_DX:
-        cpu->dx = value;
-        break;
-    case REG_BX:
-        cpu->bx = value;
-        break;
-    case REG_SP:
-        cpu->sp = value;
-        break;
-    case REG_BP:
-        cpu->bp = value;
-        break;
-    case REG_SI:
-        cpu->si = value;
-        break;
-    case REG_DI:
-        cpu->di = value;
-        break;
-    default:
-        panic("Unhandled register '%s'", reg_to_str(reg));
+    if (reg >= REG_AX) {
+        cpu->regs[REG16_INDEX(reg)] = value;
+    } else {
+        cpu->regs8[REG8_INDEX(reg)] = value;
     }
 }
 
 u16 read_mem_base_value(struct cpu_state *cpu, enum mem_base base) {
+    u16 *regs = cpu->regs;
     switch (base) {
-    case MEM_BASE_BX_SI: return read_reg_value(cpu, REG_BX) + read_reg_value(cpu, REG_SI);
-    case MEM_BASE_BX_DI: return read_reg_value(cpu, REG_BX) + read_reg_value(cpu, REG_DI);
-    case MEM_BASE_BP_SI: return read_reg_value(cpu, REG_BP) + read_reg_value(cpu, REG_SI);
-    case MEM_BASE_BP_DI: return read_reg_value(cpu, REG_BP) + read_reg_value(cpu, REG_DI);
-    case MEM_BASE_SI:    return read_reg_value(cpu, REG_SI);
-    case MEM_BASE_DI:    return read_reg_value(cpu, REG_DI);
-    case MEM_BASE_BP:    return read_reg_value(cpu, REG_BP);
-    case MEM_BASE_BX:    return read_reg_value(cpu, REG_BX);
+    case MEM_BASE_BX_SI: return regs[REG16_INDEX(REG_BX)] + regs[REG16_INDEX(REG_SI)];
+    case MEM_BASE_BX_DI: return regs[REG16_INDEX(REG_BX)] + regs[REG16_INDEX(REG_DI)];
+    case MEM_BASE_BP_SI: return regs[REG16_INDEX(REG_BP)] + regs[REG16_INDEX(REG_SI)];
+    case MEM_BASE_BP_DI: return regs[REG16_INDEX(REG_BP)] + regs[REG16_INDEX(REG_DI)];
+    case MEM_BASE_SI:    return regs[REG16_INDEX(REG_SI)];
+    case MEM_BASE_DI:    return regs[REG16_INDEX(REG_DI)];
+    case MEM_BASE_BP:    return regs[REG16_INDEX(REG_BP)];
+    case MEM_BASE_BX:    return regs[REG16_INDEX(REG_BX)];
     default: return 0;
     }
 }
@@ -146,6 +86,11 @@ void write_reg_or_mem_value(struct memory *mem, struct cpu_state *cpu, struct re
     }
 }
 
+u16 calculate_packed_mem_address(struct cpu_state *cpu, u8 base, u16 disp) {
+    struct mem_value value = { .base = base, .disp = disp };
+    return calculate_mem_address(cpu, &value);
+}
+
 bool is_reg_16bit(enum reg_value reg) {
     switch (reg) {
     case REG_AL:
@@ -171,24 +116,113 @@ bool is_reg_16bit(enum reg_value reg) {
 }
 
 bool are_instruction_operands_16bit(struct instruction *inst) {
-    if (inst->dest.is_reg) {
-        return is_reg_16bit(inst->dest.reg);
-    } else if (inst->src.variant == SRC_VALUE_REG) {
-        return is_reg_16bit(inst->src.reg);
-    } else if (inst->src.variant == SRC_VALUE_IMMEDIATE8) {
-        return false;
-    } else if (inst->src.variant == SRC_VALUE_IMMEDIATE16) {
-        return true;
-    } else {
-        panic("Failed to determine instruction width\n");
+    return inst->wide;
+}
+
+void set_lazy_flags(struct cpu_state *cpu, enum lazy_flags_op op, u16 dest, u16 src, u16 result, bool wide) {
+    cpu->lazy_flags.op = op;
+    cpu->lazy_flags.wide = wide;
+    cpu->lazy_flags.dest = dest;
+    cpu->lazy_flags.src = src;
+    cpu->lazy_flags.result = result;
+}
+
+static u16 lazy_flags_mask(struct cpu_state *cpu) {
+    return cpu->lazy_flags.wide ? 0xFFFF : 0xFF;
+}
+
+static u16 lazy_flags_sign_bit(struct cpu_state *cpu) {
+    return cpu->lazy_flags.wide ? 0x8000 : 0x80;
+}
+
+bool get_zero_flag(struct cpu_state *cpu) {
+    if (cpu->lazy_flags.op == LAZY_FLAGS_NONE) return cpu->lazy_flags.flags & FLAG_ZERO;
+    return (cpu->lazy_flags.result & lazy_flags_mask(cpu)) == 0;
+}
+
+bool get_sign_flag(struct cpu_state *cpu) {
+    if (cpu->lazy_flags.op == LAZY_FLAGS_NONE) return cpu->lazy_flags.flags & FLAG_SIGN;
+    return cpu->lazy_flags.result & lazy_flags_sign_bit(cpu);
+}
+
+bool get_carry_flag(struct cpu_state *cpu) {
+    u16 mask = lazy_flags_mask(cpu);
+    u16 dest = cpu->lazy_flags.dest & mask;
+    u16 src = cpu->lazy_flags.src & mask;
+
+    switch (cpu->lazy_flags.op) {
+    case LAZY_FLAGS_ADD: return (u32)dest + (u32)src > mask;
+    case LAZY_FLAGS_SUB: return src > dest;
+    default:             return cpu->lazy_flags.flags & FLAG_CARRY;
     }
 }
 
-void update_sign_flag(struct cpu_state *cpu, struct instruction *inst, u16 result) {
-    if (are_instruction_operands_16bit(inst)) {
-        cpu->flags.sign = (result >> 15) & 0b1;
-    } else {
-        cpu->flags.sign = (result >> 7) & 0b1;
+bool get_overflow_flag(struct cpu_state *cpu) {
+    u16 dest = cpu->lazy_flags.dest;
+    u16 src = cpu->lazy_flags.src;
+    u16 result = cpu->lazy_flags.result;
+
+    switch (cpu->lazy_flags.op) {
+    case LAZY_FLAGS_ADD: return (~(dest ^ src) & (dest ^ result)) & lazy_flags_sign_bit(cpu);
+    case LAZY_FLAGS_SUB: return ((dest ^ src) & (dest ^ result)) & lazy_flags_sign_bit(cpu);
+    default:             return cpu->lazy_flags.flags & FLAG_OVERFLOW;
+    }
+}
+
+bool get_aux_carry_flag(struct cpu_state *cpu) {
+    if (cpu->lazy_flags.op == LAZY_FLAGS_NONE) return cpu->lazy_flags.flags & FLAG_AUX_CARRY;
+    return (cpu->lazy_flags.dest ^ cpu->lazy_flags.src ^ cpu->lazy_flags.result) & 0x10;
+}
+
+// Parity flag is set when the low byte of the result has an even number of 1 bits
+bool get_parity_flag(struct cpu_state *cpu) {
+    if (cpu->lazy_flags.op == LAZY_FLAGS_NONE) return cpu->lazy_flags.flags & FLAG_PARITY;
+    u8 value = cpu->lazy_flags.result & 0xFF;
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return (value & 1) == 0;
+}
+
+u16 get_cpu_flags(struct cpu_state *cpu) {
+    if (cpu->lazy_flags.op == LAZY_FLAGS_NONE) return cpu->lazy_flags.flags;
+
+    u16 flags = 0;
+    if (get_carry_flag(cpu))     flags |= FLAG_CARRY;
+    if (get_parity_flag(cpu))    flags |= FLAG_PARITY;
+    if (get_aux_carry_flag(cpu)) flags |= FLAG_AUX_CARRY;
+    if (get_zero_flag(cpu))      flags |= FLAG_ZERO;
+    if (get_sign_flag(cpu))      flags |= FLAG_SIGN;
+    if (get_overflow_flag(cpu))  flags |= FLAG_OVERFLOW;
+    return flags;
+}
+
+void set_cpu_flags(struct cpu_state *cpu, u16 flags) {
+    cpu->lazy_flags.op = LAZY_FLAGS_NONE;
+    cpu->lazy_flags.flags = flags;
+}
+
+// Checks the condition of a conditional jump, only the flags that it needs are evaluated.
+// Look at "Table 2-15. Interpretation of Conditional Transfers" for more details.
+bool is_jump_condition_met(struct cpu_state *cpu, enum operation op) {
+    switch (op) {
+    case OP_JE:   return get_zero_flag(cpu);
+    case OP_JNE:  return !get_zero_flag(cpu);
+    case OP_JL:   return get_sign_flag(cpu) != get_overflow_flag(cpu);
+    case OP_JNL:  return get_sign_flag(cpu) == get_overflow_flag(cpu);
+    case OP_JLE:  return get_zero_flag(cpu) || get_sign_flag(cpu) != get_overflow_flag(cpu);
+    case OP_JNLE: return !get_zero_flag(cpu) && get_sign_flag(cpu) == get_overflow_flag(cpu);
+    case OP_JB:   return get_carry_flag(cpu);
+    case OP_JNB:  return !get_carry_flag(cpu);
+    case OP_JBE:  return get_carry_flag(cpu) || get_zero_flag(cpu);
+    case OP_JNBE: return !get_carry_flag(cpu) && !get_zero_flag(cpu);
+    case OP_JP:   return get_parity_flag(cpu);
+    case OP_JNP:  return !get_parity_flag(cpu);
+    case OP_JO:   return get_overflow_flag(cpu);
+    case OP_JNO:  return !get_overflow_flag(cpu);
+    case OP_JS:   return get_sign_flag(cpu);
+    case OP_JNS:  return !get_sign_flag(cpu);
+    default: panic("Operation '%s' is not a conditional jump\n", operation_to_str(op));
     }
 }
 
@@ -206,8 +240,7 @@ void execute_instruction(struct memory *mem, struct cpu_state *cpu, struct instr
         u16 src_value = read_src_value(mem, cpu, &inst->src, wide);
         u16 result = dest_value + src_value;
 
-        cpu->flags.zero = result == 0;
-        update_sign_flag(cpu, inst, result);
+        set_lazy_flags(cpu, LAZY_FLAGS_ADD, dest_value, src_value, result, wide);
 
         write_reg_or_mem_value(mem, cpu, &inst->dest, result, wide);
         break;
@@ -218,8 +251,7 @@ void execute_instruction(struct memory *mem, struct cpu_state *cpu, struct instr
         u16 src_value = read_src_value(mem, cpu, &inst->src, wide);
         u16 result = dest_value - src_value;
 
-        cpu->flags.zero = result == 0;
-        update_sign_flag(cpu, inst, result);
+        set_lazy_flags(cpu, LAZY_FLAGS_SUB, dest_value, src_value, result, wide);
 
         write_reg_or_mem_value(mem, cpu, &inst->dest, result, wide);
         break;
@@ -230,15 +262,52 @@ void execute_instruction(struct memory *mem, struct cpu_state *cpu, struct instr
         u16 src_value = read_src_value(mem, cpu, &inst->src, wide);
         u16 result = dest_value - src_value;
 
-        cpu->flags.zero = result == 0;
-        update_sign_flag(cpu, inst, result);
+        set_lazy_flags(cpu, LAZY_FLAGS_SUB, dest_value, src_value, result, wide);
         break;
     }
-    case OP_JNE: {
-        if (!cpu->flags.zero) {
+    case OP_JE:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JB:
+    case OP_JBE:
+    case OP_JP:
+    case OP_JO:
+    case OP_JS:
+    case OP_JNE:
+    case OP_JNL:
+    case OP_JNLE:
+    case OP_JNB:
+    case OP_JNBE:
+    case OP_JNP:
+    case OP_JNO:
+    case OP_JNS: {
+        if (is_jump_condition_met(cpu, inst->op)) {
             cpu->ip += inst->jmp_offset;
         }
+        break;
+    }
+    case OP_LOOP:
+    case OP_LOOPZ:
+    case OP_LOOPNZ: {
+        u16 cx = read_reg_value(cpu, REG_CX) - 1;
+        write_reg_value(cpu, REG_CX, cx);
 
+        bool jump = cx != 0;
+        if (inst->op == OP_LOOPZ) {
+            jump = jump && get_zero_flag(cpu);
+        } else if (inst->op == OP_LOOPNZ) {
+            jump = jump && !get_zero_flag(cpu);
+        }
+
+        if (jump) {
+            cpu->ip += inst->jmp_offset;
+        }
+        break;
+    }
+    case OP_JCXZ: {
+        if (read_reg_value(cpu, REG_CX) == 0) {
+            cpu->ip += inst->jmp_offset;
+        }
         break;
     } default:
         todo("Unhandled instruction execution '%s'\n", operation_to_str(inst->op));
@@ -267,59 +336,179 @@ int estimate_ea_clocks(struct mem_value *value) {
     }
 }
 
-u32 estimate_instruction_clocks(struct instruction *inst) {
-    switch (inst->op) {
-    case OP_MOV: {
-        bool is_src_memory = inst->src.variant == SRC_VALUE_MEM;
-        bool is_dest_memory = !inst->dest.is_reg;
-        bool is_src_accumulator  = inst->src.variant == SRC_VALUE_REG && inst->src.reg == REG_AX;
-        bool is_dest_accumulator = inst->dest.is_reg && inst->dest.reg == REG_AX;
-        bool is_src_reg = inst->src.variant == SRC_VALUE_REG;
-        bool is_dest_reg = inst->dest.is_reg;
-        bool is_src_immediate = inst->src.variant == SRC_VALUE_IMMEDIATE8 || inst->src.variant == SRC_VALUE_IMMEDIATE16;
-
-        if ((is_src_accumulator && is_dest_memory) || (is_dest_accumulator && is_src_memory)) {
-            return 10;
-        } else if (is_src_reg && is_dest_reg) {
-            return 2;
-        } else if (is_dest_reg && is_src_memory) {
-            return 8 + estimate_ea_clocks(&inst->src.mem);
-        } else if (is_dest_memory && is_src_reg) {
-            return 9 + estimate_ea_clocks(&inst->dest.mem);
-        } else if (is_dest_reg && is_src_immediate) {
-            return 4;
-        } else if (is_dest_memory && is_src_immediate) {
-            return 10 + estimate_ea_clocks(&inst->dest.mem);
+// Operand combinations that have separate rows in "Table 2-21. Instruction Set Summary"
+enum clock_form {
+    CLOCK_FORM_REG_REG,
+    CLOCK_FORM_REG_MEM, // Register destination, memory source
+    CLOCK_FORM_MEM_REG,
+    CLOCK_FORM_REG_IMM,
+    CLOCK_FORM_MEM_IMM,
+    CLOCK_FORM_ACC_IMM,
+    CLOCK_FORM_ACC_MEM, // Only with a direct address, other addressing modes use the REG_MEM/MEM_REG rows
+    CLOCK_FORM_MEM_ACC,
+    CLOCK_FORM_JUMP,
+    __CLOCK_FORM_COUNT
+};
+
+struct clock_timing {
+    u8 clocks;    // Without EA clocks. For jumps it's the cost when the jump is taken.
+    u8 not_taken; // Only for jumps
+    u8 transfers; // Memory transfers, each word transfer costs 4 more on the 8088, and on the 8086 at an odd address
+};
+
+// 0 clocks means that the combination doesn't exist, `ACC_*` forms fall back to the general ones
+static const struct clock_timing clock_table[__OP_COUNT][__CLOCK_FORM_COUNT] = {
+    [OP_MOV] = {
+        [CLOCK_FORM_REG_REG] = { 2 },
+        [CLOCK_FORM_REG_MEM] = { 8, 0, 1 },
+        [CLOCK_FORM_MEM_REG] = { 9, 0, 1 },
+        [CLOCK_FORM_REG_IMM] = { 4 },
+        [CLOCK_FORM_MEM_IMM] = { 10, 0, 1 },
+        [CLOCK_FORM_ACC_MEM] = { 10, 0, 1 },
+        [CLOCK_FORM_MEM_ACC] = { 10, 0, 1 },
+    },
+    [OP_ADD] = {
+        [CLOCK_FORM_REG_REG] = { 3 },
+        [CLOCK_FORM_REG_MEM] = { 9, 0, 1 },
+        [CLOCK_FORM_MEM_REG] = { 16, 0, 2 },
+        [CLOCK_FORM_REG_IMM] = { 4 },
+        [CLOCK_FORM_MEM_IMM] = { 17, 0, 2 },
+        [CLOCK_FORM_ACC_IMM] = { 4 },
+    },
+    [OP_SUB] = {
+        [CLOCK_FORM_REG_REG] = { 3 },
+        [CLOCK_FORM_REG_MEM] = { 9, 0, 1 },
+        [CLOCK_FORM_MEM_REG] = { 16, 0, 2 },
+        [CLOCK_FORM_REG_IMM] = { 4 },
+        [CLOCK_FORM_MEM_IMM] = { 17, 0, 2 },
+        [CLOCK_FORM_ACC_IMM] = { 4 },
+    },
+    [OP_CMP] = {
+        [CLOCK_FORM_REG_REG] = { 3 },
+        [CLOCK_FORM_REG_MEM] = { 9, 0, 1 },
+        [CLOCK_FORM_MEM_REG] = { 9, 0, 1 },
+        [CLOCK_FORM_REG_IMM] = { 4 },
+        [CLOCK_FORM_MEM_IMM] = { 10, 0, 1 },
+        [CLOCK_FORM_ACC_IMM] = { 4 },
+    },
+    [OP_JE]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JL]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JLE]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JB]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JBE]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JP]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JO]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JS]     = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNE]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNL]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNLE]   = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNB]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNBE]   = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNP]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNO]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_JNS]    = { [CLOCK_FORM_JUMP] = { 16, 4 } },
+    [OP_LOOP]   = { [CLOCK_FORM_JUMP] = { 17, 5 } },
+    [OP_LOOPZ]  = { [CLOCK_FORM_JUMP] = { 18, 6 } },
+    [OP_LOOPNZ] = { [CLOCK_FORM_JUMP] = { 19, 5 } },
+    [OP_JCXZ]   = { [CLOCK_FORM_JUMP] = { 18, 6 } },
+};
+
+static bool is_accumulator(enum reg_value reg) {
+    return reg == REG_AX || reg == REG_AL;
+}
+
+static enum clock_form get_clock_form(struct instruction *inst) {
+    if (inst->op >= OP_JE) return CLOCK_FORM_JUMP;
+
+    bool is_src_immediate = inst->src.variant == SRC_VALUE_IMMEDIATE8 || inst->src.variant == SRC_VALUE_IMMEDIATE16;
+    if (inst->dest.is_reg) {
+        if (is_src_immediate) {
+            bool acc = is_accumulator(inst->dest.reg) && clock_table[inst->op][CLOCK_FORM_ACC_IMM].clocks;
+            return acc ? CLOCK_FORM_ACC_IMM : CLOCK_FORM_REG_IMM;
+        } else if (inst->src.variant == SRC_VALUE_MEM) {
+            bool acc = is_accumulator(inst->dest.reg) && inst->src.mem.base == MEM_BASE_DIRECT_ADDRESS && clock_table[inst->op][CLOCK_FORM_ACC_MEM].clocks;
+            return acc ? CLOCK_FORM_ACC_MEM : CLOCK_FORM_REG_MEM;
+        } else {
+            return CLOCK_FORM_REG_REG;
         }
+    } else {
+        if (is_src_immediate) {
+            return CLOCK_FORM_MEM_IMM;
+        } else {
+            bool acc = is_accumulator(inst->src.reg) && inst->dest.mem.base == MEM_BASE_DIRECT_ADDRESS && clock_table[inst->op][CLOCK_FORM_MEM_ACC].clocks;
+            return acc ? CLOCK_FORM_MEM_ACC : CLOCK_FORM_MEM_REG;
+        }
+    }
+}
 
-        break;
+static struct mem_value *get_memory_operand(struct instruction *inst) {
+    if (inst->op >= OP_JE) return NULL;
+    if (!inst->dest.is_reg) return &inst->dest.mem;
+    if (inst->src.variant == SRC_VALUE_MEM) return &inst->src.mem;
+    return NULL;
+}
+
+// Every decoded instruction has an entry in the timing table
+bool has_clock_estimation(struct instruction *inst) {
+    return inst->op < __OP_COUNT && clock_table[inst->op][get_clock_form(inst)].clocks > 0;
+}
+
+// Clocks of an instruction split up like in the manual: "8 + 6ea + 4p"
+struct instruction_clocks get_instruction_clocks(enum cpu_model model, struct instruction *inst, bool jump_taken, u16 mem_address) {
+    struct instruction_clocks result = { 0 };
+    enum clock_form form = get_clock_form(inst);
+    const struct clock_timing *timing = &clock_table[inst->op][form];
+
+    if (form == CLOCK_FORM_JUMP) {
+        result.base = jump_taken ? timing->clocks : timing->not_taken;
+        return result;
     }
-    case OP_ADD: {
-        bool is_src_memory = inst->src.variant == SRC_VALUE_MEM;
-        bool is_dest_memory = !inst->dest.is_reg;
-        bool is_src_reg = inst->src.variant == SRC_VALUE_REG;
-        bool is_dest_reg = inst->dest.is_reg;
-        bool is_dest_accumulator = inst->dest.is_reg && inst->dest.reg == REG_AX;
-        bool is_src_immediate = inst->src.variant == SRC_VALUE_IMMEDIATE8 || inst->src.variant == SRC_VALUE_IMMEDIATE16;
-
-        if (is_src_reg && is_dest_reg) {
-            return 3;
-        } else if (is_dest_reg && is_src_memory) {
-            return 9 + estimate_ea_clocks(&inst->src.mem);
-        } else if (is_dest_memory && is_src_reg) {
-            return 16 + estimate_ea_clocks(&inst->dest.mem);
-        } else if (is_dest_reg && is_src_immediate) {
-            return 4;
-        } else if (is_dest_memory && is_src_immediate) {
-            return 17 + estimate_ea_clocks(&inst->dest.mem);
-        } else if (is_dest_accumulator && is_src_immediate) {
-            return 4;
-        }
 
-        break;
-    } default:
-        todo("Unhandled instruction estimation '%s'\n", operation_to_str(inst->op));
+    result.base = timing->clocks;
+    struct mem_value *mem = get_memory_operand(inst);
+    if (mem == NULL) return result;
+
+    // Accumulator forms encode the address directly, there is no EA calculation
+    if (form != CLOCK_FORM_ACC_MEM && form != CLOCK_FORM_MEM_ACC) {
+        result.ea = estimate_ea_clocks(mem);
     }
 
-    todo("Unhandled estimation variant '%s'\n", operation_to_str(inst->op));
-}
\ No newline at end of file
+    bool word_penalty = model == CPU_8088 || (mem_address & 1);
+    if (inst->wide && word_penalty) {
+        result.penalty = 4 * timing->transfers;
+    }
+    return result;
+}
+
+u32 get_total_clocks(struct instruction_clocks clocks) {
+    return clocks.base + clocks.ea + clocks.penalty;
+}
+
+// Checks if a jump or loop instruction would jump, must be called before executing it
+bool is_jump_taken(struct cpu_state *cpu, struct instruction *inst) {
+    switch (inst->op) {
+    case OP_LOOP:   return read_reg_value(cpu, REG_CX) != 1;
+    case OP_LOOPZ:  return read_reg_value(cpu, REG_CX) != 1 && get_zero_flag(cpu);
+    case OP_LOOPNZ: return read_reg_value(cpu, REG_CX) != 1 && !get_zero_flag(cpu);
+    case OP_JCXZ:   return read_reg_value(cpu, REG_CX) == 0;
+    default:        return is_jump_condition_met(cpu, inst->op);
+    }
+}
+
+// Clocks of `inst` when executed from the state in `cpu`, must be called before executing it
+struct instruction_clocks estimate_executed_clocks(enum cpu_model model, struct instruction *inst, struct cpu_state *cpu) {
+    bool jump_taken = false;
+    u16 mem_address = 0;
+    if (inst->op >= OP_JE) {
+        jump_taken = is_jump_taken(cpu, inst);
+    } else {
+        struct mem_value *mem = get_memory_operand(inst);
+        if (mem) mem_address = calculate_mem_address(cpu, mem);
+    }
+    return get_instruction_clocks(model, inst, jump_taken, mem_address);
+}
+
+// Estimate without knowing the state: on an 8086, with jumps taken and memory accesses at even addresses
+u32 estimate_instruction_clocks(struct instruction *inst) {
+    return get_total_clocks(get_instruction_clocks(CPU_8086, inst, true, 0));
+}
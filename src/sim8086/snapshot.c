@@ -0,0 +1,49 @@
+// Snapshots of `struct memory` + `struct cpu_state`, for running the same image over and over again.
+//
+// A snapshot is an immutable copy of the whole state. After taking or restoring a snapshot the live memory
+// tracks which pages got written to (`DIRTY_SNAPSHOT` in `memory.dirty_pages`), so restoring only
+// has to copy those pages back. Any number of memories can be forked from the same snapshot.
+
+struct snapshot {
+    u8 mem[MEMORY_SIZE];
+    struct cpu_state cpu;
+};
+
+static void restore_snapshot_page(struct snapshot *snapshot, struct memory *mem, u32 page) {
+    u32 start = page * MEMORY_PAGE_SIZE;
+    // Other dirty bits see this as a write, the same as `write_u8_at` would
+    if (memcmp(mem->mem + start, snapshot->mem + start, MEMORY_PAGE_SIZE) != 0) {
+        memcpy(mem->mem + start, snapshot->mem + start, MEMORY_PAGE_SIZE);
+        mem->dirty_pages[page] |= DIRTY_WEB | DIRTY_DUMP;
+    }
+    mem->dirty_pages[page] &= ~DIRTY_SNAPSHOT;
+    invalidate_decoded_range(mem, start, MEMORY_PAGE_SIZE);
+}
+
+void take_snapshot(struct snapshot *snapshot, struct memory *mem, struct cpu_state *cpu) {
+    memcpy(snapshot->mem, mem->mem, MEMORY_SIZE);
+    snapshot->cpu = *cpu;
+    clear_dirty_pages(mem, DIRTY_SNAPSHOT);
+}
+
+// `mem` must have been last snapshotted, restored or forked from this `snapshot`.
+// Returns how many pages had to be copied.
+u32 restore_snapshot(struct snapshot *snapshot, struct memory *mem, struct cpu_state *cpu) {
+    u32 restored_pages = 0;
+    for (u32 i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        if (mem->dirty_pages[i] & DIRTY_SNAPSHOT) {
+            restore_snapshot_page(snapshot, mem, i);
+            restored_pages++;
+        }
+    }
+    *cpu = snapshot->cpu;
+    return restored_pages;
+}
+
+// Overwrites all of `mem` with the snapshot, after this it can be restored cheaply with `restore_snapshot`
+void fork_snapshot(struct snapshot *snapshot, struct memory *mem, struct cpu_state *cpu) {
+    for (u32 i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        restore_snapshot_page(snapshot, mem, i);
+    }
+    *cpu = snapshot->cpu;
+}
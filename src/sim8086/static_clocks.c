@@ -0,0 +1,487 @@
+// Clock estimation without executing the program.
+//
+// All instructions reachable from address 0 are split into basic blocks. Every decoded jump is one of
+// `cond_jmp_lookup` or `cond_loop_jmp_lookup`, so each block ends with two successors: the jump target
+// and the next instruction. A jump backwards to the start of a block is treated as a loop over the
+// address range from its target up to the jump.
+//
+// Memory addresses are unknown, so 8086 odd address penalties are never counted, and jumps inside a
+// loop body other than its own back edge are assumed to fall through.
+//
+// Block clocks are remembered in `struct static_clocks_cache` by a hash of the block bytes, so analysing
+// a program again after editing it only has to estimate the blocks which changed.
+
+struct static_block {
+    u16 start;
+    u16 end; // Exclusive
+    u16 inst_count;
+    u32 clocks; // Everything except the jump at the end
+
+    bool has_jump;
+    enum operation jump_op;
+    u16 jump_ip;
+    u16 jump_target;
+    u32 taken_clocks;
+    u32 not_taken_clocks;
+};
+
+struct static_loop {
+    u16 start;       // Jump target
+    u16 end;         // End of the block with the back edge, exclusive
+    u32 back_edge;   // Index of the block with the back edge
+    int parent;      // Index of the smallest loop containing this one, or -1
+
+    u32 body_clocks; // One iteration which takes the back edge
+    u32 exit_clocks; // Difference of the back edge jump not being taken on the last iteration
+
+    bool has_trip_count;
+    u32 trip_count;
+    enum reg_value counter; // Register which determines the trip count
+    uint64_t total_clocks;  // Only if `has_trip_count`
+};
+
+// Bits for every address while discovering blocks
+#define STATIC_INST   (1 << 0)
+#define STATIC_LEADER (1 << 1)
+
+#define STATIC_CLOCKS_CACHE_SIZE 4096 // Must be a power of two
+
+struct static_clocks_cache_entry {
+    uint64_t hash; // Of the block bytes and the CPU model, 0 means empty
+    u32 clocks;
+    u16 inst_count;
+};
+
+struct static_clocks_cache {
+    struct static_clocks_cache_entry entries[STATIC_CLOCKS_CACHE_SIZE];
+};
+
+struct static_clocks {
+    struct static_block *blocks;
+    u32 block_count;
+    struct static_loop *loops;
+    u32 loop_count;
+
+    u32 cached_blocks; // Blocks whose clocks came from the cache
+
+    bool has_total; // Every loop outside of other loops has a known trip count
+    uint64_t total_clocks;
+};
+
+static uint64_t hash_static_block(struct memory *mem, u16 start, u16 end, enum cpu_model model) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (u32 addr = start; addr < end; addr++) {
+        hash = (hash ^ mem->mem[addr]) * 0x100000001b3;
+    }
+    hash = (hash ^ model) * 0x100000001b3;
+    return hash == 0 ? 1 : hash;
+}
+
+static struct static_clocks_cache_entry *find_static_cache_entry(struct static_clocks_cache *cache, uint64_t hash) {
+    u32 index = hash & (STATIC_CLOCKS_CACHE_SIZE - 1);
+    for (u32 i = 0; i < STATIC_CLOCKS_CACHE_SIZE; i++) {
+        struct static_clocks_cache_entry *entry = &cache->entries[(index + i) & (STATIC_CLOCKS_CACHE_SIZE - 1)];
+        if (entry->hash == hash || entry->hash == 0) return entry;
+    }
+    // Full, reuse the home slot
+    return &cache->entries[index];
+}
+
+static bool is_jump_op(enum operation op) {
+    return op >= OP_JE && op <= OP_JCXZ;
+}
+
+static bool do_regs_overlap(enum reg_value a, enum reg_value b) {
+    if (a == b) return true;
+    if (a >= REG_AX && b >= REG_AX) return false;
+    if (a < REG_AX && b < REG_AX) return false;
+    enum reg_value wide = a >= REG_AX ? a : b;
+    enum reg_value byte = a >= REG_AX ? b : a;
+    // Only AX, CX, DX and BX have byte halves: AL-BL are 0-3, AH-BH are 4-7
+    return wide <= REG_BX && (byte & 0b11) == wide - REG_AX;
+}
+
+static bool does_inst_write_reg(struct instruction *inst, enum reg_value reg) {
+    switch (inst->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+        return inst->dest.is_reg && do_regs_overlap(inst->dest.reg, reg);
+    case OP_LOOP:
+    case OP_LOOPZ:
+    case OP_LOOPNZ:
+        return do_regs_overlap(REG_CX, reg);
+    default:
+        return false;
+    }
+}
+
+static bool is_reg_imm(struct instruction *inst, enum operation op) {
+    return inst->op == op && inst->wide && inst->dest.is_reg && inst->dest.reg >= REG_AX &&
+        (inst->src.variant == SRC_VALUE_IMMEDIATE8 || inst->src.variant == SRC_VALUE_IMMEDIATE16);
+}
+
+// Registers written by the instructions in [start, end), as a mask of `cpu_state.regs` indices
+static u8 get_static_written_regs(struct memory *mem, u16 start, u16 end) {
+    u8 mask = 0;
+    u16 addr = start;
+    while (addr < end) {
+        struct instruction inst;
+        if (decode_instruction(mem, &addr, &inst) != DECODE_OK) return 0xFF;
+        for (int i = 0; i < 8; i++) {
+            if (does_inst_write_reg(&inst, REG_AX + i)) mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+#define STATIC_MAX_PENDING_JUMPS 16
+
+// Finds registers with a constant value when reaching `header`, by going through the program in address order.
+// Registers written in a skipped over range or inside a loop are unknown after it.
+// `known` is a mask of `cpu_state.regs` indices.
+static u8 find_static_known_regs(struct memory *mem, u16 header, u16 values[8]) {
+    u8 known = 0;
+    struct { u16 target; u8 written; } pending[STATIC_MAX_PENDING_JUMPS];
+    u32 pending_count = 0;
+
+    u16 addr = 0;
+    while (addr < header) {
+        for (u32 i = 0; i < pending_count; i++) {
+            if (pending[i].target == addr) known &= ~pending[i].written;
+        }
+
+        u16 inst_addr = addr;
+        struct instruction inst;
+        if (decode_instruction(mem, &addr, &inst) != DECODE_OK) return 0;
+
+        if (is_jump_op(inst.op)) {
+            u16 target = addr + inst.jmp_offset;
+            if (target > addr) {
+                if (pending_count == STATIC_MAX_PENDING_JUMPS) return 0;
+                pending[pending_count].target = target;
+                pending[pending_count].written = get_static_written_regs(mem, addr, target);
+                pending_count++;
+            } else {
+                known &= ~get_static_written_regs(mem, target, inst_addr);
+            }
+        }
+
+        u8 dest_index = 0;
+        bool writes_wide_reg = inst.dest.is_reg && inst.dest.reg >= REG_AX;
+        if (writes_wide_reg) dest_index = REG16_INDEX(inst.dest.reg);
+
+        if (is_reg_imm(&inst, OP_MOV)) {
+            known |= 1 << dest_index;
+            values[dest_index] = inst.src.immediate;
+        } else if (inst.op == OP_MOV && writes_wide_reg && inst.src.variant == SRC_VALUE_REG && inst.src.reg >= REG_AX) {
+            u8 src_index = REG16_INDEX(inst.src.reg);
+            if (known & (1 << src_index)) {
+                known |= 1 << dest_index;
+                values[dest_index] = values[src_index];
+            } else {
+                known &= ~(1 << dest_index);
+            }
+        } else if ((is_reg_imm(&inst, OP_ADD) || is_reg_imm(&inst, OP_SUB)) && (known & (1 << dest_index))) {
+            values[dest_index] += inst.op == OP_ADD ? inst.src.immediate : -inst.src.immediate;
+        } else {
+            for (int i = 0; i < 8; i++) {
+                if (does_inst_write_reg(&inst, REG_AX + i)) known &= ~(1 << i);
+            }
+        }
+    }
+
+    // Jumps over the header
+    for (u32 i = 0; i < pending_count; i++) {
+        if (pending[i].target > header) known &= ~pending[i].written;
+    }
+    return known;
+}
+
+// Recognizes "mov cx, N" before a LOOP, and a register set before the loop which is only changed by
+// one "add/sub reg, S" inside it and compared with "cmp reg, N" (or against 0 by the add/sub) before a JNE.
+static void find_static_trip_count(struct static_clocks *analysis, struct memory *mem, struct static_loop *loop) {
+    struct static_block *back_edge = &analysis->blocks[loop->back_edge];
+
+    u16 values[8];
+    u8 known = find_static_known_regs(mem, loop->start, values);
+    u8 written = get_static_written_regs(mem, loop->start, loop->end);
+
+    enum reg_value counter;
+    u16 limit = 0;
+    if (back_edge->jump_op == OP_LOOP) {
+        counter = REG_CX;
+    } else if (back_edge->jump_op == OP_JNE) {
+        // Instruction right before the jump sets the flags
+        struct instruction last = { 0 };
+        bool has_last = false;
+        u16 addr = back_edge->start;
+        while (addr < back_edge->jump_ip) {
+            if (decode_instruction(mem, &addr, &last) != DECODE_OK) return;
+            has_last = true;
+        }
+        if (!has_last) return;
+
+        if (is_reg_imm(&last, OP_CMP)) {
+            limit = last.src.immediate;
+        } else if (last.op == OP_CMP && last.wide && last.dest.is_reg && last.src.variant == SRC_VALUE_REG) {
+            // Compared against a register that is constant inside the loop
+            u8 limit_index = REG16_INDEX(last.src.reg);
+            if (!(known & (1 << limit_index)) || (written & (1 << limit_index))) return;
+            limit = values[limit_index];
+        } else if (!is_reg_imm(&last, OP_ADD) && !is_reg_imm(&last, OP_SUB)) {
+            return;
+        }
+        counter = last.dest.reg;
+    } else {
+        return;
+    }
+
+    if (counter < REG_AX || !(known & (1 << REG16_INDEX(counter)))) return;
+    u16 init = values[REG16_INDEX(counter)];
+
+    // Counter can only be changed by one add/sub (or the LOOP itself)
+    bool is_add = false;
+    u16 step = 0;
+    u32 writes = 0;
+    u16 addr = loop->start;
+    while (addr < loop->end) {
+        struct instruction inst;
+        if (decode_instruction(mem, &addr, &inst) != DECODE_OK) return;
+        if (!does_inst_write_reg(&inst, counter)) continue;
+        writes++;
+        if (back_edge->jump_op == OP_LOOP) {
+            if (inst.op != OP_LOOP) return;
+        } else if ((is_reg_imm(&inst, OP_ADD) || is_reg_imm(&inst, OP_SUB)) && inst.dest.reg == counter) {
+            is_add = inst.op == OP_ADD;
+            step = inst.src.immediate;
+        } else {
+            return;
+        }
+    }
+    if (writes != 1) return;
+
+    u32 trips;
+    if (back_edge->jump_op == OP_LOOP) {
+        trips = init == 0 ? 0x10000 : init;
+    } else {
+        u16 distance = is_add ? (u16)(limit - init) : (u16)(init - limit);
+        if (step == 0 || distance == 0 || distance % step != 0) return;
+        trips = distance / step;
+    }
+
+    loop->has_trip_count = true;
+    loop->trip_count = trips;
+    loop->counter = counter;
+}
+
+// Clocks of the blocks in [start, end) which are not inside any loop with `parent` as the parent.
+// Loops directly inside are added as a whole.
+static uint64_t sum_static_range(struct static_clocks *analysis, int parent, u16 start, u16 end) {
+    uint64_t clocks = 0;
+    for (u32 i = 0; i < analysis->block_count; i++) {
+        struct static_block *block = &analysis->blocks[i];
+        if (block->start < start || block->start >= end) continue;
+
+        bool inside_child = false;
+        for (u32 j = 0; j < analysis->loop_count; j++) {
+            struct static_loop *child = &analysis->loops[j];
+            if (child->parent == parent && block->start >= child->start && block->start < child->end) {
+                inside_child = true;
+                break;
+            }
+        }
+        if (inside_child) continue;
+
+        clocks += block->clocks;
+        if (block->has_jump) {
+            bool is_back_edge = parent >= 0 && analysis->loops[parent].back_edge == i;
+            clocks += is_back_edge ? block->taken_clocks : block->not_taken_clocks;
+        }
+    }
+
+    for (u32 j = 0; j < analysis->loop_count; j++) {
+        struct static_loop *child = &analysis->loops[j];
+        if (child->parent != parent || child->start < start || child->start >= end) continue;
+        if (child->has_trip_count) {
+            clocks += child->total_clocks;
+        } else {
+            clocks += child->body_clocks - child->exit_clocks; // Once, falling through at the end
+        }
+    }
+    return clocks;
+}
+
+static int compare_static_loops(const void *a, const void *b) {
+    const struct static_loop *loop_a = a;
+    const struct static_loop *loop_b = b;
+    return (int)(loop_a->end - loop_a->start) - (int)(loop_b->end - loop_b->start);
+}
+
+// `cache` is optional. Returns -1 if out of memory.
+int analyse_static_clocks(struct static_clocks *analysis, struct memory *mem, u16 program_size, enum cpu_model model, struct static_clocks_cache *cache) {
+    memset(analysis, 0, sizeof(*analysis));
+    u8 *flags = calloc(MEMORY_SIZE, 1);
+    u16 *worklist = malloc(MEMORY_SIZE * sizeof(u16));
+    if (flags == NULL || worklist == NULL) {
+        free(flags);
+        free(worklist);
+        return -1;
+    }
+
+    // Find every reachable instruction and block leader
+    u32 worklist_size = 0;
+    if (program_size > 0) {
+        worklist[worklist_size++] = 0;
+        flags[0] |= STATIC_LEADER;
+    }
+    while (worklist_size > 0) {
+        u16 addr = worklist[--worklist_size];
+        while (addr < program_size && !(flags[addr] & STATIC_INST)) {
+            flags[addr] |= STATIC_INST;
+            struct instruction inst;
+            if (decode_instruction(mem, &addr, &inst) != DECODE_OK) break;
+            if (!is_jump_op(inst.op)) continue;
+
+            u16 targets[2] = { addr, addr + inst.jmp_offset };
+            for (int i = 0; i < 2; i++) {
+                if (targets[i] >= program_size) continue;
+                if (!(flags[targets[i]] & STATIC_LEADER)) {
+                    flags[targets[i]] |= STATIC_LEADER;
+                    worklist[worklist_size++] = targets[i];
+                }
+            }
+            break;
+        }
+    }
+
+    // Split into blocks
+    u32 block_capacity = 0;
+    for (u32 addr = 0; addr < program_size; addr++) {
+        if (flags[addr] & STATIC_LEADER) block_capacity++;
+    }
+    analysis->blocks = calloc(block_capacity > 0 ? block_capacity : 1, sizeof(struct static_block));
+    if (analysis->blocks == NULL) {
+        free(flags);
+        free(worklist);
+        return -1;
+    }
+
+    for (u32 leader = 0; leader < program_size; leader++) {
+        if ((flags[leader] & (STATIC_LEADER | STATIC_INST)) != (STATIC_LEADER | STATIC_INST)) continue;
+
+        struct static_block *block = &analysis->blocks[analysis->block_count++];
+        block->start = leader;
+        u16 addr = leader;
+        while (true) {
+            u16 inst_addr = addr;
+            struct instruction inst;
+            if (decode_instruction(mem, &addr, &inst) != DECODE_OK) {
+                addr = inst_addr;
+                break;
+            }
+            if (is_jump_op(inst.op)) {
+                block->has_jump = true;
+                block->jump_op = inst.op;
+                block->jump_ip = inst_addr;
+                block->jump_target = addr + inst.jmp_offset;
+                block->taken_clocks = get_total_clocks(get_instruction_clocks(model, &inst, true, 0));
+                block->not_taken_clocks = get_total_clocks(get_instruction_clocks(model, &inst, false, 0));
+                break;
+            }
+            if (addr >= program_size || (flags[addr] & STATIC_LEADER) || !(flags[addr] & STATIC_INST)) break;
+        }
+        block->end = addr;
+
+        // Clocks of everything before the jump
+        u16 body_end = block->has_jump ? block->jump_ip : block->end;
+        struct static_clocks_cache_entry *entry = NULL;
+        uint64_t hash = 0;
+        if (cache) {
+            hash = hash_static_block(mem, block->start, body_end, model);
+            entry = find_static_cache_entry(cache, hash);
+            if (entry->hash == hash) {
+                block->clocks = entry->clocks;
+                block->inst_count = entry->inst_count + block->has_jump;
+                analysis->cached_blocks++;
+                continue;
+            }
+        }
+
+        u16 body_addr = block->start;
+        while (body_addr < body_end) {
+            struct instruction inst;
+            if (decode_instruction(mem, &body_addr, &inst) != DECODE_OK) break;
+            block->clocks += get_total_clocks(get_instruction_clocks(model, &inst, false, 0));
+            block->inst_count++;
+        }
+        if (entry) {
+            entry->hash = hash;
+            entry->clocks = block->clocks;
+            entry->inst_count = block->inst_count;
+        }
+        block->inst_count += block->has_jump;
+    }
+    free(flags);
+    free(worklist);
+
+    // Back edges make loops
+    analysis->loops = calloc(analysis->block_count > 0 ? analysis->block_count : 1, sizeof(struct static_loop));
+    if (analysis->loops == NULL) {
+        free(analysis->blocks);
+        analysis->blocks = NULL;
+        return -1;
+    }
+    for (u32 i = 0; i < analysis->block_count; i++) {
+        struct static_block *block = &analysis->blocks[i];
+        if (!block->has_jump || block->jump_target > block->jump_ip) continue;
+
+        struct static_loop *loop = &analysis->loops[analysis->loop_count++];
+        loop->start = block->jump_target;
+        loop->end = block->end;
+        loop->back_edge = i;
+    }
+
+    // Innermost loops first, so they are done before the loops containing them
+    qsort(analysis->loops, analysis->loop_count, sizeof(struct static_loop), compare_static_loops);
+    for (u32 i = 0; i < analysis->loop_count; i++) {
+        struct static_loop *loop = &analysis->loops[i];
+        loop->parent = -1;
+        for (u32 j = i + 1; j < analysis->loop_count; j++) {
+            struct static_loop *outer = &analysis->loops[j];
+            if (outer->start <= loop->start && loop->end <= outer->end) {
+                loop->parent = j;
+                break;
+            }
+        }
+    }
+
+    for (u32 i = 0; i < analysis->loop_count; i++) {
+        struct static_loop *loop = &analysis->loops[i];
+        struct static_block *back_edge = &analysis->blocks[loop->back_edge];
+        loop->body_clocks = sum_static_range(analysis, i, loop->start, loop->end);
+        loop->exit_clocks = back_edge->taken_clocks - back_edge->not_taken_clocks;
+
+        find_static_trip_count(analysis, mem, loop);
+        if (loop->has_trip_count) {
+            loop->total_clocks = (uint64_t)loop->trip_count * loop->body_clocks - loop->exit_clocks;
+        }
+    }
+
+    analysis->has_total = true;
+    for (u32 i = 0; i < analysis->loop_count; i++) {
+        if (analysis->loops[i].parent == -1 && !analysis->loops[i].has_trip_count) {
+            analysis->has_total = false;
+        }
+    }
+    analysis->total_clocks = sum_static_range(analysis, -1, 0, program_size);
+
+    return 0;
+}
+
+void free_static_clocks(struct static_clocks *analysis) {
+    free(analysis->blocks);
+    free(analysis->loops);
+    analysis->blocks = NULL;
+    analysis->loops = NULL;
+}
@@ -0,0 +1,428 @@
+// Threaded interpreter. Instead of decoding and going through `execute_instruction` on every step,
+// each decode cache entry gets linked to a handler once, and every handler jumps straight into
+// the handler of the next instruction.
+//
+// With GCC/Clang handlers are labels and `decode_cache_entry.handler` holds their address ("labels as values").
+// Other compilers fall back to a switch over `decode_cache_entry.kind`.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_COMPUTED_GOTO
+#endif
+
+// Every (operation, destination, source, width) combination gets its own handler, so that
+// the kind of operands is resolved once when linking and not on every execution.
+// Memory to memory forms don't exist on the 8086.
+#define THREADED_OPERAND_FORMS(X, op) \
+    X(op, REG, REG, 8)  X(op, REG, REG, 16) \
+    X(op, REG, MEM, 8)  X(op, REG, MEM, 16) \
+    X(op, REG, IMM, 8)  X(op, REG, IMM, 16) \
+    X(op, MEM, REG, 8)  X(op, MEM, REG, 16) \
+    X(op, MEM, IMM, 8)  X(op, MEM, IMM, 16)
+
+#define THREADED_FORMS(X)                 \
+    THREADED_OPERAND_FORMS(X, MOV)        \
+    THREADED_OPERAND_FORMS(X, ADD)        \
+    THREADED_OPERAND_FORMS(X, SUB)        \
+    THREADED_OPERAND_FORMS(X, CMP)
+
+// A flag setting instruction directly followed by a conditional jump is linked as one "fused" entry.
+// The jump is then taken based on the operands, and flags are only stored if an instruction after the jump can observe them.
+// Destination is always a register.
+#define THREADED_FUSED_OPERAND_FORMS(X, op) \
+    X(op, REG, 8) X(op, REG, 16)            \
+    X(op, IMM, 8) X(op, IMM, 16)
+
+#define THREADED_FUSED_FORMS(X)            \
+    THREADED_FUSED_OPERAND_FORMS(X, ADD)   \
+    THREADED_FUSED_OPERAND_FORMS(X, SUB)   \
+    THREADED_FUSED_OPERAND_FORMS(X, CMP)
+
+// How many instructions after a fused jump are looked at to prove that flags are overwritten before being read
+#define THREADED_LIVENESS_DEPTH 4
+
+#define THREADED_FORM_KIND(op, dest, src, width) THREADED_##op##_##dest##_##src##_##width,
+#define THREADED_FUSED_FORM_KIND(op, src, width) THREADED_FUSED_##op##_##src##_##width,
+
+enum threaded_kind {
+    THREADED_UNLINKED, // Must be 0, invalidated cache entries are reset to it
+    THREADED_GENERIC,
+    THREADED_JCC,
+    THREADED_LOOP,
+    THREADED_JCXZ,
+    THREADED_FORMS(THREADED_FORM_KIND)
+    THREADED_FUSED_FORMS(THREADED_FUSED_FORM_KIND)
+    __THREADED_COUNT
+};
+
+struct threaded_stats {
+    // How many times each fused pair was executed, indexed by the operation of the first instruction and of the jump
+    uint64_t fused_pairs[__OP_COUNT][__OP_COUNT];
+};
+
+enum threaded_operand {
+    THREADED_OPERAND_REG,
+    THREADED_OPERAND_MEM,
+    THREADED_OPERAND_IMM,
+};
+
+static enum threaded_kind get_threaded_kind(struct packed_instruction *inst) {
+    switch (inst->op) {
+    case OP_LOOP:
+    case OP_LOOPZ:
+    case OP_LOOPNZ:
+        return THREADED_LOOP;
+    case OP_JCXZ:
+        return THREADED_JCXZ;
+    case OP_JE:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JB:
+    case OP_JBE:
+    case OP_JP:
+    case OP_JO:
+    case OP_JS:
+    case OP_JNE:
+    case OP_JNL:
+    case OP_JNLE:
+    case OP_JNB:
+    case OP_JNBE:
+    case OP_JNP:
+    case OP_JNO:
+    case OP_JNS:
+        return THREADED_JCC;
+    default:
+        break;
+    }
+
+    enum threaded_operand dest = (inst->flags & PACKED_DEST_MEM) ? THREADED_OPERAND_MEM : THREADED_OPERAND_REG;
+    enum threaded_operand src;
+    switch ((inst->flags >> PACKED_SRC_SHIFT) & 0b11) {
+    case SRC_VALUE_REG: src = THREADED_OPERAND_REG; break;
+    case SRC_VALUE_MEM: src = THREADED_OPERAND_MEM; break;
+    default:            src = THREADED_OPERAND_IMM; break;
+    }
+    u8 width = (inst->flags & PACKED_WIDE) ? 16 : 8;
+
+    #define X(op_name, dest_kind, src_kind, form_width)             \
+        if (inst->op == OP_##op_name &&                             \
+            dest == THREADED_OPERAND_##dest_kind &&                 \
+            src == THREADED_OPERAND_##src_kind &&                   \
+            width == form_width) {                                  \
+            return THREADED_##op_name##_##dest_kind##_##src_kind##_##form_width; \
+        }
+    THREADED_FORMS(X)
+    #undef X
+
+    return THREADED_GENERIC;
+}
+
+// Only conditions which can be answered by comparing the operands directly are fused.
+// After ADD that is only the zero and sign flags.
+static bool is_fusable_jump(u8 first_op, u8 jump_op) {
+    switch (jump_op) {
+    case OP_JE:
+    case OP_JNE:
+    case OP_JS:
+    case OP_JNS:
+        return true;
+    case OP_JB:
+    case OP_JNB:
+    case OP_JBE:
+    case OP_JNBE:
+    case OP_JL:
+    case OP_JNL:
+    case OP_JLE:
+    case OP_JNLE:
+        return first_op == OP_SUB || first_op == OP_CMP;
+    default:
+        return false;
+    }
+}
+
+// Same as `is_jump_condition_met` for the jumps accepted by `is_fusable_jump`, but without going through `cpu_state.lazy_flags`
+static inline bool is_fused_jump_taken(u8 jump_op, u16 dest, u16 src, u16 result, bool wide) {
+    u16 mask = wide ? 0xFFFF : 0xFF;
+    u16 sign_bit = wide ? 0x8000 : 0x80;
+    dest &= mask;
+    src &= mask;
+    result &= mask;
+
+    // Flipping the sign bit turns a signed comparison into an unsigned one
+    u16 signed_dest = dest ^ sign_bit;
+    u16 signed_src = src ^ sign_bit;
+
+    switch (jump_op) {
+    case OP_JE:   return result == 0;
+    case OP_JNE:  return result != 0;
+    case OP_JS:   return result & sign_bit;
+    case OP_JNS:  return !(result & sign_bit);
+    case OP_JB:   return dest < src;
+    case OP_JNB:  return dest >= src;
+    case OP_JBE:  return dest <= src;
+    case OP_JNBE: return dest > src;
+    case OP_JL:   return signed_dest < signed_src;
+    case OP_JNL:  return signed_dest >= signed_src;
+    case OP_JLE:  return signed_dest <= signed_src;
+    case OP_JNLE: return signed_dest > signed_src;
+    default: panic("Operation '%s' can't be fused\n", operation_to_str(jump_op));
+    }
+}
+
+// Checks if all flags get overwritten at `ip` before anything can read them.
+// Anything other than a register MOV or a flag setter is assumed to read them, as are the final flags at `end_ip`.
+// A MOV into memory could patch one of the following instructions into something reading the flags.
+// Instructions are decoded through the cache even if they never run, so that writing over them later
+// bumps `cache->invalidations` and the fused entry relying on them gets relinked.
+static bool are_flags_dead_at(struct decode_cache *cache, struct memory *mem, u16 ip, u16 end_ip) {
+    for (int i = 0; i < THREADED_LIVENESS_DEPTH; i++) {
+        if (ip >= end_ip) return false;
+
+        struct instruction inst;
+        if (decode_instruction_cached(cache, mem, &ip, &inst) != DECODE_OK) return false;
+
+        switch (inst.op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_CMP:
+            return true;
+        case OP_MOV:
+            if (!inst.dest.is_reg) return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// Returns the fused kind for the instruction at `ip`, or `THREADED_UNLINKED` if it can't be fused with the next one
+static enum threaded_kind get_fused_kind(struct decode_cache *cache, struct memory *mem, u16 ip, u16 end_ip) {
+    struct decode_cache_entry *entry = &cache->entries[ip];
+    struct packed_instruction *inst = &entry->inst;
+    if (inst->op != OP_ADD && inst->op != OP_SUB && inst->op != OP_CMP) return THREADED_UNLINKED;
+    if (inst->flags & PACKED_DEST_MEM) return THREADED_UNLINKED;
+
+    u8 src_variant = (inst->flags >> PACKED_SRC_SHIFT) & 0b11;
+    if (src_variant == SRC_VALUE_MEM) return THREADED_UNLINKED;
+
+    u16 jump_ip = ip + entry->size;
+    if (jump_ip >= end_ip) return THREADED_UNLINKED;
+
+    u16 next_ip = jump_ip;
+    struct instruction jump;
+    if (decode_instruction_cached(cache, mem, &next_ip, &jump) != DECODE_OK) return THREADED_UNLINKED;
+    if (!is_fusable_jump(inst->op, jump.op)) return THREADED_UNLINKED;
+
+    entry->fused_flags_live = !are_flags_dead_at(cache, mem, next_ip, end_ip) ||
+                              !are_flags_dead_at(cache, mem, next_ip + jump.jmp_offset, end_ip);
+    entry->fused_epoch = (u32)cache->invalidations;
+
+    bool is_src_reg = src_variant == SRC_VALUE_REG;
+    bool wide = inst->flags & PACKED_WIDE;
+    #define X(op_name, src_kind, form_width)                            \
+        if (inst->op == OP_##op_name &&                                 \
+            is_src_reg == (THREADED_OPERAND_##src_kind == THREADED_OPERAND_REG) && \
+            wide == (form_width == 16)) {                               \
+            return THREADED_FUSED_##op_name##_##src_kind##_##form_width; \
+        }
+    THREADED_FUSED_FORMS(X)
+    #undef X
+
+    return THREADED_UNLINKED;
+}
+
+// Operand access for the generated handlers, `field` is either `dest` or `src` of `struct packed_instruction`
+#define THREADED_MEM_READ_8  read_u8_at
+#define THREADED_MEM_READ_16 read_u16_at
+#define THREADED_MEM_WRITE_8  write_u8_at
+#define THREADED_MEM_WRITE_16 write_u16_at
+
+#define THREADED_REG_8(field)  cpu->regs8[REG8_INDEX(inst->field)]
+#define THREADED_REG_16(field) cpu->regs[REG16_INDEX(inst->field)]
+
+#define THREADED_READ_REG(field, width) THREADED_REG_##width(field)
+#define THREADED_READ_MEM(field, width) \
+    THREADED_MEM_READ_##width(mem, calculate_packed_mem_address(cpu, inst->field, inst->disp))
+#define THREADED_READ_IMM(field, width) inst->immediate
+
+#define THREADED_WRITE_REG(field, width, value) THREADED_REG_##width(field) = (value)
+#define THREADED_WRITE_MEM(field, width, value) \
+    THREADED_MEM_WRITE_##width(mem, calculate_packed_mem_address(cpu, inst->field, inst->disp), value)
+
+#define THREADED_EXEC_MOV(dest_kind, src_kind, width) \
+    THREADED_WRITE_##dest_kind(dest, width, THREADED_READ_##src_kind(src, width));
+
+#define THREADED_EXEC_ALU(operator, flags_op, store, dest_kind, src_kind, width) { \
+        u16 dest_value = THREADED_READ_##dest_kind(dest, width);                   \
+        u16 src_value = THREADED_READ_##src_kind(src, width);                      \
+        u16 result = dest_value operator src_value;                                \
+        set_lazy_flags(cpu, flags_op, dest_value, src_value, result, width == 16); \
+        if (store) THREADED_WRITE_##dest_kind(dest, width, result);                \
+    }
+#define THREADED_EXEC_ADD(dest_kind, src_kind, width) THREADED_EXEC_ALU(+, LAZY_FLAGS_ADD, true,  dest_kind, src_kind, width)
+#define THREADED_EXEC_SUB(dest_kind, src_kind, width) THREADED_EXEC_ALU(-, LAZY_FLAGS_SUB, true,  dest_kind, src_kind, width)
+#define THREADED_EXEC_CMP(dest_kind, src_kind, width) THREADED_EXEC_ALU(-, LAZY_FLAGS_SUB, false, dest_kind, src_kind, width)
+
+#define THREADED_FUSED_ADD(src_kind, width) THREADED_EXEC_FUSED(+, LAZY_FLAGS_ADD, true,  OP_ADD, src_kind, width)
+#define THREADED_FUSED_SUB(src_kind, width) THREADED_EXEC_FUSED(-, LAZY_FLAGS_SUB, true,  OP_SUB, src_kind, width)
+#define THREADED_FUSED_CMP(src_kind, width) THREADED_EXEC_FUSED(-, LAZY_FLAGS_SUB, false, OP_CMP, src_kind, width)
+
+// The jump entry is still valid, otherwise `fused_epoch` wouldn't match
+#define THREADED_EXEC_FUSED(operator, flags_op, store, first_op, src_kind, width) {              \
+        u16 dest_value = THREADED_READ_REG(dest, width);                                        \
+        u16 src_value = THREADED_READ_##src_kind(src, width);                                   \
+        u16 result = dest_value operator src_value;                                             \
+        if (entry->fused_flags_live) {                                                          \
+            set_lazy_flags(cpu, flags_op, dest_value, src_value, result, width == 16);          \
+        }                                                                                       \
+        if (store) THREADED_WRITE_REG(dest, width, result);                                     \
+        struct decode_cache_entry *jump = &cache->entries[cpu->ip];                             \
+        cpu->ip += jump->size;                                                                  \
+        stats->fused_pairs[first_op][jump->inst.op]++;                                          \
+        if (is_fused_jump_taken(jump->inst.op, dest_value, src_value, result, width == 16)) {   \
+            cpu->ip += (i8)jump->inst.immediate;                                                \
+        }                                                                                       \
+    }
+
+// Runs until `cpu->ip` reaches `end_ip` or an instruction fails to decode.
+// `mem->decode_cache` must be set, it is used as the storage of linked instructions.
+// Because of instruction fusion, a cache should only be used with one `end_ip`.
+enum decode_error run_threaded(struct memory *mem, struct cpu_state *cpu, u16 end_ip, struct threaded_stats *stats) {
+    struct decode_cache *cache = mem->decode_cache;
+    assert(cache != NULL);
+
+#ifdef THREADED_COMPUTED_GOTO
+    #define X(op, dest_kind, src_kind, width) \
+        [THREADED_##op##_##dest_kind##_##src_kind##_##width] = &&handler_THREADED_##op##_##dest_kind##_##src_kind##_##width,
+    #define FUSED_X(op, src_kind, width) \
+        [THREADED_FUSED_##op##_##src_kind##_##width] = &&handler_THREADED_FUSED_##op##_##src_kind##_##width,
+    static const void *handlers[__THREADED_COUNT] = {
+        [THREADED_UNLINKED] = &&handler_THREADED_UNLINKED,
+        [THREADED_GENERIC]  = &&handler_THREADED_GENERIC,
+        [THREADED_JCC]      = &&handler_THREADED_JCC,
+        [THREADED_LOOP]     = &&handler_THREADED_LOOP,
+        [THREADED_JCXZ]     = &&handler_THREADED_JCXZ,
+        THREADED_FORMS(X)
+        THREADED_FUSED_FORMS(FUSED_X)
+    };
+    #undef X
+    #undef FUSED_X
+
+    // First time this cache is used by the threaded engine, point all entries at their handlers
+    if (cache->unlinked_handler != handlers[THREADED_UNLINKED]) {
+        cache->unlinked_handler = handlers[THREADED_UNLINKED];
+        for (u32 i = 0; i < MEMORY_SIZE; i++) {
+            cache->entries[i].handler = handlers[cache->entries[i].kind];
+        }
+    }
+
+    #define HANDLER(kind) handler_##kind
+    #define DISPATCH() goto *entry->handler
+#else
+    #define HANDLER(kind) case kind
+    #define DISPATCH() goto dispatch
+#endif
+
+    #define NEXT()                                 \
+        if (cpu->ip >= end_ip) return DECODE_OK;  \
+        entry = &cache->entries[cpu->ip];         \
+        inst = &entry->inst;                      \
+        DISPATCH()
+
+    struct decode_cache_entry *entry;
+    struct packed_instruction *inst;
+    NEXT();
+
+#ifndef THREADED_COMPUTED_GOTO
+dispatch:
+    switch (entry->kind) {
+#endif
+
+    HANDLER(THREADED_UNLINKED): {
+relink:
+        if (!entry->valid) {
+            u16 addr = cpu->ip;
+            struct instruction decoded;
+            enum decode_error err = decode_instruction_cached(cache, mem, &addr, &decoded);
+            if (err != DECODE_OK) return err;
+        }
+
+        entry->kind = get_fused_kind(cache, mem, cpu->ip, end_ip);
+        if (entry->kind == THREADED_UNLINKED) {
+            entry->kind = get_threaded_kind(inst);
+        }
+#ifdef THREADED_COMPUTED_GOTO
+        entry->handler = handlers[entry->kind];
+#endif
+        DISPATCH();
+    }
+
+    HANDLER(THREADED_GENERIC): {
+        struct instruction unpacked;
+        unpack_instruction(&unpacked, inst);
+        cpu->ip += entry->size;
+        execute_instruction(mem, cpu, &unpacked);
+        NEXT();
+    }
+
+    HANDLER(THREADED_JCC): {
+        cpu->ip += entry->size;
+        if (is_jump_condition_met(cpu, inst->op)) {
+            cpu->ip += (i8)inst->immediate;
+        }
+        NEXT();
+    }
+
+    HANDLER(THREADED_LOOP): {
+        cpu->ip += entry->size;
+        u16 cx = --cpu->regs[REG16_INDEX(REG_CX)];
+        bool jump = cx != 0;
+        if (inst->op == OP_LOOPZ) {
+            jump = jump && get_zero_flag(cpu);
+        } else if (inst->op == OP_LOOPNZ) {
+            jump = jump && !get_zero_flag(cpu);
+        }
+        if (jump) {
+            cpu->ip += (i8)inst->immediate;
+        }
+        NEXT();
+    }
+
+    HANDLER(THREADED_JCXZ): {
+        cpu->ip += entry->size;
+        if (cpu->regs[REG16_INDEX(REG_CX)] == 0) {
+            cpu->ip += (i8)inst->immediate;
+        }
+        NEXT();
+    }
+
+    #define X(op, dest_kind, src_kind, width)                               \
+        HANDLER(THREADED_##op##_##dest_kind##_##src_kind##_##width): {      \
+            cpu->ip += entry->size;                                         \
+            THREADED_EXEC_##op(dest_kind, src_kind, width)                  \
+            NEXT();                                                         \
+        }
+    THREADED_FORMS(X)
+    #undef X
+
+    // Code could have been written to since linking, the jump or the instructions after it might be different now
+    #define X(op, src_kind, width)                                          \
+        HANDLER(THREADED_FUSED_##op##_##src_kind##_##width): {              \
+            if (entry->fused_epoch != (u32)cache->invalidations) goto relink; \
+            cpu->ip += entry->size;                                         \
+            THREADED_FUSED_##op(src_kind, width)                            \
+            NEXT();                                                         \
+        }
+    THREADED_FUSED_FORMS(X)
+    #undef X
+
+#ifndef THREADED_COMPUTED_GOTO
+    default:
+        panic("Unhandled threaded instruction kind %d\n", entry->kind);
+    }
+#endif
+
+    #undef NEXT
+    #undef DISPATCH
+    #undef HANDLER
+}
@@ -0,0 +1,131 @@
+// Compact binary execution trace.
+//
+// File starts with "S86T" followed by a u32 version. After that there is one variable sized record
+// per executed instruction, all numbers are little endian:
+//     u16 ip                    address of the instruction
+//     u8  inst[8]               `struct packed_instruction`
+//     u16 changed               bits 0-7 for `cpu_state.regs`, bit 8 for the flags register
+//     u16 new registers...      only the changed ones
+//     u16 new flags             only if they changed
+//     u8  write count
+//     (u16 address, u8 new value)...
+// Writes are taken from `struct write_log`, so the same restrictions apply as for "journal.c".
+
+#define TRACE_MAGIC "S86T"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 8
+#define TRACE_CHANGED_FLAGS (1 << 8)
+#define TRACE_MAX_RECORD_SIZE (2 + 8 + 2 + 8*2 + 2 + 1 + WRITE_LOG_SIZE*3)
+
+struct trace_record {
+    u16 ip;
+    struct packed_instruction inst;
+    u16 changed;
+    u16 regs[8]; // Only the ones in `changed` are filled in
+    u16 flags;
+    u8 write_count;
+    u16 write_address[WRITE_LOG_SIZE];
+    u8 write_value[WRITE_LOG_SIZE];
+};
+
+static u8 *trace_put_u16(u8 *buff, u16 value) {
+    buff[0] = value & 0xFF;
+    buff[1] = value >> 8;
+    return buff + 2;
+}
+
+static u16 trace_get_u16(const u8 *buff) {
+    return buff[0] | (buff[1] << 8);
+}
+
+void write_trace_header(u8 *buff) {
+    memcpy(buff, TRACE_MAGIC, 4);
+    buff[4] = TRACE_VERSION;
+    buff[5] = 0;
+    buff[6] = 0;
+    buff[7] = 0;
+}
+
+bool is_trace_header_valid(const u8 *buff, u32 size) {
+    return size >= TRACE_HEADER_SIZE && memcmp(buff, TRACE_MAGIC, 4) == 0 && buff[4] == TRACE_VERSION;
+}
+
+// `before` is the state before executing `inst` which was decoded at `before->ip`, `log` has the writes it made.
+// `buff` must have room for `TRACE_MAX_RECORD_SIZE` bytes. Returns the size of the record.
+u32 encode_trace_record(u8 *buff, struct cpu_state *before, struct cpu_state *after, struct instruction *inst, struct memory *mem, struct write_log *log) {
+    u8 *cursor = buff;
+    cursor = trace_put_u16(cursor, before->ip);
+
+    struct packed_instruction packed;
+    pack_instruction(&packed, inst);
+    *cursor++ = packed.op;
+    *cursor++ = packed.flags;
+    *cursor++ = packed.dest;
+    *cursor++ = packed.src;
+    cursor = trace_put_u16(cursor, packed.disp);
+    cursor = trace_put_u16(cursor, packed.immediate);
+
+    u16 changed = 0;
+    for (int i = 0; i < 8; i++) {
+        if (before->regs[i] != after->regs[i]) changed |= 1 << i;
+    }
+    u16 flags = 0;
+    if (memcmp(&before->lazy_flags, &after->lazy_flags, sizeof(before->lazy_flags)) != 0) {
+        flags = get_cpu_flags(after);
+        if (flags != get_cpu_flags(before)) changed |= TRACE_CHANGED_FLAGS;
+    }
+
+    cursor = trace_put_u16(cursor, changed);
+    for (int i = 0; i < 8; i++) {
+        if (changed & (1 << i)) cursor = trace_put_u16(cursor, after->regs[i]);
+    }
+    if (changed & TRACE_CHANGED_FLAGS) cursor = trace_put_u16(cursor, flags);
+
+    *cursor++ = log->count;
+    for (int i = 0; i < log->count; i++) {
+        cursor = trace_put_u16(cursor, log->address[i]);
+        *cursor++ = read_u8_at(mem, log->address[i]);
+    }
+
+    return cursor - buff;
+}
+
+// Returns the size of the record, or 0 if `buff` ends in the middle of it
+u32 decode_trace_record(const u8 *buff, u32 size, struct trace_record *record) {
+    const u8 *cursor = buff;
+    const u8 *end = buff + size;
+
+    if (end - cursor < 12) return 0;
+    record->ip = trace_get_u16(cursor);
+    record->inst.op = cursor[2];
+    record->inst.flags = cursor[3];
+    record->inst.dest = cursor[4];
+    record->inst.src = cursor[5];
+    record->inst.disp = trace_get_u16(cursor + 6);
+    record->inst.immediate = trace_get_u16(cursor + 8);
+    record->changed = trace_get_u16(cursor + 10);
+    cursor += 12;
+
+    for (int i = 0; i < 8; i++) {
+        if (!(record->changed & (1 << i))) continue;
+        if (end - cursor < 2) return 0;
+        record->regs[i] = trace_get_u16(cursor);
+        cursor += 2;
+    }
+    if (record->changed & TRACE_CHANGED_FLAGS) {
+        if (end - cursor < 2) return 0;
+        record->flags = trace_get_u16(cursor);
+        cursor += 2;
+    }
+
+    if (end - cursor < 1) return 0;
+    record->write_count = *cursor++;
+    if (record->write_count > WRITE_LOG_SIZE || end - cursor < record->write_count * 3) return 0;
+    for (int i = 0; i < record->write_count; i++) {
+        record->write_address[i] = trace_get_u16(cursor);
+        record->write_value[i] = cursor[2];
+        cursor += 3;
+    }
+
+    return cursor - buff;
+}
@@ -58,6 +58,26 @@ static void src_to_str(char *buff, size_t max_size, struct src_value *value) {
     }
 }
 
+// Writes the set flags in the same order as the reference simulator, e.g. "CPAS"
+static void flags_to_str(char *buff, size_t max_size, u16 flags) {
+    const struct { u16 flag; char name; } flag_names[] = {
+        { FLAG_CARRY,     'C' },
+        { FLAG_PARITY,    'P' },
+        { FLAG_AUX_CARRY, 'A' },
+        { FLAG_ZERO,      'Z' },
+        { FLAG_SIGN,      'S' },
+        { FLAG_OVERFLOW,  'O' },
+    };
+
+    size_t len = 0;
+    for (size_t i = 0; i < ARRAY_LEN(flag_names) && len+1 < max_size; i++) {
+        if (flags & flag_names[i].flag) {
+            buff[len++] = flag_names[i].name;
+        }
+    }
+    buff[len] = '\0';
+}
+
 static const char *operation_to_str(enum operation op) {
     const char *operation_str[__OP_COUNT] = {
         "mov", "add", "sub", "cmp", "je", "jl", "jle", "jb", "jbe", "jp", "jo",
@@ -124,3 +144,75 @@ static void instruction_to_str(char *buff, size_t max_size, struct instruction *
         panic("Invalid instruction opcode %d\n", inst->op);
     }
 }
+
+void pack_instruction(struct packed_instruction *packed, struct instruction *inst) {
+    memset(packed, 0, sizeof(*packed));
+    packed->op = inst->op;
+    packed->flags = inst->wide ? PACKED_WIDE : 0;
+
+    switch (inst->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CMP:
+        break;
+    default:
+        packed->immediate = inst->jmp_offset;
+        return;
+    }
+
+    packed->flags |= inst->src.variant << PACKED_SRC_SHIFT;
+
+    if (inst->dest.is_reg) {
+        packed->dest = inst->dest.reg;
+    } else {
+        packed->flags |= PACKED_DEST_MEM;
+        packed->dest = inst->dest.mem.base;
+        packed->disp = inst->dest.mem.disp;
+    }
+
+    switch (inst->src.variant) {
+    case SRC_VALUE_REG:
+        packed->src = inst->src.reg;
+        break;
+    case SRC_VALUE_MEM:
+        packed->src = inst->src.mem.base;
+        packed->disp = inst->src.mem.disp;
+        break;
+    case SRC_VALUE_IMMEDIATE8:
+    case SRC_VALUE_IMMEDIATE16:
+        packed->immediate = inst->src.immediate;
+        break;
+    }
+}
+
+void unpack_instruction(struct instruction *inst, const struct packed_instruction *packed) {
+    memset(inst, 0, sizeof(*inst));
+    inst->op = packed->op;
+    inst->wide = packed->flags & PACKED_WIDE;
+    inst->jmp_offset = packed->immediate;
+
+    if (packed->flags & PACKED_DEST_MEM) {
+        inst->dest.is_reg = false;
+        inst->dest.mem.base = packed->dest;
+        inst->dest.mem.disp = packed->disp;
+    } else {
+        inst->dest.is_reg = true;
+        inst->dest.reg = packed->dest;
+    }
+
+    inst->src.variant = (packed->flags >> PACKED_SRC_SHIFT) & 0b11;
+    switch (inst->src.variant) {
+    case SRC_VALUE_REG:
+        inst->src.reg = packed->src;
+        break;
+    case SRC_VALUE_MEM:
+        inst->src.mem.base = packed->src;
+        inst->src.mem.disp = packed->disp;
+        break;
+    case SRC_VALUE_IMMEDIATE8:
+    case SRC_VALUE_IMMEDIATE16:
+        inst->src.immediate = packed->immediate;
+        break;
+    }
+}
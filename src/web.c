@@ -7,19 +7,268 @@
 #define EXPORT EMSCRIPTEN_KEEPALIVE
 #define dbg(...) emscripten_log(EM_LOG_CONSOLE, __VA_ARGS__)
 
-EXPORT struct memory memory_state;
+static struct decode_cache decode_cache_state;
+
+EXPORT struct memory memory_state = { .decode_cache = &decode_cache_state };
 EXPORT struct cpu_state cpu_state;
 
+// Copy of the CPU state which is refreshed after every `step` and `run`, so that JS can read
+// everything through one typed array view. See `get_packed_cpu_state_base`.
+struct packed_cpu_state {
+    u16 regs[8]; // Same order as `cpu_state.regs`
+    u16 ip;
+    u16 flags;
+    u32 steps;   // Instructions executed by the last `run`
+    u32 cycles;  // Estimated clocks of the last `run`, only counted when it was given a cycle budget
+};
+
+enum run_stop_reason {
+    RUN_STOP_HALT,         // `ip` reached the end of the program
+    RUN_STOP_STEP_BUDGET,
+    RUN_STOP_CYCLE_BUDGET,
+    RUN_STOP_BREAKPOINT,
+    RUN_STOP_DECODE_ERROR,
+};
+
+static struct packed_cpu_state packed_cpu_state;
+static u32 program_end = MEMORY_SIZE;
+static u8 breakpoints[MEMORY_SIZE / 8];
+static enum cpu_model cpu_model = CPU_8086; // Used for the cycle budget of `run`
+
+// While enabled, `step` and `run` record into it so that they can be undone. See `enable_journal`.
+static struct journal journal;
+static bool journal_enabled = false;
+
+static void update_packed_cpu_state() {
+    memcpy(packed_cpu_state.regs, cpu_state.regs, sizeof(packed_cpu_state.regs));
+    packed_cpu_state.ip = cpu_state.ip;
+    packed_cpu_state.flags = get_cpu_flags(&cpu_state);
+}
+
+static bool is_breakpoint_at(u16 addr) {
+    return breakpoints[addr / 8] & (1 << (addr % 8));
+}
+
+// Decodes and executes one instruction, through the journal if it's enabled
+static enum decode_error step_instruction(struct instruction *inst) {
+	if (journal_enabled) {
+		return journal_step(&journal, &memory_state, &cpu_state, inst);
+	}
+
+	enum decode_error err = decode_instruction_cached(&decode_cache_state, &memory_state, &cpu_state.ip, inst);
+	if (err == DECODE_OK) {
+		execute_instruction(&memory_state, &cpu_state, inst);
+	}
+	return err;
+}
+
 EXPORT void step() {
     struct instruction inst;
-	enum decode_error err = decode_instruction(&memory_state, &cpu_state.ip, &inst);
-	if (err == DECODE_OK) {
-		execute_instruction(&memory_state, &cpu_state, &inst);
+	step_instruction(&inst);
+	update_packed_cpu_state();
+}
+
+// Runs without returning to JS until one of the budgets runs out, a breakpoint is hit or the program ends.
+// A budget of 0 means no limit. The breakpoint at the starting `ip` is ignored, so that a stopped run can be resumed.
+// Cycles are estimated with `estimate_executed_clocks` for the model set by `set_cpu_model`.
+EXPORT enum run_stop_reason run(u32 max_steps, u32 max_cycles) {
+	enum run_stop_reason reason = RUN_STOP_HALT;
+	u32 steps = 0;
+	u32 cycles = 0;
+	while (cpu_state.ip < program_end) {
+		if (max_steps && steps >= max_steps) {
+			reason = RUN_STOP_STEP_BUDGET;
+			break;
+		}
+		if (max_cycles && cycles >= max_cycles) {
+			reason = RUN_STOP_CYCLE_BUDGET;
+			break;
+		}
+		if (steps > 0 && is_breakpoint_at(cpu_state.ip)) {
+			reason = RUN_STOP_BREAKPOINT;
+			break;
+		}
+
+		struct instruction inst;
+		if (max_cycles) {
+			// Clocks have to be estimated from the state before executing the instruction
+			u16 ip = cpu_state.ip;
+			if (decode_instruction_cached(&decode_cache_state, &memory_state, &ip, &inst) == DECODE_OK) {
+				cycles += get_total_clocks(estimate_executed_clocks(cpu_model, &inst, &cpu_state));
+			}
+		}
+		enum decode_error err = step_instruction(&inst);
+		if (err != DECODE_OK) {
+			reason = RUN_STOP_DECODE_ERROR;
+			break;
+		}
+		steps++;
 	}
+
+	update_packed_cpu_state();
+	packed_cpu_state.steps = steps;
+	packed_cpu_state.cycles = cycles;
+	return reason;
 }
 
-EXPORT void reset_cpu() {
+// 0 for the 8086, 1 for the 8088, see `enum cpu_model`
+EXPORT void set_cpu_model(u32 model) {
+	cpu_model = model == CPU_8088 ? CPU_8088 : CPU_8086;
+}
+
+// `run` stops once `ip` reaches this address
+EXPORT void set_program_end(u32 end) {
+	program_end = end;
+}
+
+EXPORT void set_breakpoint(u16 addr) {
+	breakpoints[addr / 8] |= (1 << (addr % 8));
+}
+
+EXPORT void clear_breakpoint(u16 addr) {
+	breakpoints[addr / 8] &= ~(1 << (addr % 8));
+}
+
+EXPORT void clear_all_breakpoints() {
+	memset(breakpoints, 0, sizeof(breakpoints));
+}
+
+EXPORT struct packed_cpu_state *get_packed_cpu_state_base() {
+	return &packed_cpu_state;
+}
+
+// State that `reset_cpu` goes back to, only the pages dirtied since then are copied back
+static struct snapshot reset_snapshot;
+static bool has_reset_snapshot = false;
+
+// Current memory with all registers cleared becomes the state `reset_cpu` returns to.
+// Call after loading a program.
+EXPORT void save_reset_state() {
 	memset(&cpu_state, 0, sizeof(cpu_state));
+	take_snapshot(&reset_snapshot, &memory_state, &cpu_state);
+	has_reset_snapshot = true;
+	update_packed_cpu_state();
+}
+
+EXPORT void reset_cpu() {
+	if (has_reset_snapshot) {
+		restore_snapshot(&reset_snapshot, &memory_state, &cpu_state);
+	} else {
+		memset(&cpu_state, 0, sizeof(cpu_state));
+	}
+	if (journal_enabled) {
+		journal_clear(&journal);
+	}
+	update_packed_cpu_state();
+}
+
+/* -------------------- Reverse execution ----------------------- */
+
+// Starts recording every step into a ring of `ring_size` bytes (a few bytes per instruction), with a full
+// checkpoint of memory every `checkpoint_interval` steps. Returns 0 on success, -1 if out of memory.
+EXPORT int enable_journal(u32 ring_size, u32 checkpoint_count, u32 checkpoint_interval) {
+	if (journal_enabled) {
+		journal_free(&journal);
+		journal_enabled = false;
+	}
+	if (journal_init(&journal, ring_size, checkpoint_count, checkpoint_interval)) {
+		return -1;
+	}
+	journal_enabled = true;
+	return 0;
+}
+
+EXPORT void disable_journal() {
+	if (journal_enabled) {
+		journal_free(&journal);
+		journal_enabled = false;
+	}
+}
+
+// Returns how many steps it actually went back, it can be less if the journal doesn't reach that far
+EXPORT u32 step_back(u32 count) {
+	u32 steps = 0;
+	if (journal_enabled) {
+		steps = journal_step_back(&journal, &memory_state, &cpu_state, count);
+	}
+	update_packed_cpu_state();
+	return steps;
+}
+
+// Goes back to the last instruction that wrote to `addr`. Returns false if the journal has no such write.
+EXPORT bool run_back_to_write(u16 addr) {
+	bool found = false;
+	if (journal_enabled) {
+		found = journal_run_back_to_write(&journal, &memory_state, &cpu_state, addr);
+	}
+	update_packed_cpu_state();
+	return found;
+}
+
+/* -------------------- Parameter sweeps ----------------------- */
+
+// Result of one lane of `run_sweep`, read by JS through `get_sweep_results_base`
+struct sweep_result {
+    u16 regs[8]; // Same order as `cpu_state.regs`
+    u16 ip;
+    u16 flags;
+    u32 status;  // `enum lockstep_lane_status`
+    u32 steps;
+    u32 clocks;  // Estimated for the model set by `set_cpu_model`, only valid if `has_clocks`
+    u32 has_clocks;
+};
+_Static_assert(sizeof(struct sweep_result) == 36, "layout is also in api.js");
+
+static struct lockstep sweep_lockstep;
+static struct memory sweep_mems[LOCKSTEP_LANES];
+static struct sweep_result sweep_results[LOCKSTEP_LANES];
+
+EXPORT u32 get_lockstep_lanes() {
+	return LOCKSTEP_LANES;
+}
+
+// Runs copies of the current state on the lockstep engine, in lane `i` register `reg` (index into
+// `cpu_state.regs`) starts as `first + i*stride`. Memory and registers of the current state are left as they are.
+// Returns how many lanes ran, at most `get_lockstep_lanes`.
+EXPORT u32 run_sweep(u32 reg, u16 first, u16 stride, u32 lane_count, u32 max_steps) {
+	if (lane_count > LOCKSTEP_LANES) lane_count = LOCKSTEP_LANES;
+	if (reg >= 8) return 0;
+
+	struct lockstep *ls = &sweep_lockstep;
+	ls->lane_count = lane_count;
+	ls->model = cpu_model;
+	for (u32 lane = 0; lane < lane_count; lane++) {
+		struct memory *mem = &sweep_mems[lane];
+		memcpy(mem->mem, memory_state.mem, MEMORY_SIZE);
+		mem->decode_cache = NULL;
+		mem->write_log = NULL;
+		ls->mems[lane] = mem;
+
+		struct cpu_state cpu = cpu_state;
+		cpu.regs[reg] = first + lane * stride;
+		lockstep_set_lane(ls, lane, &cpu);
+	}
+
+	u16 end_ip = program_end < MEMORY_SIZE ? program_end : MEMORY_SIZE - 1; // `run_lockstep` takes a 16bit address
+	run_lockstep(ls, end_ip, max_steps ? max_steps : UINT64_MAX);
+
+	for (u32 lane = 0; lane < lane_count; lane++) {
+		struct cpu_state cpu;
+		lockstep_get_lane(ls, lane, &cpu);
+		struct sweep_result *result = &sweep_results[lane];
+		memcpy(result->regs, cpu.regs, sizeof(result->regs));
+		result->ip = cpu.ip;
+		result->flags = get_cpu_flags(&cpu);
+		result->status = ls->status[lane];
+		result->steps = ls->steps[lane];
+		result->clocks = ls->clocks[lane];
+		result->has_clocks = ls->has_clocks[lane];
+	}
+	return lane_count;
+}
+
+EXPORT struct sweep_result *get_sweep_results_base() {
+	return sweep_results;
 }
 
 /* -------------------- Decoder ----------------------- */
@@ -36,6 +285,14 @@ EXPORT u16 decode_inst_at(u16 addr, char *buff, size_t buff_size) {
 	}
 }
 
+EXPORT uint64_t get_decode_cache_hits() {
+    return decode_cache_state.hits;
+}
+
+EXPORT uint64_t get_decode_cache_misses() {
+    return decode_cache_state.misses;
+}
+
 /* -------------------- Memory ----------------------- */
 
 EXPORT int set_memory_state(u8 *buffer, u16 buffer_size, u16 start) {
@@ -50,33 +307,86 @@ EXPORT size_t get_memory_state_size() {
     return MEMORY_SIZE;
 }
 
+static struct memory_range dirty_ranges[MAX_DIRTY_RANGES];
+
+// Collects ranges of memory written since the last call into the array at `get_dirty_ranges_base`,
+// as (u32 start, u32 size) pairs. Returns how many ranges there are.
+EXPORT u32 take_memory_dirty_ranges() {
+    return take_dirty_ranges(&memory_state, DIRTY_WEB, dirty_ranges);
+}
+
+EXPORT struct memory_range *get_dirty_ranges_base() {
+    return dirty_ranges;
+}
+
+/* -------------------- Assembler ----------------------- */
+
+static u8 assembled_program[MEMORY_SIZE];
+static char assemble_error[128];
+
+// Assembles NASM style source with the built-in assembler, see "sim8086/assembler.c".
+// The bytes are left at `get_assembled_program_base`. Returns their count, or -1 with the message at `get_assemble_error`.
+EXPORT int assemble_source(const char *source) {
+    struct assemble_result result = assemble(source, strlen(source), assembled_program, sizeof(assembled_program));
+    if (result.err != ASSEMBLE_OK) {
+        snprintf(assemble_error, sizeof(assemble_error), "Line %d: %s", result.line, assemble_error_to_str(result.err));
+        return -1;
+    }
+    return result.size;
+}
+
+EXPORT u8 *get_assembled_program_base() {
+    return assembled_program;
+}
+
+EXPORT const char *get_assemble_error() {
+    return assemble_error;
+}
+
 /* -------------------- CPU ----------------------- */
 
 EXPORT void cpu_reset()
 {
-    memset(&cpu_state, 0, sizeof(cpu_state));
+    reset_cpu();
 }
 
-#define CPU_STATE_GETTER(field) EXPORT u16 cpu_get_##field() { return cpu_state.field; }
-#define CPU_STATE_SETTER(field) EXPORT void cpu_set_##field(u16 value) { cpu_state.field = value; }
-#define CPU_STATE_ACCESOR(field) CPU_STATE_SETTER(field) CPU_STATE_GETTER(field)
+// Registers are also readable all at once through `get_cpu_registers_base`, as 9 u16 values:
+// ax, cx, dx, bx, sp, bp, si, di, ip
+EXPORT u16 *get_cpu_registers_base() {
+    return cpu_state.regs;
+}
+
+#define CPU_STATE_GETTER(name, field) EXPORT u16 cpu_get_##name() { return cpu_state.field; }
+#define CPU_STATE_SETTER(name, field) EXPORT void cpu_set_##name(u16 value) { cpu_state.field = value; }
+#define CPU_STATE_ACCESOR(name, field) CPU_STATE_SETTER(name, field) CPU_STATE_GETTER(name, field)
+#define CPU_REG_ACCESOR(name, reg) CPU_STATE_ACCESOR(name, regs[REG16_INDEX(reg)])
+
+CPU_STATE_ACCESOR(ip, ip)
+CPU_REG_ACCESOR(ax, REG_AX)
+CPU_REG_ACCESOR(bx, REG_BX)
+CPU_REG_ACCESOR(cx, REG_CX)
+CPU_REG_ACCESOR(dx, REG_DX)
+CPU_REG_ACCESOR(sp, REG_SP)
+CPU_REG_ACCESOR(bp, REG_BP)
+CPU_REG_ACCESOR(si, REG_SI)
+CPU_REG_ACCESOR(di, REG_DI)
 
-CPU_STATE_ACCESOR(ip)
-CPU_STATE_ACCESOR(ax)
-CPU_STATE_ACCESOR(bx)
-CPU_STATE_ACCESOR(cx)
-CPU_STATE_ACCESOR(dx)
-CPU_STATE_ACCESOR(sp)
-CPU_STATE_ACCESOR(bp)
-CPU_STATE_ACCESOR(si)
-CPU_STATE_ACCESOR(di)
+EXPORT u16 cpu_get_flags()
+{
+    return get_cpu_flags(&cpu_state);
+}
+
+EXPORT void cpu_set_flags(u16 flags)
+{
+    set_cpu_flags(&cpu_state, flags);
+}
 
 EXPORT bool cpu_get_zero_flag()
 {
-    return cpu_state.flags.zero;
+    return get_zero_flag(&cpu_state);
 }
 
 EXPORT bool cpu_get_sign_flag()
 {
-    return cpu_state.flags.sign;
+    return get_sign_flag(&cpu_state);
 }
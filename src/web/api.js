@@ -1,11 +1,19 @@
 
+// Same order as `cpu_state.regs` followed by `cpu_state.ip`, see `get_cpu_registers_base`
+const registerNames = ["ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "ip"]
+const getCPURegistersBase = Module.cwrap("get_cpu_registers_base", "number", [])
+function getRegistersView() {
+	// View is recreated every time, because the wasm memory buffer can be replaced when it grows
+	return new Uint16Array(wasmMemory.buffer, getCPURegistersBase(), registerNames.length)
+}
+
 const registers = {}
-for (const reg of ["ax", "bx", "cx", "dx", "sp", "bp", "si", "di", "ip"]) {
+registerNames.forEach((reg, index) => {
 	registers[reg] = {
-		set: Module.cwrap(`cpu_set_${reg}`, null, ["number"]),
-		get: Module.cwrap(`cpu_get_${reg}`, "number", [])
+		set: (value) => { getRegistersView()[index] = value },
+		get: () => getRegistersView()[index]
 	}
-}
+})
 
 const decodeInstAt = Module.cwrap("decode_inst_at", null, ["number", "number", "number"])
 function getCurrentInstructionAt(address) {
@@ -34,5 +42,98 @@ function getMemory() {
 	return new Uint8Array(wasmMemory.buffer, getMemoryBaseAddress(), getMemorySize())
 }
 
+// Built-in assembler, returns the program bytes or throws with the error message
+const assembleSourceNative = Module.cwrap("assemble_source", "number", ["string"])
+const getAssembledProgramBase = Module.cwrap("get_assembled_program_base", "number", [])
+const getAssembleError = Module.cwrap("get_assemble_error", "number", [])
+function assembleSource(source) {
+	const size = assembleSourceNative(source)
+	if (size < 0) {
+		throw new Error(Module.AsciiToString(getAssembleError()))
+	}
+	return new Uint8Array(wasmMemory.buffer, getAssembledProgramBase(), size).slice()
+}
+
+// Ranges of memory written since the last call, as [start, size] pairs.
+// The first call returns everything that was ever written.
+const takeMemoryDirtyRanges = Module.cwrap("take_memory_dirty_ranges", "number", [])
+const getDirtyRangesBase = Module.cwrap("get_dirty_ranges_base", "number", [])
+function getDirtyRanges() {
+	const count = takeMemoryDirtyRanges()
+	const view = new Uint32Array(wasmMemory.buffer, getDirtyRangesBase(), count * 2)
+	const ranges = []
+	for (let i = 0; i < count; i++) {
+		ranges.push([view[i * 2], view[i * 2 + 1]])
+	}
+	return ranges
+}
+
+// Resets registers, and memory back to how it was at the last `saveResetState`
 const resetCPU = Module.cwrap("reset_cpu", null, [])
+const saveResetState = Module.cwrap("save_reset_state", null, [])
 const stepCPU = Module.cwrap("step", null, [])
+
+// Same order as `enum run_stop_reason`
+const runStopReasons = ["halt", "step budget", "cycle budget", "breakpoint", "decode error"]
+const runCPUNative = Module.cwrap("run", "number", ["number", "number"])
+function runCPU(maxSteps, maxCycles = 0) {
+	return runStopReasons[runCPUNative(maxSteps, maxCycles)]
+}
+
+const setProgramEnd = Module.cwrap("set_program_end", null, ["number"])
+// Used for the cycle budget of `runCPU`, "8086" or "8088"
+const setCPUModelNative = Module.cwrap("set_cpu_model", null, ["number"])
+function setCPUModel(name) {
+	setCPUModelNative(name === "8088" ? 1 : 0)
+}
+const setBreakpoint = Module.cwrap("set_breakpoint", null, ["number"])
+const clearBreakpoint = Module.cwrap("clear_breakpoint", null, ["number"])
+const clearAllBreakpoints = Module.cwrap("clear_all_breakpoints", null, [])
+
+// Reverse execution, `stepCPU` and `runCPU` only record history after `enableJournal`
+const enableJournalNative = Module.cwrap("enable_journal", "number", ["number", "number", "number"])
+function enableJournal(ringSize = 1 << 20, checkpointCount = 16, checkpointInterval = 100000) {
+	return enableJournalNative(ringSize, checkpointCount, checkpointInterval) === 0
+}
+const disableJournal = Module.cwrap("disable_journal", null, [])
+const stepBackCPU = Module.cwrap("step_back", "number", ["number"])
+const runBackToWrite = Module.cwrap("run_back_to_write", "boolean", ["number"])
+
+// Layout of `struct packed_cpu_state`, it is only refreshed by `stepCPU`, `runCPU`, `stepBackCPU`, `runBackToWrite` and `resetCPU`
+const getPackedCPUStateBase = Module.cwrap("get_packed_cpu_state_base", "number", [])
+function getPackedCPUState() {
+	const base = getPackedCPUStateBase()
+	const words = new Uint16Array(wasmMemory.buffer, base, 10)
+	const counters = new Uint32Array(wasmMemory.buffer, base + 20, 2)
+	const state = { flags: words[9], steps: counters[0], cycles: counters[1] }
+	registerNames.forEach((reg, index) => { state[reg] = words[index] })
+	return state
+}
+
+// Parameter sweeps on the lockstep engine, up to `getLockstepLanes()` copies of the current state at once.
+// In lane i `register` (a name from `registerNames`, not "ip") starts as `first + i*stride`.
+// The current state is not changed. Returns the end state of every lane, `clocks` is null if it can't be estimated.
+const getLockstepLanes = Module.cwrap("get_lockstep_lanes", "number", [])
+const runSweepNative = Module.cwrap("run_sweep", "number", ["number", "number", "number", "number", "number"])
+const getSweepResultsBase = Module.cwrap("get_sweep_results_base", "number", [])
+// Same order as `enum lockstep_lane_status`
+const sweepStatuses = ["running", "halt", "decode error", "step budget"]
+function runSweep(register, first, stride, laneCount, maxSteps = 0) {
+	const count = runSweepNative(registerNames.indexOf(register), first, stride, laneCount, maxSteps)
+	const base = getSweepResultsBase()
+	const results = []
+	for (let i = 0; i < count; i++) {
+		// Layout of `struct sweep_result`, 36 bytes
+		const words = new Uint16Array(wasmMemory.buffer, base + i * 36, 10)
+		const counters = new Uint32Array(wasmMemory.buffer, base + i * 36 + 20, 4)
+		const result = {
+			flags: words[9],
+			status: sweepStatuses[counters[0]],
+			steps: counters[1],
+			clocks: counters[3] ? counters[2] : null
+		}
+		registerNames.forEach((reg, index) => { result[reg] = words[index] })
+		results.push(result)
+	}
+	return results
+}